@@ -8,6 +8,10 @@ AR = $(CROSS_COMPILE)ar
 STRIP = $(CROSS_COMPILE)strip
 INSTALL ?= /usr/bin/install
 DEBUG ?= y
+# io_uring fd events backend (needs linux >= 5.19 headers)
+IO_URING ?= y
+# eBPF and AF_XDP support (needs linux >= 5.9 headers)
+EBPF ?= y
 
 # Kernel headers
 KERNEL_HEADERS := /kernel_headers
@@ -36,6 +40,14 @@ ifeq ($(DEBUG),y)
 CFLAGS += -g -DDEBUG
 endif
 
+ifeq ($(IO_URING),y)
+CFLAGS += -DCONFIG_IO_URING
+endif
+
+ifeq ($(EBPF),y)
+CFLAGS += -DCONFIG_EBPF
+endif
+
 CFLAGS += $(EXTRA_CFLAGS)
 LDFLAGS += $(EXTRA_LDFLAGS)
 
@@ -6,6 +6,7 @@
  * Author Davide Ciminaghi 2016
  */
 
+#define _GNU_SOURCE /* sendmmsg(), struct mmsghdr */
 
 #include <arpa/inet.h>
 #include <time.h>
@@ -24,11 +25,14 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <endian.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <libudev.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <linux/if.h>
 #include <linux/r2proc_ioctl.h>
-#include <linux/virtio_ring.h>
+#include <linux/net_tstamp.h>
 #include "logger.h"
 #include <net/ethernet.h> /* ETHER_ADDR_LEN */
 #include "list.h"
@@ -37,6 +41,13 @@
 #include "lininoio-internal.h"
 #include "udev-events.h"
 #include "timeout.h"
+#include "mac-hash.h"
+#include "slab.h"
+#include "virtio.h"
+#ifdef CONFIG_EBPF
+#include "xsk.h"
+#include "ebpf.h"
+#endif
 
 #define DEFAULT_ALIVE_TIMEOUT 2000
 
@@ -45,6 +56,13 @@
 #define RVDEV_SHIFT 2
 #define MAX_RVDEVS_PER_RPROC (1 << RVDEV_SHIFT)
 
+/*
+ * Virtio drivers (console, rpmsg) receive on the first vring of their
+ * rvdev and transmit on the second one
+ */
+#define RVDEV_RX_VRING 0
+#define RVDEV_TX_VRING 1
+
 #ifndef FIRMWARE_PREFIX
 #define FIRMWARE_PREFIX ""
 #endif
@@ -57,23 +75,185 @@
 #define BACKEND_MEM_SIZE (1024*1024)
 #endif
 
+/* MTU used when the interface's one cannot be read */
+#define ETHER_DEFAULT_MTU ETH_DATA_LEN
+
+/* TPACKET_V3 rx ring geometry */
+#define RX_RING_BLOCK_SIZE (1 << 16)
+#define RX_RING_BLOCK_NR 16
+#define RX_RING_FRAME_SIZE 2048
+
+/* Max number of frames queued for transmission in a loop iteration */
+#define TX_BATCH 64
+
+/* TPACKET_V2 tx ring geometry */
+#define TX_RING_BLOCK_SIZE (1 << 16)
+#define TX_RING_BLOCK_NR 8
+/* Minimum frame size, frames grow (powers of 2) with the interface MTU */
+#define TX_RING_FRAME_SIZE 2048
+#define TX_RING_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+/* Nodes are allocated in slabs of NODES_PER_SLAB */
+#define NODES_PER_SLAB 64
+
+/* eBPF filter allowlist size when there's no max_nodes */
+#define EBPF_FILTER_MAX_NODES 65536
+
+/*
+ * Pacing: the rate of each node is adapted every PACE_ADAPT_INTERVAL ms,
+ * PACE_AI_STEPS additive increases take it from 0 to the max rate and a
+ * decrease cuts it by 1/4 (never below PACE_MIN_RATE, bytes/s). An idle
+ * node can send PACE_BURST frames back to back
+ */
+#define PACE_ADAPT_INTERVAL 100
+#define PACE_AI_STEPS 32
+#define PACE_MIN_RATE 2000
+#define PACE_BURST 2
+/* Queue building up: srtt more than twice the min one, plus this (ms) */
+#define PACE_RTT_SLACK 5
+/* Max frames waiting in a node's pacing queue */
+#define PACE_MAX_QUEUED 512
+/* SO_TXTIME: min time given to the qdisc before a departure, ns */
+#define PACE_TXTIME_LEAD 500000
+
 struct ether_data {
-	struct list_head free_nodes;
+	struct slab_cache node_cache;
+	/* Associated nodes, least recently seen first */
 	struct list_head nodes;
+	/* Expires when the least recently seen node times out */
+	struct timeout sweep_to;
+	/* Associated nodes, indexed by (mac, ifindex) */
+	struct mac_hash node_hash;
 	struct sockaddr_ll addr;
 	int bus_id;
 	int curr_dev;
 	int netif_fd;
+	/* Interface MTU (SIOCGIFMTU), max payload of rx and tx frames */
+	int mtu;
 	struct fd_event *rx_event;
+	/* Frames truncated by the rx ring, dropped */
+	unsigned long rx_truncated;
+	/* Frames the kernel failed to send, dropped */
+	unsigned long tx_dropped;
+	/* Frames refused to the senders (EAGAIN), the tx engine was full */
+	unsigned long tx_refused;
+	/* AF_XDP socket, NULL if unused. Used for both rx and tx */
+	struct xsk *xsk;
+	struct fd_event *xsk_event;
+	/* TPACKET_V3 rx ring, map is NULL if unused */
+	struct {
+		void *map;
+		unsigned int block_size;
+		unsigned int block_nr;
+		/* Next block to be processed */
+		unsigned int cur;
+	} rx_ring;
+	/*
+	 * Transmit engine: frames are gathered here and flushed all
+	 * together at the end of each loop iteration
+	 */
+	struct {
+		/* Number of frames waiting for flush */
+		unsigned int queued;
+		/*
+		 * The socket or ring was full at the last flush or reserve,
+		 * event waits for it to be writable again
+		 */
+		int blocked;
+		struct fd_event *event;
+		/* sendmmsg() batch is queued on the loop's io_uring instead */
+		int uring;
+		/* sendmmsg() batch, used when there's no tx ring */
+		struct mmsghdr msgs[TX_BATCH];
+		struct iovec iovs[TX_BATCH];
+		struct sockaddr_ll addrs[TX_BATCH];
+		/* TX_BATCH buffers of mtu bytes */
+		uint8_t *bufs;
+		/* PACKET_TX_RING, map is NULL if unused */
+		int ring_fd;
+		void *map;
+		unsigned int frame_size;
+		unsigned int frame_nr;
+		/* Next frame to be filled */
+		unsigned int head;
+		/* Nodes with an open bundle (lininoio_ether_node.bundle) */
+		struct list_head bundles;
+		/*
+		 * Backends whose vring drain stopped on EAGAIN (tx engine or
+		 * reliable backlog full), drained again before each flush
+		 */
+		struct list_head stalled;
+		/* SCM_TXTIME control messages, sendmmsg() only */
+		uint8_t cmsgs[TX_BATCH][CMSG_SPACE(sizeof(uint64_t))]
+			__attribute__((aligned(8)));
+	} tx;
+	/* Interface address, for frames built by hand (tx ring, xsk) */
+	uint8_t hwaddr[ETHER_ADDR_LEN];
+	/* eBPF rx filter and its allowlist of associated MACs, -1 if unused */
+	int filter_prog_fd;
+	int filter_map_fd;
+	/* Alive frames are counted by the eBPF filter, in filter_map_fd */
+	int alive_offload;
+	/* Capabilities offered to the nodes (LININOIO_CAP_*) */
+	uint8_t caps;
+	/* Max transmit rate to each node, bytes/s, 0 if not paced */
+	unsigned int pace_max_rate;
+	/*
+	 * Paced frames are queued with their departure time (SO_TXTIME,
+	 * CLOCK_TAI) and held by the qdisc (etf) instead of a timer
+	 */
+	int txtime;
+	/* VIRTIO_RING_F_* offered and used on the nodes' vrings */
+	uint32_t vring_features;
+};
+
+/* Startup of an rx thread, which then has its own loop and ether_data */
+struct ether_worker {
+	pthread_t thread;
+	const char *netif_name;
+	const struct lininoio_ether_config *cfg;
+	enum fd_events_backend backend;
+	sem_t ready;
+	int stat;
 };
 
 struct lininoio_ether_node {
 	struct lininoio_node node;
 	struct sockaddr_ll addr;
 	struct ether_data *ether_data;
+	/* Capabilities advertised by the node (LININOIO_CAP_*) */
+	uint8_t node_caps;
+	/*
+	 * Bundle being filled in a reserved tx frame, NULL if none. Sent
+	 * when full, when a non data packet is queued or on flush
+	 */
+	struct lininoio_bundle_packet *bundle;
+	size_t bundle_len;
+	struct list_head bundle_list;
+	/* Transmit pacing, rate is node.tx_rate */
+	struct {
+		/* Departure time of the next frame, ns (ether_pace_now()) */
+		uint64_t next;
+		/* Frames waiting for their departure time, timer pacer */
+		struct list_head queue;
+		unsigned int queued;
+		struct timeout to;
+		/* Last rate adaptation, ms, and reliable channels losses then */
+		uint64_t adapted;
+		unsigned long lost;
+		/* Min smoothed rtt seen on the reliable channels, ms */
+		unsigned int min_rtt;
+	} pace;
+};
+
+/* Frame waiting in a node's pacing queue */
+struct ether_paced_pkt {
+	struct list_head list;
+	size_t len;
+	uint8_t data[0];
 };
 
-struct virtio_backend {
+struct ether_virtio_backend {
 	char devname[PATH_MAX];
 	int fd;
 	struct fd_event *evt;
@@ -83,12 +263,98 @@ struct virtio_backend {
 	int vring_index;
 	struct lininoio_core *core;
 	struct lininoio_channel *channel;
+	/* Attached if the channel describes the vring (vr.vq != NULL) */
+	struct virtio_vring vr;
+	struct list_head list;
+	/* In ether_data.tx.stalled */
+	struct list_head stalled;
 };
 
 #define to_ether_node(n) container_of(n, struct lininoio_ether_node, node)
 
+static void ether_bundle_close(struct lininoio_ether_node *en);
+
 static int opt_alive_timeout = DEFAULT_ALIVE_TIMEOUT;
 
+/* PACKET_FANOUT group id, rx threads only */
+static int fanout_id;
+
+/*
+ * Fanout program: hash of the source MAC address, so that a node always
+ * lands on the same rx thread. The kernel takes the result modulo the
+ * number of sockets in the group
+ */
+static struct sock_filter fanout_prog[] = {
+	/* X = source address bytes 2..5 */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + 8),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	/* A = source address bytes 0..1 */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_LL_OFF + 6),
+	BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/*
+ * Rx socket filter, drops malformed frames and unknown packet types in the
+ * kernel. Offsets are relative to the lininoio packet (SOCK_DGRAM socket)
+ */
+static struct sock_filter rx_filter[] = {
+	/* 0: drop empty frames */
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 32, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		 offsetof(struct lininoio_packet, type)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LININOIO_PACKET_DATA, 0, 10),
+	/* 4: data, A = header + payload length (cdlen is little endian) */
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+		 sizeof(struct lininoio_data_packet), 0, 28),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		 offsetof(struct lininoio_data_packet, cdlen) + 1),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0f),
+	BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		 offsetof(struct lininoio_data_packet, cdlen)),
+	BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+		 sizeof(struct lininoio_data_packet)),
+	BPF_STMT(BPF_JMP | BPF_JA, 16),
+	/* 14: association request, A = header + channel descriptors length */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LININOIO_PACKET_AREQUEST, 0, 7),
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+		 sizeof(struct lininoio_arequest_packet), 0, 17),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		 offsetof(struct lininoio_arequest_packet, nchannels)),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, LININOIO_MAX_NCHANNELS, 15, 0),
+	BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 1),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+		 sizeof(struct lininoio_arequest_packet)),
+	BPF_STMT(BPF_JMP | BPF_JA, 8),
+	/*
+	 * 22: bundle, fragment and reliable data, A = header length (records,
+	 * fragment and data length are checked by etherd)
+	 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LININOIO_PACKET_BUNDLE, 0, 2),
+	BPF_STMT(BPF_LD | BPF_IMM, sizeof(struct lininoio_bundle_packet)),
+	BPF_STMT(BPF_JMP | BPF_JA, 5),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LININOIO_PACKET_FRAG, 0, 2),
+	BPF_STMT(BPF_LD | BPF_IMM, sizeof(struct lininoio_frag_packet)),
+	BPF_STMT(BPF_JMP | BPF_JA, 2),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, LININOIO_PACKET_RDATA, 0, 5),
+	BPF_STMT(BPF_LD | BPF_IMM, sizeof(struct lininoio_rdata_packet)),
+	/* 30: accept if the frame is at least A bytes long */
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_X, 0, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	/* 34: drop */
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
 static void start_cb(void *_cb_data)
 {
 	struct lininoio_core *c = _cb_data;
@@ -118,26 +384,45 @@ static void stop_cb(void *_cb_data)
 }
 
 static inline int _assign_fd_evt(int fd, fd_event_cb cb,
-				 struct lininoio_core *c)
+				 struct lininoio_core *c,
+				 struct fd_event **evt)
 {
 	if (fd < 0 || !cb || !c)
 		return -1;
-	return add_fd_event(fd, EVT_FD_RD, cb, c) ? fd : -1;
+	*evt = add_fd_event(fd, EVT_FD_RD, cb, c);
+	if (!*evt) {
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 	
-/* Better way to do this ? Probably ... */
-static struct lininoio_node *mac_to_node(struct ether_data *data,
-					 const uint8_t *mac)
+/* vdev resource in the @len bytes at @r, NULL if there's none */
+static struct fw_rsc_vdev *rsc_vdev(struct fw_rsc_hdr *r, int len)
 {
-	struct lininoio_node *n;
+	if (!r || len < sizeof(struct fw_rsc_hdr) + sizeof(struct fw_rsc_vdev)
+	    || r->type != RSC_VDEV)
+		return NULL;
+	return (struct fw_rsc_vdev *)r->data;
+}
 
-	list_for_each_entry(n, &data->nodes, list) {
-		struct lininoio_ether_node *en = to_ether_node(n);\
+/* vdev resource of channel @ch, NULL if it has none */
+static struct fw_rsc_vdev *channel_vdev(struct lininoio_channel *ch)
+{
+	if (!ch)
+		return NULL;
+	return rsc_vdev(ch->resources, ch->resources_len);
+}
 
-		if (!memcmp(en->addr.sll_addr, mac, sizeof(en->addr.sll_addr)))
-			return n;
-	}
-	return NULL;
+/*
+ * Ring features of the vrings of core @c. The guest's answer (gfeatures)
+ * goes to the kernel's copy of the resource table and can't be read from
+ * here, so they are only offered when the user says the other side takes
+ * them (lininoio_ether_config.vring_features), and then used
+ */
+static uint32_t core_vring_features(struct lininoio_core *c)
+{
+	return to_ether_node(c->node)->ether_data->vring_features;
 }
 
 static int setup_remoteproc_fw(struct lininoio_core *c, char *firmware_name)
@@ -147,6 +432,7 @@ static int setup_remoteproc_fw(struct lininoio_core *c, char *firmware_name)
 	struct r2p_simple_firmware *r2p_hdr;
 	struct resource_table *rt;
 	struct fw_rsc_hdr *r;
+	struct fw_rsc_vdev *vdev;
 	char firmware_path[PATH_MAX];
 	void *ptr;
 
@@ -207,6 +493,10 @@ static int setup_remoteproc_fw(struct lininoio_core *c, char *firmware_name)
 	list_for_each_entry(ch, &c->channels, list) {
 		rt->offset[i++] = (void *)r - (void *)rt;
 		memcpy(r, ch->resources, ch->resources_len);
+		/* Offer the ring features in the copy, not in the channel's */
+		vdev = rsc_vdev(r, ch->resources_len);
+		if (vdev)
+			vdev->dfeatures |= core_vring_features(c);
 		r = (void *)r + ch->resources_len;
 	}
 	r2p_hdr->len = (void *)r - (void *)rt;
@@ -216,27 +506,94 @@ static int setup_remoteproc_fw(struct lininoio_core *c, char *firmware_name)
 	return 0;
 }
 
+/* Send a chain the other side made available to the node */
+static int virtio_backend_xmit(void *_vbe, const struct iovec *iov,
+			       int iovcnt)
+{
+	struct ether_virtio_backend *vbe = _vbe;
+
+	if (lininoio_send_messagev(vbe->channel, vbe->core->node,
+				   iov, iovcnt) < 0) {
+		pr_debug("%s: %s: error sending: %s\n", __func__,
+			 vbe->devname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Buffers are gathered straight from the reserved memory into the transmit
+ * frames, and all go back in a single used ring update. If the transmit
+ * side is full, the chains left are retried at the end of the iteration
+ */
+static void virtio_backend_drain(struct ether_virtio_backend *vbe)
+{
+	struct ether_data *data = to_ether_node(vbe->core->node)->ether_data;
+
+	virtio_vring_drain(&vbe->vr, virtio_backend_xmit, vbe);
+	if (!vbe->vr.stalled)
+		list_del_init(&vbe->stalled);
+	else if (list_empty(&vbe->stalled))
+		list_add_tail(&vbe->stalled, &data->tx.stalled);
+}
+
 static void virtio_backend_readable(void *_vbe)
 {
-	struct virtio_backend *vbe = _vbe;
-	struct vring_desc *desc = vbe->vring_ptr;
-	unsigned long offset;
-	char *ptr;
+	struct ether_virtio_backend *vbe = _vbe;
 
 	pr_debug("%s is readable\n", vbe->devname);
-	/*
-	 * desc->addr contains a phy address, get the offset from the
-	 * beginning of the r2proc reserved memory (mmap is done starting from
-	 * there);
-	 */
-	offset = desc->addr - vbe->phy_offset;
-	ptr = vbe->vring_ptr + offset;
-	pr_debug("read --- %s\n", ptr);
-	/* GET BUFFER AND SEND IT TO THE OTHER END !!!! */
+	virtio_vring_ack(&vbe->vr);
+	if (!vbe->vr.vq)
+		return;
+	/* New receive buffers, for the data waiting for them first */
+	if (vbe->vring_index == RVDEV_RX_VRING) {
+		virtio_vring_rx_kick(&vbe->vr);
+		return;
+	}
+	virtio_backend_drain(vbe);
+}
+
+/*
+ * Attach to the backend's vring, as described by its channel's vdev
+ * resource
+ */
+static int virtio_backend_attach(struct ether_virtio_backend *vbe)
+{
+	struct lininoio_channel *ch = vbe->channel;
+	struct fw_rsc_vdev *vdev = channel_vdev(ch);
+	struct vring_alloc_info ring;
+
+	if (!vdev || vbe->vring_index >= vdev->num_of_vrings)
+		return 0;
+	ring.num_descs = vdev->vring[vbe->vring_index].num;
+	ring.align = vdev->vring[vbe->vring_index].align;
+	if (virtio_vring_init(&vbe->vr, vbe->fd, vbe->vring_ptr,
+			      BACKEND_MEM_SIZE, vbe->phy_offset, &ring,
+			      core_vring_features(vbe->core)) < 0)
+		return -1;
+	/* Data from the node goes to the host's receive buffers */
+	if (vbe->vring_index == RVDEV_RX_VRING)
+		ch->rx_vring = &vbe->vr;
+	return 0;
+}
+
+static void virtio_backend_detach(struct ether_virtio_backend *vbe)
+{
+	struct virtio_vring *vr = &vbe->vr;
+
+	if (vbe->channel && vbe->channel->rx_vring == vr)
+		vbe->channel->rx_vring = NULL;
+	if (vr->dropped || vr->rx_dropped || vr->rx_backlogged)
+		pr_info("%s: %lu chains dropped, %lu packets dropped, "
+			"%lu backlogged\n", vbe->devname, vr->dropped,
+			vr->rx_dropped, vr->rx_backlogged);
+	pr_debug("%s: %lu interrupts, %lu avoided\n", vbe->devname,
+		 vr->interrupts, vr->interrupts_avoided);
+	virtio_vring_release(vr);
 }
 
 /* Match a backend with the relevant channel */
-static void match_backend(struct virtio_backend *vbe)
+static void match_backend(struct ether_virtio_backend *vbe)
 {
 	int rvdev_index;
 	struct lininoio_node *n = vbe->core->node;
@@ -249,12 +606,12 @@ static void match_backend(struct virtio_backend *vbe)
 	vbe->channel = n->channels[rvdev_index];
 }
 
-static void virtio_backend_add(struct udev_device *dev,
-			       const char *path, void *priv)
+static void ether_virtio_backend_add(struct udev_device *dev,
+				     const char *path, void *priv)
 {
 	const char *basename = rindex(path, '/') + 1;
 	int fd;
-	struct virtio_backend *vbe;
+	struct ether_virtio_backend *vbe;
 	const char *offs;
 
 	if (!basename) {
@@ -266,6 +623,7 @@ static void virtio_backend_add(struct udev_device *dev,
 		pr_err("%s: malloc(): %s", __func__, strerror(errno));
 		return;
 	}
+	INIT_LIST_HEAD(&vbe->stalled);
 	offs = udev_device_get_sysattr_value(dev, "phy_offset");
 	if (!offs) {
 		pr_err("%s: could not find phy_offset attribute\n",
@@ -282,6 +640,8 @@ static void virtio_backend_add(struct udev_device *dev,
 		return;
 	}
 	vbe->fd = fd;
+	memset(&vbe->vr, 0, sizeof(vbe->vr));
+	vbe->vr.fd = fd;
 	vbe->evt = add_fd_event(vbe->fd, EVT_FD_RD, virtio_backend_readable,
 				vbe);
 	if (!vbe->evt) {
@@ -290,15 +650,20 @@ static void virtio_backend_add(struct udev_device *dev,
 		free(vbe);
 		return;
 	}
-	vbe->vring_ptr = mmap(NULL, BACKEND_MEM_SIZE, PROT_READ, MAP_SHARED,
-			      fd, 0);
+	/* The used ring is written */
+	vbe->vring_ptr = mmap(NULL, BACKEND_MEM_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fd, 0);
 	if (vbe->vring_ptr == MAP_FAILED)
 		pr_err("%s: mmap(): %s", __func__, strerror(errno));
 	pr_debug("%s: mapped vring (%s) to %p\n", __func__,
 		 vbe->devname, vbe->vring_ptr);
 	vbe->minor = minor(udev_device_get_devnum(dev));
 	vbe->core = priv;
+	list_add_tail(&vbe->list, &vbe->core->backends);
 	match_backend(vbe);
+	if (vbe->vring_ptr != MAP_FAILED && virtio_backend_attach(vbe) < 0)
+		pr_err("%s: %s: could not attach vring\n", __func__,
+		       vbe->devname);
 }
 
 static void setup_remoteproc(struct lininoio_core *c)
@@ -321,12 +686,14 @@ static void setup_remoteproc(struct lininoio_core *c)
 	strncpy((char *)c->pd.fw_name, firmware_name,
 		sizeof(c->pd.fw_name) - 1);
 	strncpy((char *)c->pd.name, c->rproc_name, sizeof(c->pd.name) - 1);
-	c->pd.start_fd = _assign_fd_evt(eventfd(0, 0), start_cb, c);
-	c->pd.stop_fd = _assign_fd_evt(eventfd(0, 0), stop_cb, c);
+	c->pd.start_fd = _assign_fd_evt(eventfd(0, 0), start_cb, c,
+					&c->start_evt);
+	c->pd.stop_fd = _assign_fd_evt(eventfd(0, 0), stop_cb, c,
+				       &c->stop_evt);
 	/* FIXME: calculate this ? */
 	c->pd.reserved_memsize = BACKEND_MEM_SIZE;
 	if (schedule_udev_event(udev_new_virtio_backend,
-				virtio_backend_add, c) < 0) {
+				ether_virtio_backend_add, c) < 0) {
 		pr_err("Error setting up udev event\n");
 		goto err2;
 	}
@@ -334,6 +701,7 @@ static void setup_remoteproc(struct lininoio_core *c)
 		pr_err("%s, ioctl(): %s\n", __func__, strerror(errno));
 		goto err2;
 	}
+	c->rproc_added = 1;
 	return;
 
 err2:
@@ -359,183 +727,1200 @@ static int setup_remoteprocs(struct lininoio_node *n)
 	return 0;
 }
 
+static void kill_fd_evt(int fd, struct fd_event *evt)
+{
+	if (evt)
+		cancel_fd_event(evt);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Kill remote processor related to core @c
+ */
+static void kill_remoteproc(struct lininoio_core *c)
+{
+	struct ether_virtio_backend *vbe, *tmp;
+	struct r2p_name name;
+	int fd;
+
+	cancel_udev_events(c);
+	list_for_each_entry_safe(vbe, tmp, &c->backends, list) {
+		cancel_fd_event(vbe->evt);
+		virtio_backend_detach(vbe);
+		if (vbe->vring_ptr != MAP_FAILED)
+			munmap(vbe->vring_ptr, BACKEND_MEM_SIZE);
+		close(vbe->fd);
+		list_del(&vbe->list);
+		list_del(&vbe->stalled);
+		free(vbe);
+	}
+	kill_fd_evt(c->pd.start_fd, c->start_evt);
+	kill_fd_evt(c->pd.stop_fd, c->stop_evt);
+	if (!c->rproc_added)
+		return;
+	fd = open(R2PROC_MISC_DEV, O_RDWR);
+	if (fd < 0) {
+		pr_err("%s, open(): %s\n", __func__, strerror(errno));
+		return;
+	}
+	memset(&name, 0, sizeof(name));
+	strncpy(name.name, c->rproc_name, sizeof(name.name) - 1);
+	if (ioctl(fd, R2P_REMOVE_PROC, &name) < 0)
+		pr_err("%s, ioctl(): %s\n", __func__, strerror(errno));
+	close(fd);
+}
+
 /*
  * Kill all remote processors related to node @n
  */
 static void kill_remoteprocs(struct lininoio_node *n)
 {
+	int i;
+
+	for (i = 0; i < LININOIO_MAX_NCORES; i++)
+		if (n->cores[i])
+			kill_remoteproc(n->cores[i]);
 }
 
+#ifdef CONFIG_EBPF
+/* Allowlist key: source MAC, zero padded */
+static void filter_key(uint8_t *key, const struct sockaddr_ll *addr)
+{
+	memset(key, 0, 8);
+	memcpy(key, addr->sll_addr, ETHER_ADDR_LEN);
+}
 
-/* This assumes timeout does not need to be canceled */
-static void kill_node(struct timeout *t, void *_node)
+static int filter_allow(struct ether_data *data,
+			const struct sockaddr_ll *addr)
 {
-	struct lininoio_node *node = _node;
-	struct lininoio_ether_node *en = to_ether_node(node);
-	struct ether_data *data = en->ether_data;
-	struct lininoio_channel *c;
-	int i;
+	uint8_t key[8];
+	uint64_t v = 0;
 
-	kill_remoteprocs(node);
-	for (i = 0; i < ARRAY_SIZE(node->channels); i++) {
-		c = node->channels[i];
-		if (!c)
-			break;
-		if (c->ops->disconnect)
-			c->ops->disconnect(c, node);
-		free(c);
+	if (data->filter_map_fd < 0)
+		return 0;
+	filter_key(key, addr);
+	if (ebpf_map_update(data->filter_map_fd, key, &v, BPF_ANY) < 0) {
+		pr_err("%s: ebpf_map_update: %s\n", __func__, strerror(errno));
+		return -1;
 	}
-	list_move(&node->list, &data->free_nodes);
+	return 0;
 }
 
-static struct lininoio_node *find_node(struct ether_data *data,
-				       const struct sockaddr_ll *from)
+static void filter_deny(struct ether_data *data,
+			const struct sockaddr_ll *addr)
 {
-	struct lininoio_node *ptr;
-	
-	list_for_each_entry(ptr, &data->nodes, list) {
-		if (!memcmp(from, &to_ether_node(ptr)->addr, sizeof(*from)))
-			return ptr;
+	uint8_t key[8];
+
+	if (data->filter_map_fd < 0)
+		return;
+	filter_key(key, addr);
+	ebpf_map_delete(data->filter_map_fd, key);
+}
+
+/*
+ * eBPF version of rx_filter[]: same checks, and data, bundle, fragment and
+ * reliable data frames are only accepted from source addresses in the
+ * allowlist. The allowlist value is the time (CLOCK_MONOTONIC ns) of the
+ * last alive frame: with cfg->alive_offload alive frames only update it and
+ * are dropped, the sweep reads it back (see node_alive_offloaded())
+ */
+static int setup_ebpf_filter(int fd, struct ether_data *data,
+			     const struct lininoio_ether_config *cfg)
+{
+	unsigned int max = cfg->max_nodes ? : EBPF_FILTER_MAX_NODES;
+	int map_fd, prog_fd;
+
+	map_fd = ebpf_map_create(BPF_MAP_TYPE_HASH, 8, sizeof(uint64_t), max);
+	if (map_fd < 0) {
+		pr_err("%s: ebpf_map_create: %s\n", __func__, strerror(errno));
+		return -1;
 	}
-	return NULL;
+	{
+		struct bpf_insn prog[] = {
+			/* r6 = skb, r7 = frame length */
+			BPF_MOV64_REG(BPF_REG_6, BPF_REG_1),
+			BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_6,
+				    offsetof(struct __sk_buff, len)),
+			BPF_JMP_IMM(BPF_JLT, BPF_REG_7,
+				    sizeof(struct lininoio_data_packet), 58),
+			/* 3: fp[-8] = first 3 bytes of the packet */
+			BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+			BPF_MOV64_IMM(BPF_REG_2, 0),
+			BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -8),
+			BPF_MOV64_IMM(BPF_REG_4,
+				      sizeof(struct lininoio_data_packet)),
+			BPF_MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET),
+			BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes_relative),
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 50),
+			BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10, -8),
+			BPF_JMP_IMM(BPF_JEQ, BPF_REG_2,
+				    LININOIO_PACKET_AREQUEST, 34),
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_2, LININOIO_PACKET_DATA, 49),
+			/* 14: data, r8 = payload length, header + payload must fit */
+			BPF_LDX_MEM(BPF_B, BPF_REG_3, BPF_REG_10, -6),
+			BPF_ALU64_IMM(BPF_AND, BPF_REG_3, 0x0f),
+			BPF_ALU64_IMM(BPF_LSH, BPF_REG_3, 8),
+			BPF_LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_10, -7),
+			BPF_ALU64_REG(BPF_OR, BPF_REG_3, BPF_REG_4),
+			BPF_MOV64_REG(BPF_REG_8, BPF_REG_3),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_3,
+				      sizeof(struct lininoio_data_packet)),
+			BPF_JMP_REG(BPF_JGT, BPF_REG_3, BPF_REG_7, 39),
+			/* 22: fp[-16] = source address, zero padded */
+			BPF_ST_MEM(BPF_DW, BPF_REG_10, -16, 0),
+			BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+			BPF_MOV64_IMM(BPF_REG_2,
+				      offsetof(struct ether_header, ether_shost)),
+			BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -16),
+			BPF_MOV64_IMM(BPF_REG_4, ETHER_ADDR_LEN),
+			BPF_MOV64_IMM(BPF_REG_5, BPF_HDR_START_MAC),
+			BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes_relative),
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 30),
+			BPF_LD_MAP_FD(BPF_REG_1, map_fd),
+			BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -16),
+			BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),
+			BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 24),
+			/* 37: alive frame, store its time and drop it (offload) */
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_8, 0, 7),
+			BPF_MOV64_IMM(BPF_REG_1, !!cfg->alive_offload),
+			BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 5),
+			BPF_MOV64_REG(BPF_REG_9, BPF_REG_0),
+			BPF_EMIT_CALL(BPF_FUNC_ktime_get_ns),
+			BPF_STX_MEM(BPF_DW, BPF_REG_9, BPF_REG_0, 0),
+			BPF_MOV64_IMM(BPF_REG_0, 0),
+			BPF_EXIT_INSN(),
+			/* 45: accept */
+			BPF_MOV64_REG(BPF_REG_0, BPF_REG_7),
+			BPF_EXIT_INSN(),
+			/* 47: association request, channel descriptors must fit */
+			BPF_JMP_IMM(BPF_JLT, BPF_REG_7,
+				    sizeof(struct lininoio_arequest_packet), 13),
+			BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+			BPF_MOV64_IMM(BPF_REG_2,
+				      offsetof(struct lininoio_arequest_packet,
+					       nchannels)),
+			BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -8),
+			BPF_MOV64_IMM(BPF_REG_4, 1),
+			BPF_MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET),
+			BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes_relative),
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 5),
+			BPF_LDX_MEM(BPF_B, BPF_REG_3, BPF_REG_10, -8),
+			BPF_JMP_IMM(BPF_JGT, BPF_REG_3, LININOIO_MAX_NCHANNELS, 3),
+			BPF_ALU64_IMM(BPF_LSH, BPF_REG_3, 1),
+			BPF_ALU64_IMM(BPF_ADD, BPF_REG_3,
+				      sizeof(struct lininoio_arequest_packet)),
+			BPF_JMP_REG(BPF_JLE, BPF_REG_3, BPF_REG_7, -16),
+			/* 61: drop */
+			BPF_MOV64_IMM(BPF_REG_0, 0),
+			BPF_EXIT_INSN(),
+			/*
+			 * 63: bundle, fragment and reliable data, r3 = header
+			 * length, only from the allowlist. r8 != 0: never an
+			 * alive frame
+			 */
+			BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, LININOIO_PACKET_BUNDLE,
+				    4),
+			BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, LININOIO_PACKET_FRAG,
+				    5),
+			BPF_JMP_IMM(BPF_JNE, BPF_REG_2, LININOIO_PACKET_RDATA,
+				    -5),
+			BPF_MOV64_IMM(BPF_REG_3,
+				      sizeof(struct lininoio_rdata_packet)),
+			BPF_JMP_IMM(BPF_JA, 0, 0, 3),
+			BPF_MOV64_IMM(BPF_REG_3,
+				      sizeof(struct lininoio_bundle_packet)),
+			BPF_JMP_IMM(BPF_JA, 0, 0, 1),
+			BPF_MOV64_IMM(BPF_REG_3,
+				      sizeof(struct lininoio_frag_packet)),
+			/* 71: the header must fit */
+			BPF_JMP_REG(BPF_JGT, BPF_REG_3, BPF_REG_7, -11),
+			BPF_MOV64_IMM(BPF_REG_8, 1),
+			BPF_JMP_IMM(BPF_JA, 0, 0, -52),
+		};
+
+		prog_fd = ebpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, prog,
+					 ARRAY_SIZE(prog));
+	}
+	if (prog_fd < 0) {
+		pr_err("%s: ebpf_prog_load: %s\n", __func__, strerror(errno));
+		close(map_fd);
+		return -1;
+	}
+	if (ebpf_socket_attach(prog_fd, fd) < 0) {
+		pr_err("%s: ebpf_socket_attach: %s\n", __func__,
+		       strerror(errno));
+		close(prog_fd);
+		close(map_fd);
+		return -1;
+	}
+	data->filter_prog_fd = prog_fd;
+	data->filter_map_fd = map_fd;
+	data->alive_offload = !!cfg->alive_offload;
+	return 0;
 }
 
-static struct lininoio_node *get_node(struct ether_data *data,
-				      const struct sockaddr_ll *from)
+/*
+ * Time (timeouts_now() ms) of the last alive frame counted by the kernel
+ * for node @en, 0 if none
+ */
+static uint64_t node_alive_offloaded(struct ether_data *data,
+				     struct lininoio_ether_node *en)
 {
-	struct lininoio_node *out = NULL;
-	struct lininoio_ether_node *en;
+	uint8_t key[8];
+	uint64_t v;
 
-	if (list_empty(&data->free_nodes))
-		return out;
-	out = list_first_entry(&data->free_nodes, struct lininoio_node, list);
-	out->name[0] = 0;
-	out->alive_to = NULL;
-	memset(out->cores, 0, sizeof(out->cores));
-	out->nchannels = 0;
-	out->ll_data = NULL;
-	out->send_packet = NULL;
-	memset(out->channels, 0, sizeof(out->channels));
-	list_move(&out->list, &data->nodes);
-	en = to_ether_node(out);
-	en->ether_data = data;
-	en->addr = *from;
-	return out;
+	if (!data->alive_offload)
+		return 0;
+	filter_key(key, &en->addr);
+	if (ebpf_map_lookup(data->filter_map_fd, key, &v) < 0)
+		return 0;
+	return v / 1000000;
+}
+#else
+static inline int filter_allow(struct ether_data *data,
+			       const struct sockaddr_ll *addr)
+{
+	return 0;
 }
 
-static int ether_send_areply(struct lininoio_node *node, int stat)
+static inline void filter_deny(struct ether_data *data,
+			       const struct sockaddr_ll *addr)
+{
+}
+
+static int setup_ebpf_filter(int fd, struct ether_data *data,
+			     const struct lininoio_ether_config *cfg)
+{
+	pr_err("%s: built without CONFIG_EBPF\n", __func__);
+	return -1;
+}
+
+static inline uint64_t node_alive_offloaded(struct ether_data *data,
+					    struct lininoio_ether_node *en)
+{
+	return 0;
+}
+#endif
+
+/* Counters of node @node, logged when it goes away */
+static void log_node_stats(struct lininoio_node *node)
+{
+	struct lininoio_channel *c;
+	struct lininoio_rel_stats *s;
+	int i;
+
+	if (to_ether_node(node)->ether_data->pace_max_rate)
+		pr_info("%s: tx rate %u bytes/s\n", node->name, node->tx_rate);
+
+	for (i = 0; i < node->nchannels; i++) {
+		c = node->channels[i];
+		if (!c || !c->rel)
+			continue;
+		s = &c->rel_stats;
+		pr_info("%s: channel %u: %lu lost, %lu retransmits, "
+			"%lu reordered, %lu duplicates, %lu unreliable, "
+			"srtt %u ms\n", node->name, c->id, s->lost,
+			s->retransmits, s->reordered, s->duplicates,
+			s->unreliable, s->srtt);
+	}
+}
+
+static void kill_node(struct lininoio_node *node)
 {
-	int i, ret;
-	struct lininoio_areply_packet p = {
-		.type = htole32(LININOIO_PACKET_AREPLY),
-		.status = stat,
-	};
-	struct msghdr mhdr;
-	/* We need a vec for the packet header, then 1 vec for each channel */
-	struct iovec *vecs = malloc(sizeof(struct iovec) *
-				    (1 + node->nchannels));
 	struct lininoio_ether_node *en = to_ether_node(node);
 	struct ether_data *data = en->ether_data;
-	struct lininoio_channel *c;
+	struct lininoio_channel *c, *tmp;
+	struct ether_paced_pkt *pp, *pp_tmp;
+	struct lininoio_core *core;
+	int i;
 
-	if (!vecs) {
-		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
-		return -1;
+	log_node_stats(node);
+	if (en->bundle)
+		ether_bundle_close(en);
+	if (data->pace_max_rate) {
+		del_timeout(&en->pace.to);
+		list_for_each_entry_safe(pp, pp_tmp, &en->pace.queue, list)
+			free(pp);
 	}
-	mhdr.msg_name = &en->addr;
-	mhdr.msg_namelen = sizeof(en->addr);
-	mhdr.msg_iov = vecs;
-	mhdr.msg_iovlen = 1 + node->nchannels;
-	mhdr.msg_control = NULL;
-	mhdr.msg_controllen = 0;
-	mhdr.msg_flags = 0;
-	i = 0;
-	vecs[i].iov_base = &p;
-	vecs[i++].iov_len = sizeof(p);
-	printf("pippo stat = %d\n", stat);
-	for (c = node->channels[i - 1]; c; i++) {
-		vecs[i].iov_base = c->adata;
-		vecs[i++].iov_len =
-			lininoio_decode_cdlen(c->adata->chan_dlen, NULL) +
-			sizeof(c->adata->chan_dlen);
-		printf("pluto i = %d\n", i);
+	kill_remoteprocs(node);
+	for (i = 0; i < LININOIO_MAX_NCORES; i++) {
+		core = node->cores[i];
+		if (!core)
+			continue;
+		list_for_each_entry_safe(c, tmp, &core->channels, list) {
+			if (c->ops && c->ops->disconnect)
+				c->ops->disconnect(c, node);
+			lininoio_reasm_release(c);
+			lininoio_rel_release(c);
+			list_del(&c->list);
+			free(c);
+		}
+		free(core);
 	}
-	ret = sendmsg(data->netif_fd, &mhdr, 0);
-	free(vecs);
-	return ret;
+	mac_hash_del(&data->node_hash, en->addr.sll_addr, en->addr.sll_ifindex);
+	filter_deny(data, &en->addr);
+	list_del(&node->list);
+	slab_free(&data->node_cache, en);
 }
 
-static struct lininoio_core *get_core(struct lininoio_node *n,
-				      int core_id)
+/* Node @n has just been seen, move it to the tail of the LRU list */
+static inline void node_seen(struct lininoio_node *n, struct ether_data *data)
 {
-	struct lininoio_core *core = n->cores[core_id];
-	
-	if (core)
-		return core;
-	core = malloc(sizeof(*core));
-	if (!core) {
-		pr_err("allocating new core: %s\n", strerror(errno));
-		return core;
-	}
-	core->nchannels = 0;
-	INIT_LIST_HEAD(&core->channels);
-	core->node = n;
-	snprintf(core->rproc_name, sizeof(core->rproc_name) - 1, "%s-%d",
-		 n->name, core_id);
-	n->cores[core_id] = core;
-	return core;
+	n->last_seen = timeouts_now();
+	list_move_tail(&n->list, &data->nodes);
 }
 
-static struct lininoio_channel *new_channel(struct lininoio_node *n,
-					    int chan_id,
-					    uint16_t cdescr)
+/*
+ * Node @n was last seen at @t, which can be older than other nodes' time:
+ * keep the LRU list sorted
+ */
+static void node_seen_at(struct lininoio_node *n, struct ether_data *data,
+			 uint64_t t)
 {
-	uint8_t core_id = lininoio_cdescr_to_core_id(cdescr);
-	struct lininoio_core *core;
-	struct lininoio_channel *out = NULL;
+	struct lininoio_node *p;
 
-	core = get_core(n, core_id);
-	if (!core)
-		return out;
-	out = malloc(sizeof(*out));
-	if (!out) {
-		pr_err("allocating new channel: %s\n", strerror(errno));
-		return out;
-	}
-	list_add_tail(&out->list, &core->channels);
-	core->nchannels++;
-	return out;
+	n->last_seen = t;
+	list_del(&n->list);
+	list_for_each_entry_reverse(p, &data->nodes, list)
+		if (p->last_seen <= t)
+			break;
+	list_add(&n->list, &p->list);
 }
 
-static void ether_rx_arequest(const struct sockaddr_ll *from,
-			      const struct lininoio_arequest_packet *packet,
-			      int len, struct ether_data *data)
+/* Arm the sweep timeout for the least recently seen node */
+static void arm_sweep(struct ether_data *data)
 {
 	struct lininoio_node *n;
-	int i, stat;
+	uint64_t now = timeouts_now(), deadline;
 
-	if (packet->nchannels > LININOIO_MAX_NCHANNELS) {
-		pr_err("%s: new node with invalid number of channels\n",
-		       __func__);
+	if (list_empty(&data->nodes))
 		return;
+	n = list_first_entry(&data->nodes, struct lininoio_node, list);
+	deadline = n->last_seen + opt_alive_timeout;
+	mod_timeout(&data->sweep_to, deadline > now ? deadline - now : 0);
+}
+
+/* Kill all the nodes which have been silent for too long */
+static void sweep_nodes(struct timeout *t, void *_data)
+{
+	struct ether_data *data = _data;
+	struct lininoio_node *n, *tmp;
+	uint64_t now = timeouts_now(), seen;
+
+	list_for_each_entry_safe(n, tmp, &data->nodes, list) {
+		if (now - n->last_seen < opt_alive_timeout)
+			break;
+		/* Alive frames might have been counted by the kernel */
+		seen = node_alive_offloaded(data, to_ether_node(n));
+		if (seen > n->last_seen && seen + opt_alive_timeout > now) {
+			node_seen_at(n, data, seen);
+			continue;
+		}
+		pr_info("%s: node %s timed out\n", __func__, n->name);
+		kill_node(n);
 	}
-	n = find_node(data, from);
-	if (n) {
-		pr_err("%s: association request from an already associated node\n", __func__);
-		/* FIXME: SEND POSITIVE AREPLY AND DO NOTHING ELSE */
-		ether_send_areply(n, 0);
+	arm_sweep(data);
+}
+
+/* Count a frame the kernel refused, complain about the first one only */
+static void ether_tx_dropped(struct ether_data *data, int err)
+{
+	if (!data->tx_dropped++)
+		pr_warn("%s: %s, frame dropped\n", __func__, strerror(err));
+}
+
+static void ether_tx_flush(void *_data);
+
+/* The tx fd is writable again: retry, then let senders in again */
+static void ether_tx_writable(void *_data)
+{
+	struct ether_data *data = _data;
+
+	data->tx.blocked = 0;
+	ether_tx_flush(data);
+	if (data->tx.blocked)
 		return;
-	}
-	
-	/* Create new node and add it to list */
-	n = get_node(data, from);
-	if (!n) {
-		pr_err("%s: no more free nodes\n", __func__);
-		/* Silently ignore the request */
+	cancel_fd_event(data->tx.event);
+	data->tx.event = NULL;
+}
+
+/*
+ * The socket or ring is full: frames are kept (or refused) until it is
+ * writable again. Flushes at the end of loop iterations keep retrying too
+ */
+static void ether_tx_block(struct ether_data *data)
+{
+	int fd = data->netif_fd;
+
+	data->tx.blocked = 1;
+	if (data->tx.event)
 		return;
-	}
-	n->nchannels = packet->nchannels;
-	n->alive_to = schedule_timeout(opt_alive_timeout, kill_node, n);
+	if (data->xsk)
+		fd = data->xsk->fd;
+	else if (data->tx.map)
+		fd = data->tx.ring_fd;
+	data->tx.event = add_fd_event(fd, EVT_FD_WR, ether_tx_writable, data);
+	if (!data->tx.event)
+		pr_err("%s: error in add_fd_event\n", __func__);
+}
+
+/* Queue the batch from frame @first on the loop's io_uring */
+static int ether_tx_submit_uring(struct ether_data *data, unsigned int first)
+{
+	unsigned int i;
+
+	for (i = first; i < data->tx.queued; i++)
+		if (fd_event_sendmsg(data->netif_fd,
+				     &data->tx.msgs[i].msg_hdr) < 0)
+			break;
+	return i > first ? i - first : -1;
+}
+
+/* Frames before @done have gone, move the others to the batch's head */
+static void ether_tx_keep_mmsg(struct ether_data *data, unsigned int done)
+{
+	struct mmsghdr *m;
+	unsigned int i;
+
+	for (i = 0; done + i < data->tx.queued; i++) {
+		m = &data->tx.msgs[i];
+		*m = data->tx.msgs[done + i];
+		data->tx.addrs[i] = data->tx.addrs[done + i];
+		data->tx.iovs[i].iov_base = data->tx.bufs + i * data->mtu;
+		data->tx.iovs[i].iov_len = data->tx.iovs[done + i].iov_len;
+		memmove(data->tx.iovs[i].iov_base,
+			data->tx.iovs[done + i].iov_base,
+			data->tx.iovs[i].iov_len);
+		m->msg_hdr.msg_name = &data->tx.addrs[i];
+		m->msg_hdr.msg_iov = &data->tx.iovs[i];
+		if (m->msg_hdr.msg_control) {
+			memcpy(data->tx.cmsgs[i], data->tx.cmsgs[done + i],
+			       sizeof(data->tx.cmsgs[i]));
+			m->msg_hdr.msg_control = data->tx.cmsgs[i];
+		}
+	}
+	data->tx.queued = i;
+}
+
+/*
+ * Send the batch, with sendmmsg() or on the loop's io_uring (which waits
+ * for room in the socket itself). Frames left when the socket is full
+ * stay queued for the next flush
+ */
+static void ether_tx_flush_mmsg(struct ether_data *data)
+{
+	unsigned int done = 0;
+	int ret;
+
+	while (done < data->tx.queued) {
+		if (data->tx.uring)
+			ret = ether_tx_submit_uring(data, done);
+		else
+			ret = sendmmsg(data->netif_fd, &data->tx.msgs[done],
+				       data->tx.queued - done, MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				ether_tx_block(data);
+				break;
+			}
+			/* Drop the failing frame and go on with the others */
+			ether_tx_dropped(data, errno);
+			ret = 1;
+		}
+		done += ret;
+	}
+	ether_tx_keep_mmsg(data, done);
+}
+
+#ifdef CONFIG_EBPF
+static void ether_tx_flush_xsk(struct ether_data *data)
+{
+	xsk_tx_kick(data->xsk);
+}
+#else
+static inline void ether_tx_flush_xsk(struct ether_data *data)
+{
+}
+#endif
+
+static void ether_tx_flush(void *_data)
+{
+	struct ether_data *data = _data;
+
+	/* Open bundles hold reserved frames, commit them first */
+	while (!list_empty(&data->tx.bundles))
+		ether_bundle_close(list_first_entry(&data->tx.bundles,
+						    struct lininoio_ether_node,
+						    bundle_list));
+	if (!data->tx.queued)
+		return;
+	if (!data->xsk && !data->tx.map) {
+		/* Leaves the frames it couldn't send in the batch */
+		ether_tx_flush_mmsg(data);
+		return;
+	}
+	if (data->xsk)
+		ether_tx_flush_xsk(data);
+	/*
+	 * Kick the tx ring, all frames flagged for sending go out. Those
+	 * left when the socket is full stay in the ring for the next kick
+	 */
+	else if (sendto(data->tx.ring_fd, NULL, 0, MSG_DONTWAIT,
+			(struct sockaddr *)&data->addr,
+			sizeof(data->addr)) < 0) {
+		if (errno == EAGAIN)
+			ether_tx_block(data);
+		else
+			pr_err("%s: sendto: %s\n", __func__, strerror(errno));
+	}
+	data->tx.queued = 0;
+}
+
+/*
+ * End of a loop iteration: drain the vrings stalled on a full tx engine
+ * again (unless it still is), then flush
+ */
+static void ether_tx_post(void *_data)
+{
+	struct ether_data *data = _data;
+	struct ether_virtio_backend *vbe, *tmp;
+	LIST_HEAD(retry);
+
+	if (!data->tx.blocked) {
+		/* Backends stalling again go back to tx.stalled */
+		list_splice_init(&data->tx.stalled, &retry);
+		list_for_each_entry_safe(vbe, tmp, &retry, stalled) {
+			list_del_init(&vbe->stalled);
+			virtio_backend_drain(vbe);
+		}
+	}
+	ether_tx_flush(data);
+}
+
+/* Gather @iov into @dst, skipping its first @skip bytes */
+static uint8_t *ether_tx_gather(uint8_t *dst, const struct iovec *iov,
+				int iovcnt, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(dst, iov[i].iov_base + skip, iov[i].iov_len - skip);
+		dst += iov[i].iov_len - skip;
+		skip = 0;
+	}
+	return dst;
+}
+
+static size_t ether_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* Write the ethernet header for @to in @buf, returns the payload */
+static void *ether_tx_header(struct ether_data *data, void *buf,
+			     const struct sockaddr_ll *to)
+{
+	struct ether_header *eh = buf;
+
+	memcpy(eh->ether_dhost, to->sll_addr, ETHER_ADDR_LEN);
+	memcpy(eh->ether_shost, data->hwaddr, ETHER_ADDR_LEN);
+	eh->ether_type = htons(LININOIO_ETH_TYPE);
+	return eh + 1;
+}
+
+#ifdef CONFIG_EBPF
+static void *ether_tx_reserve_xsk(struct ether_data *data,
+				  const struct sockaddr_ll *to)
+{
+	void *buf = xsk_tx_reserve(data->xsk);
+
+	if (!buf) {
+		/* No free frames, push pending ones and try again later */
+		ether_tx_flush(data);
+		ether_tx_block(data);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return ether_tx_header(data, buf, to);
+}
+
+static void ether_tx_commit_xsk(struct ether_data *data, void *p, size_t len)
+{
+	xsk_tx_submit(data->xsk, p - ETH_HLEN, ETH_HLEN + len);
+}
+#else
+static inline void *ether_tx_reserve_xsk(struct ether_data *data,
+					 const struct sockaddr_ll *to)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+static inline void ether_tx_commit_xsk(struct ether_data *data, void *p,
+				       size_t len)
+{
+}
+#endif
+
+static void *ether_tx_reserve_ring(struct ether_data *data,
+				   const struct sockaddr_ll *to)
+{
+	struct tpacket2_hdr *h;
+
+	h = data->tx.map + data->tx.head * data->tx.frame_size;
+	if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) !=
+	    TP_STATUS_AVAILABLE) {
+		/* Ring is full, push pending frames and try again later */
+		ether_tx_flush(data);
+		ether_tx_block(data);
+		errno = EAGAIN;
+		return NULL;
+	}
+	data->tx.head = (data->tx.head + 1) % data->tx.frame_nr;
+	return ether_tx_header(data, (void *)h + TX_RING_DATA_OFFSET, to);
+}
+
+static void ether_tx_commit_ring(struct ether_data *data, void *p, size_t len)
+{
+	struct tpacket2_hdr *h = p - ETH_HLEN - TX_RING_DATA_OFFSET;
+
+	h->tp_len = ETH_HLEN + len;
+	__atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST,
+			 __ATOMIC_RELEASE);
+}
+
+static void *ether_tx_reserve_mmsg(struct ether_data *data,
+				   const struct sockaddr_ll *to)
+{
+	unsigned int n = data->tx.queued;
+
+	/* Batch still full of frames the socket didn't take */
+	if (n == TX_BATCH) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	data->tx.addrs[n] = *to;
+	return data->tx.bufs + n * data->mtu;
+}
+
+static void ether_tx_commit_mmsg(struct ether_data *data, void *p, size_t len)
+{
+	unsigned int n = (p - (void *)data->tx.bufs) / data->mtu;
+	struct mmsghdr *m = &data->tx.msgs[n];
+
+	data->tx.iovs[n].iov_base = p;
+	data->tx.iovs[n].iov_len = len;
+	memset(m, 0, sizeof(*m));
+	m->msg_hdr.msg_name = &data->tx.addrs[n];
+	m->msg_hdr.msg_namelen = sizeof(data->tx.addrs[n]);
+	m->msg_hdr.msg_iov = &data->tx.iovs[n];
+	m->msg_hdr.msg_iovlen = 1;
+}
+
+/* Committed frame @p (sendmmsg() only) must leave at @txtime, ns */
+static void ether_tx_set_txtime(struct ether_data *data, void *p,
+				uint64_t txtime)
+{
+	unsigned int n = (p - (void *)data->tx.bufs) / data->mtu;
+	struct msghdr *h = &data->tx.msgs[n].msg_hdr;
+	struct cmsghdr *cm;
+
+	h->msg_control = data->tx.cmsgs[n];
+	h->msg_controllen = sizeof(data->tx.cmsgs[n]);
+	cm = CMSG_FIRSTHDR(h);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(txtime));
+	memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+}
+
+/*
+ * Reserve a frame for @to, returns its payload (up to data->mtu bytes) or
+ * NULL. The frame is sent after ether_tx_commit(), all the reserved frames
+ * must be committed before the engine is flushed
+ */
+static void *ether_tx_reserve(struct ether_data *data,
+			      const struct sockaddr_ll *to)
+{
+	void *p;
+
+	if (data->tx.queued == TX_BATCH)
+		ether_tx_flush(data);
+	if (data->xsk)
+		p = ether_tx_reserve_xsk(data, to);
+	else if (data->tx.map)
+		p = ether_tx_reserve_ring(data, to);
+	else
+		p = ether_tx_reserve_mmsg(data, to);
+	if (p)
+		data->tx.queued++;
+	else if (errno == EAGAIN && !data->tx_refused++)
+		pr_warn("%s: tx engine full, frame refused\n", __func__);
+	return p;
+}
+
+/* Frame @p (from ether_tx_reserve()) has @len bytes of payload */
+static void ether_tx_commit(struct ether_data *data, void *p, size_t len)
+{
+	if (data->xsk)
+		ether_tx_commit_xsk(data, p, len);
+	else if (data->tx.map)
+		ether_tx_commit_ring(data, p, len);
+	else
+		ether_tx_commit_mmsg(data, p, len);
+}
+
+/*
+ * Queue a frame for @to, data is copied so that the caller can reuse its
+ * buffers right away. A non zero @txtime is its departure time (SO_TXTIME
+ * clock, data->txtime only)
+ */
+static int __ether_tx_queue(struct ether_data *data,
+			    const struct sockaddr_ll *to,
+			    const struct iovec *iov, int iovcnt,
+			    uint64_t txtime)
+{
+	size_t len = ether_iov_len(iov, iovcnt);
+	void *p;
+
+	if (len > data->mtu) {
+		pr_err("%s: frame too long (%zu, mtu is %d)\n", __func__, len,
+		       data->mtu);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	p = ether_tx_reserve(data, to);
+	if (!p)
+		return -1;
+	ether_tx_gather(p, iov, iovcnt, 0);
+	ether_tx_commit(data, p, len);
+	if (txtime)
+		ether_tx_set_txtime(data, p, txtime);
+	return 0;
+}
+
+static inline int ether_tx_queue(struct ether_data *data,
+				 const struct sockaddr_ll *to,
+				 const struct iovec *iov, int iovcnt)
+{
+	return __ether_tx_queue(data, to, iov, iovcnt, 0);
+}
+
+/*
+ * Send the bundle of @en. A single record goes out as a plain data packet:
+ * same layout, minus nrecords
+ */
+static void ether_bundle_close(struct lininoio_ether_node *en)
+{
+	struct lininoio_bundle_packet *b = en->bundle;
+	size_t len = en->bundle_len;
+
+	if (b->nrecords == 1) {
+		b->type = LININOIO_PACKET_DATA;
+		memmove(&b->nrecords, b->records, len - sizeof(*b));
+		len--;
+	}
+	list_del(&en->bundle_list);
+	en->bundle = NULL;
+	ether_tx_commit(en->ether_data, b, len);
+}
+
+/*
+ * Append data packet @iov (@len bytes) to the bundle of @en, opening a new
+ * bundle when there's none or the current one is full. Records are data
+ * packets without their type byte
+ */
+static int ether_bundle_add(struct lininoio_ether_node *en,
+			    const struct iovec *iov, int iovcnt, size_t len)
+{
+	struct ether_data *data = en->ether_data;
+	struct lininoio_bundle_packet *b = en->bundle;
+	size_t rlen = len - sizeof(b->type);
+
+	if (b && (en->bundle_len + rlen > data->mtu ||
+		  b->nrecords == LININOIO_BUNDLE_MAX_RECORDS))
+		ether_bundle_close(en);
+	if (!en->bundle) {
+		if (sizeof(*b) + rlen > data->mtu)
+			return ether_tx_queue(data, &en->addr, iov, iovcnt);
+		b = ether_tx_reserve(data, &en->addr);
+		if (!b)
+			return -1;
+		b->type = LININOIO_PACKET_BUNDLE;
+		b->nrecords = 0;
+		en->bundle = b;
+		en->bundle_len = sizeof(*b);
+		list_add_tail(&en->bundle_list, &data->tx.bundles);
+	}
+	ether_tx_gather((uint8_t *)b + en->bundle_len, iov, iovcnt,
+			sizeof(b->type));
+	en->bundle_len += rlen;
+	b->nrecords++;
+	return 0;
+}
+
+/* Packet @iov (@len bytes) to @en, bundled if possible */
+static int ether_xmit_packet(struct lininoio_ether_node *en,
+			     const struct iovec *iov, int iovcnt, size_t len)
+{
+	const struct lininoio_packet *p = iov[0].iov_base;
+
+	if ((en->node.caps & LININOIO_CAP_BUNDLE) && iov[0].iov_len &&
+	    p->type == LININOIO_PACKET_DATA &&
+	    len >= sizeof(struct lininoio_data_packet) &&
+	    len <= en->ether_data->mtu)
+		return ether_bundle_add(en, iov, iovcnt, len);
+	/* Keep packets in order */
+	if (en->bundle)
+		ether_bundle_close(en);
+	return ether_tx_queue(en->ether_data, &en->addr, iov, iovcnt);
+}
+
+/* Pacing clock, ns. Same as the SO_TXTIME one when used */
+static uint64_t ether_pace_now(struct ether_data *data)
+{
+	struct timespec ts;
+
+	clock_gettime(data->txtime ? CLOCK_TAI : CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Time it takes to send @len bytes to @en, ns */
+static inline uint64_t ether_pace_cost(struct lininoio_ether_node *en,
+				       size_t len)
+{
+	return len * 1000000000ULL / en->node.tx_rate;
+}
+
+/*
+ * AIMD: cut the rate of @en when its reliable channels lose packets or
+ * their round trip time grows (queues building up in the access point),
+ * increase it otherwise. Nodes without reliable channels just go to the
+ * max rate
+ */
+static void ether_pace_adapt(struct lininoio_ether_node *en)
+{
+	struct lininoio_node *n = &en->node;
+	unsigned int max_rate = en->ether_data->pace_max_rate;
+	unsigned int rate = n->tx_rate, srtt = 0;
+	uint64_t now = timeouts_now();
+	struct lininoio_channel *c;
+	unsigned long lost = 0;
+	int i, congested;
+
+	if (now - en->pace.adapted < PACE_ADAPT_INTERVAL)
+		return;
+	en->pace.adapted = now;
+	for (i = 0; i < n->nchannels; i++) {
+		c = n->channels[i];
+		if (!c || !c->rel)
+			continue;
+		lost += c->rel_stats.lost;
+		srtt = max(srtt, c->rel_stats.srtt);
+	}
+	if (srtt && (!en->pace.min_rtt || srtt < en->pace.min_rtt))
+		en->pace.min_rtt = srtt;
+	congested = lost != en->pace.lost ||
+		srtt > 2 * en->pace.min_rtt + PACE_RTT_SLACK;
+	en->pace.lost = lost;
+	if (congested)
+		rate = max(rate - rate / 4,
+			   min((unsigned int)PACE_MIN_RATE, max_rate));
+	else
+		rate = min(rate + max_rate / PACE_AI_STEPS, max_rate);
+	/* Cuts and recoveries to the max rate, not every additive step */
+	if (rate < n->tx_rate || (rate == max_rate && rate != n->tx_rate))
+		pr_info("%s: tx rate %u bytes/s%s\n", n->name, rate,
+			congested ? " (congested)" : "");
+	else if (rate != n->tx_rate)
+		pr_debug("%s: %s: tx rate %u bytes/s\n", __func__, n->name,
+			 rate);
+	n->tx_rate = rate;
+}
+
+/* Send the frames of @en whose departure time has come */
+static void ether_pace_expired(struct timeout *t, void *_en)
+{
+	struct lininoio_ether_node *en = _en;
+	uint64_t now = ether_pace_now(en->ether_data);
+	struct ether_paced_pkt *pp;
+	struct iovec iov;
+
+	while (en->pace.queued && en->pace.next <= now) {
+		pp = list_first_entry(&en->pace.queue, struct ether_paced_pkt,
+				      list);
+		list_del(&pp->list);
+		en->pace.queued--;
+		en->pace.next += ether_pace_cost(en, pp->len);
+		iov.iov_base = pp->data;
+		iov.iov_len = pp->len;
+		if (ether_xmit_packet(en, &iov, 1, pp->len) < 0)
+			pr_debug("%s: %s: frame dropped\n", __func__,
+				 en->node.name);
+		free(pp);
+	}
+	if (en->pace.queued)
+		mod_timeout(t, max((en->pace.next - now + 999999) / 1000000,
+				   (uint64_t)1));
+}
+
+/*
+ * Paced transmission: frames leave @en at node.tx_rate. With SO_TXTIME
+ * they are queued right away with their departure time, otherwise the
+ * ones which cannot leave now wait in the node's pacing queue
+ */
+static int ether_pace_packet(struct lininoio_ether_node *en,
+			     const struct iovec *iov, int iovcnt, size_t len)
+{
+	struct ether_data *data = en->ether_data;
+	uint64_t now = ether_pace_now(data), burst, txtime;
+	struct ether_paced_pkt *pp;
+
+	ether_pace_adapt(en);
+	burst = ether_pace_cost(en, PACE_BURST * data->mtu);
+	if (en->pace.next + burst < now)
+		en->pace.next = now - burst;
+	if (data->txtime) {
+		txtime = max(en->pace.next, now + PACE_TXTIME_LEAD);
+		en->pace.next += ether_pace_cost(en, len);
+		return __ether_tx_queue(data, &en->addr, iov, iovcnt, txtime);
+	}
+	if (!en->pace.queued && en->pace.next <= now) {
+		en->pace.next += ether_pace_cost(en, len);
+		return ether_xmit_packet(en, iov, iovcnt, len);
+	}
+	if (len > data->mtu) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (en->pace.queued >= PACE_MAX_QUEUED) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	pp = malloc(sizeof(*pp) + len);
+	if (!pp)
+		return -1;
+	pp->len = len;
+	ether_tx_gather(pp->data, iov, iovcnt, 0);
+	list_add_tail(&pp->list, &en->pace.queue);
+	en->pace.queued++;
+	if (!timeout_pending(&en->pace.to))
+		mod_timeout(&en->pace.to,
+			    max((en->pace.next - now + 999999) / 1000000,
+				(uint64_t)1));
+	return 0;
+}
+
+static int ether_send_packet(struct lininoio_node *node,
+			     const struct iovec *iov, int iovcnt)
+{
+	struct lininoio_ether_node *en = to_ether_node(node);
+	size_t len = ether_iov_len(iov, iovcnt);
+
+	if (en->ether_data->pace_max_rate)
+		return ether_pace_packet(en, iov, iovcnt, len);
+	return ether_xmit_packet(en, iov, iovcnt, len);
+}
+
+static struct lininoio_node *find_node(struct ether_data *data,
+				       const struct sockaddr_ll *from)
+{
+	return mac_hash_find(&data->node_hash, from->sll_addr,
+			     from->sll_ifindex);
+}
+
+static struct lininoio_node *get_node(struct ether_data *data,
+				      const struct sockaddr_ll *from)
+{
+	struct lininoio_node *out;
+	struct lininoio_ether_node *en;
+
+	en = slab_alloc(&data->node_cache);
+	if (!en)
+		return NULL;
+	memset(en, 0, sizeof(*en));
+	out = &en->node;
+	if (mac_hash_add(&data->node_hash, from->sll_addr, from->sll_ifindex,
+			 out) < 0) {
+		slab_free(&data->node_cache, en);
+		return NULL;
+	}
+	if (filter_allow(data, from) < 0) {
+		mac_hash_del(&data->node_hash, from->sll_addr,
+			     from->sll_ifindex);
+		slab_free(&data->node_cache, en);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&out->list);
+	node_seen(out, data);
+	en->ether_data = data;
+	en->addr = *from;
+	out->max_dlen = min(data->mtu - (int)sizeof(struct lininoio_data_packet),
+			    LININOIO_MAX_DLEN);
+	out->send_packet = ether_send_packet;
+	if (data->pace_max_rate) {
+		out->tx_rate = data->pace_max_rate;
+		INIT_LIST_HEAD(&en->pace.queue);
+		init_timeout(&en->pace.to, ether_pace_expired, en);
+	}
+	return out;
+}
+
+static int ether_send_areply(struct lininoio_node *node, int stat)
+{
+	int i;
+	struct lininoio_areply_packet p = {
+		.type = LININOIO_PACKET_AREPLY,
+		.status = stat,
+	};
+	/*
+	 * We need a vec for the packet header, then 1 vec for each channel,
+	 * 1 for the capabilities and 1 for the reliable channels mask
+	 */
+	struct iovec vecs[3 + LININOIO_MAX_NCHANNELS];
+	struct lininoio_channel *c;
+	struct lininoio_ether_node *en = to_ether_node(node);
+	uint16_t rel_mask = 0;
+
+	vecs[0].iov_base = &p;
+	vecs[0].iov_len = sizeof(p);
+	/* Channels set up before an error, if any */
+	for (i = 0; i < node->nchannels; i++) {
+		c = node->channels[i];
+		if (!c)
+			break;
+		vecs[i + 1].iov_base = c->adata;
+		vecs[i + 1].iov_len =
+			lininoio_decode_cdlen(c->adata->chan_dlen, NULL) +
+			sizeof(c->adata->chan_dlen);
+		if (c->rel)
+			rel_mask |= 1 << c->id;
+	}
+	/* Only nodes advertising capabilities expect them in the reply */
+	if (i == node->nchannels && en->node_caps) {
+		vecs[++i].iov_base = &node->caps;
+		vecs[i].iov_len = sizeof(node->caps);
+		if (node->caps & LININOIO_CAP_RELIABLE) {
+			rel_mask = htole16(rel_mask);
+			vecs[++i].iov_base = &rel_mask;
+			vecs[i].iov_len = sizeof(rel_mask);
+		}
+	}
+	return ether_send_packet(node, vecs, i + 1);
+}
+
+static struct lininoio_core *get_core(struct lininoio_node *n,
+				      int core_id)
+{
+	struct lininoio_core *core = n->cores[core_id];
+	
+	if (core)
+		return core;
+	core = malloc(sizeof(*core));
+	if (!core) {
+		pr_err("allocating new core: %s\n", strerror(errno));
+		return core;
+	}
+	memset(core, 0, sizeof(*core));
+	core->pd.start_fd = core->pd.stop_fd = -1;
+	INIT_LIST_HEAD(&core->channels);
+	INIT_LIST_HEAD(&core->backends);
+	core->node = n;
+	snprintf(core->rproc_name, sizeof(core->rproc_name) - 1, "%s-%d",
+		 n->name, core_id);
+	n->cores[core_id] = core;
+	return core;
+}
+
+static struct lininoio_channel *new_channel(struct lininoio_node *n,
+					    int chan_id,
+					    uint16_t cdescr)
+{
+	uint8_t core_id = lininoio_cdescr_to_core_id(cdescr);
+	struct lininoio_core *core;
+	struct lininoio_channel *out = NULL;
+
+	core = get_core(n, core_id);
+	if (!core)
+		return out;
+	out = malloc(sizeof(*out));
+	if (!out) {
+		pr_err("allocating new channel: %s\n", strerror(errno));
+		return out;
+	}
+	memset(out, 0, sizeof(*out));
+	list_add_tail(&out->list, &core->channels);
+	core->nchannels++;
+	n->channels[chan_id] = out;
+	return out;
+}
+
+static void ether_rx_arequest(const struct sockaddr_ll *from,
+			      const struct lininoio_arequest_packet *packet,
+			      int len, struct ether_data *data)
+{
+	struct lininoio_node *n;
+	struct lininoio_ether_node *en;
+	int i, stat, caps_off;
+
+	if (len < sizeof(*packet))
+		return;
+	if (packet->nchannels > LININOIO_MAX_NCHANNELS) {
+		pr_err("%s: new node with invalid number of channels\n",
+		       __func__);
+		return;
+	}
+	if (len < sizeof(*packet) +
+	    packet->nchannels * sizeof(packet->chan_descr[0])) {
+		pr_err("%s: truncated association request\n", __func__);
+		return;
+	}
+	n = find_node(data, from);
+	if (n) {
+		/*
+		 * The node restarted: its reliable channels start again from
+		 * seq 0 and its remote processors need a new setup, so drop
+		 * all the old state and associate it from scratch
+		 */
+		pr_info("%s: node %s associates again, resetting it\n",
+			__func__, n->name);
+		kill_node(n);
+	}
+
+	/* Create new node and add it to list */
+	n = get_node(data, from);
+	if (!n) {
+		pr_err("%s: cannot allocate new node\n", __func__);
+		/* Silently ignore the request */
+		return;
+	}
+	n->nchannels = packet->nchannels;
+	/* Optional capabilities byte, after the channel descriptors */
+	caps_off = sizeof(*packet) +
+		n->nchannels * sizeof(packet->chan_descr[0]);
+	if (len > caps_off) {
+		en = to_ether_node(n);
+		en->node_caps = ((const uint8_t *)packet)[caps_off];
+		n->caps = en->node_caps & data->caps;
+	}
+	if (!timeout_pending(&data->sweep_to))
+		arm_sweep(data);
 	pr_info("Association request received from %s (%02x:%02x:%02x:%02x:%02x:%02x), %d channels, alive timeout = %d\n",
 		packet->slave_name,
 		from->sll_addr[0],
@@ -545,8 +1930,7 @@ static void ether_rx_arequest(const struct sockaddr_ll *from,
 		from->sll_addr[4],
 		from->sll_addr[5],
 		n->nchannels,
-		n->alive_to);
-	list_add_tail(&n->list, &data->nodes);
+		opt_alive_timeout);
 	strncpy(n->name, (const char *)packet->slave_name,
 		sizeof(packet->slave_name));
 	for (i = 0, stat = 0; !stat && i < n->nchannels; i++) {
@@ -555,6 +1939,10 @@ static void ether_rx_arequest(const struct sockaddr_ll *from,
 
 		cdescr = le16toh(packet->chan_descr[i]);
 		c = new_channel(n, i, cdescr);
+		if (!c) {
+			stat = -ENOMEM;
+			break;
+		}
 		c->protocol = lininoio_cdescr_to_proto_id(cdescr);
 		c->core_id = lininoio_cdescr_to_core_id(cdescr);
 		c->id = i;
@@ -577,6 +1965,16 @@ static void ether_rx_arequest(const struct sockaddr_ll *from,
 		pr_err("Slave %s has no channels !\n", n->name);
 		stat = -EINVAL;
 	}
+	/* Reliable mode on the channels whose handlers ask for it */
+	for (i = 0; !stat && (n->caps & LININOIO_CAP_RELIABLE) &&
+		     i < n->nchannels; i++) {
+		struct lininoio_channel *c = n->channels[i];
+
+		if (!c->ops || !c->ops->reliable || !c->ops->inbound_message)
+			continue;
+		if (lininoio_rel_init(c, n) < 0)
+			stat = -ENOMEM;
+	}
 	if (!stat)
 		stat = setup_remoteprocs(n);
 	if (stat)
@@ -584,45 +1982,161 @@ static void ether_rx_arequest(const struct sockaddr_ll *from,
 	if (ether_send_areply(n, stat) < 0)
 		pr_err("%s: error sending association reply\n", __func__);
 	if (stat) {
-		cancel_timeout(n->alive_to);
-		kill_node(n->alive_to, n);
+		kill_node(n);
 	}
 }
 
-static void ether_data_packet(const uint8_t *mac,
-			      const struct lininoio_data_packet *dp,
-			      struct ether_data *data)
+static void ether_unknown_node(const char *func,
+			       const struct sockaddr_ll *from)
+{
+	pr_err("%s: data packet from unknown mac "
+	       "%02x:%02x:%02x:%02x:%02x:%02x\n", func,
+	       from->sll_addr[0], from->sll_addr[1], from->sll_addr[2],
+	       from->sll_addr[3], from->sll_addr[4], from->sll_addr[5]);
+}
+
+/* Channel @chan_id of @node, NULL (and complain) if there's none */
+static struct lininoio_channel *ether_channel(struct lininoio_node *node,
+					      uint8_t chan_id)
 {
 	struct lininoio_channel *c;
+
+	if (chan_id >= LININOIO_MAX_NCHANNELS) {
+		pr_err("%s: invalid chan id, ignoring packet\n",
+		       __func__);
+		return NULL;
+	}
+	c = node->channels[chan_id];
+	if (!c)
+		pr_err("%s: packet to NULL channel, ignoring\n",
+		       __func__);
+	return c;
+}
+
+/* Hand data packet @dp for channel @chan_id of @node to its handler */
+static void ether_channel_data(struct lininoio_node *node, uint8_t chan_id,
+			       const struct lininoio_data_packet *dp)
+{
+	struct lininoio_channel *c = ether_channel(node, chan_id);
+
+	if (c)
+		lininoio_data_inbound(c, dp);
+}
+
+static void ether_data_packet(const struct sockaddr_ll *from,
+			      const struct lininoio_data_packet *dp,
+			      int plen, struct ether_data *data)
+{
 	uint8_t chan_id;
+	uint16_t len;
 	struct lininoio_node *node;
 
-	chan_id = lininoio_decode_cdlen(le16toh(dp->cdlen), NULL);
+	if (plen < sizeof(*dp))
+		return;
+	len = lininoio_decode_cdlen(le16toh(dp->cdlen), &chan_id);
+	/* Payload must be in the frame, handlers trust len */
+	if (len > plen - sizeof(*dp))
+		return;
 	/* Data to node */
-	node = mac_to_node(data, mac);
+	node = find_node(data, from);
+	if (!len) {
+		/* Alive packet, any chan id: just update liveness */
+		if (node)
+			node_seen(node, data);
+		return;
+	}
 	if (!node) {
-		pr_err("%s: data packet from unknown mac %s\n",
-		       __func__, mac);
+		ether_unknown_node(__func__, from);
 		return;
 	}
-	if (chan_id >= LININOIO_MAX_NCHANNELS) {
-		pr_err("%s: invalid chan id, ignoring packet\n",
-		       __func__);
+	node_seen(node, data);
+	ether_channel_data(node, chan_id, dp);
+}
+
+static void ether_frag_packet(const struct sockaddr_ll *from,
+			      const struct lininoio_frag_packet *fp,
+			      int len, struct ether_data *data)
+{
+	struct lininoio_channel *c;
+	struct lininoio_node *node;
+	uint8_t chan_id;
+
+	if (len < sizeof(*fp))
+		return;
+	node = find_node(data, from);
+	if (!node) {
+		ether_unknown_node(__func__, from);
 		return;
 	}
-	c = node->channels[chan_id];
-	if (!c) {
-		pr_err("%s: packet to NULL channel, ignoring\n",
-		       __func__);
+	node_seen(node, data);
+	lininoio_decode_cdlen(le16toh(fp->cdlen), &chan_id);
+	c = ether_channel(node, chan_id);
+	if (c)
+		lininoio_frag_inbound(c, fp, len);
+}
+
+static void ether_rdata_packet(const struct sockaddr_ll *from,
+			       const struct lininoio_rdata_packet *rp,
+			       int len, struct ether_data *data)
+{
+	struct lininoio_channel *c;
+	struct lininoio_node *node;
+	uint8_t chan_id;
+
+	if (len < sizeof(*rp))
+		return;
+	node = find_node(data, from);
+	if (!node) {
+		ether_unknown_node(__func__, from);
 		return;
 	}
-	cancel_timeout(node->alive_to);
-	node->alive_to = schedule_timeout(opt_alive_timeout, kill_node, node);
-	if (!c->ops || !c->ops->inbound_packet) {
-		pr_debug("%s: no handler for packet\n", __func__);
+	node_seen(node, data);
+	lininoio_decode_cdlen(le16toh(rp->cdlen), &chan_id);
+	c = ether_channel(node, chan_id);
+	if (c)
+		lininoio_rel_inbound(c, rp, len);
+}
+
+/*
+ * Bundle: records are data packets without their type byte, they are
+ * handed to the channels in place
+ */
+static void ether_bundle_packet(const struct sockaddr_ll *from,
+				const struct lininoio_bundle_packet *bp,
+				int len, struct ether_data *data)
+{
+	const struct lininoio_bundle_record *r;
+	struct lininoio_node *node;
+	int i, off = sizeof(*bp);
+	uint8_t chan_id;
+	uint16_t dlen;
+
+	if (len < sizeof(*bp))
+		return;
+	node = find_node(data, from);
+	if (!node) {
+		ether_unknown_node(__func__, from);
 		return;
 	}
-	c->ops->inbound_packet(c, dp);
+	node_seen(node, data);
+	for (i = 0; i < bp->nrecords; i++) {
+		r = (const void *)bp + off;
+		if (off + (int)sizeof(*r) > len)
+			break;
+		dlen = lininoio_decode_cdlen(le16toh(r->chan_dlen), &chan_id);
+		off += sizeof(*r) + dlen;
+		if (off > len)
+			break;
+		/* Alive record */
+		if (!dlen)
+			continue;
+		ether_channel_data(node, chan_id, (const void *)r -
+				   offsetof(struct lininoio_data_packet,
+					    cdlen));
+	}
+	if (i < bp->nrecords)
+		pr_err("%s: truncated bundle from %s (%d of %d records)\n",
+		       __func__, node->name, i, bp->nrecords);
 }
 
 static void ether_rx_cb(const struct sockaddr_ll *from,
@@ -630,14 +2144,29 @@ static void ether_rx_cb(const struct sockaddr_ll *from,
 {
 	const struct lininoio_packet *packet = p;
 
+	/*
+	 * Every frame is checked here, the socket filter may be missing
+	 * and AF_XDP frames never go through it
+	 */
+	if (len < sizeof(*packet))
+		return;
 	switch (packet->type) {
 	case LININOIO_PACKET_DATA:
-		ether_data_packet(from->sll_addr, p, data);
+		ether_data_packet(from, p, len, data);
 		break;
 	case LININOIO_PACKET_AREQUEST:
 		/* Association request */
 		ether_rx_arequest(from, p, len, data);
 		break;
+	case LININOIO_PACKET_BUNDLE:
+		ether_bundle_packet(from, p, len, data);
+		break;
+	case LININOIO_PACKET_FRAG:
+		ether_frag_packet(from, p, len, data);
+		break;
+	case LININOIO_PACKET_RDATA:
+		ether_rdata_packet(from, p, len, data);
+		break;
 	default:
 		pr_err("%s: unexpected packet type %02x\n", __func__,
 		       packet->type);
@@ -645,24 +2174,341 @@ static void ether_rx_cb(const struct sockaddr_ll *from,
 	}
 }
 
-static void _ether_rx_cb(void *_data)
+static void _ether_rx_cb(void *_data, const void *buf, int len,
+			 const struct sockaddr *from, socklen_t fromlen)
 {
 	struct ether_data *data = _data;
-	int stat;
+	struct sockaddr_ll addr;
+
+	if (fromlen < offsetof(struct sockaddr_ll, sll_addr) + ETHER_ADDR_LEN) {
+		pr_err("%s: invalid source address\n", __func__);
+		return;
+	}
+	/* Zero the unused part of sll_addr, nodes are compared with memcmp */
+	memset(&addr, 0, sizeof(addr));
+	memcpy(&addr, from, min(fromlen, sizeof(addr)));
+	ether_rx_cb(&addr, buf, len, data);
+}
+
+/* Count and drop a truncated frame, complain about the first one only */
+static void ether_rx_truncated(struct ether_data *data, unsigned int len,
+			       unsigned int snaplen)
+{
+	if (!data->rx_truncated++)
+		pr_warn("%s: %u bytes frame truncated to %u, dropped\n",
+			__func__, len, snaplen);
+}
+
+/*
+ * Rx ring is readable: process all the blocks retired by the kernel,
+ * frames are handed to ether_rx_cb() from the ring
+ */
+static void ether_rx_ring_readable(void *_data)
+{
+	struct ether_data *data = _data;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *h;
+	unsigned int i, n;
+
+	for (n = 0; n < data->rx_ring.block_nr; n++) {
+		bd = data->rx_ring.map +
+			data->rx_ring.cur * data->rx_ring.block_size;
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+				      __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+		h = (void *)bd + bd->hdr.bh1.offset_to_first_pkt;
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			if (h->tp_snaplen < h->tp_len)
+				ether_rx_truncated(data, h->tp_len,
+						   h->tp_snaplen);
+			else
+				ether_rx_cb((void *)h +
+					    TPACKET_ALIGN(sizeof(*h)),
+					    (void *)h + h->tp_mac,
+					    h->tp_snaplen, data);
+			h = (void *)h + h->tp_next_offset;
+		}
+		/* Give block back to the kernel */
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		data->rx_ring.cur = (data->rx_ring.cur + 1) %
+			data->rx_ring.block_nr;
+	}
+}
+
+/*
+ * Ring frame size for the interface MTU: a power of 2 (so that frames
+ * never straddle blocks), at least @min
+ */
+static unsigned int ring_frame_size(struct ether_data *data, size_t hdr_len,
+				    unsigned int min)
+{
+	unsigned int out = min;
+
+	while (out < TPACKET_ALIGN(hdr_len) + ETH_HLEN + data->mtu)
+		out <<= 1;
+	return out;
+}
+
+static int setup_rx_ring(int fd, struct ether_data *data, int tov)
+{
+	struct tpacket_req3 req;
+	int v = TPACKET_V3;
+	size_t size;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0) {
+		pr_err("%s, setsockopt(PACKET_VERSION): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	/* A block must hold at least one full frame */
+	req.tp_frame_size = ring_frame_size(data, sizeof(struct tpacket3_hdr),
+					    RX_RING_FRAME_SIZE);
+	req.tp_block_size = max(RX_RING_BLOCK_SIZE, req.tp_frame_size);
+	req.tp_block_nr = RX_RING_BLOCK_NR;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+		RX_RING_BLOCK_NR;
+	req.tp_retire_blk_tov = tov;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		pr_err("%s, setsockopt(PACKET_RX_RING): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	size = (size_t)req.tp_block_size * req.tp_block_nr;
+	data->rx_ring.map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+				 fd, 0);
+	if (data->rx_ring.map == MAP_FAILED) {
+		pr_err("%s, mmap: %s\n", __func__, strerror(errno));
+		data->rx_ring.map = NULL;
+		return -1;
+	}
+	data->rx_ring.block_size = req.tp_block_size;
+	data->rx_ring.block_nr = req.tp_block_nr;
+	data->rx_ring.cur = 0;
+	data->rx_event = add_fd_event(fd, EVT_FD_RD, ether_rx_ring_readable,
+				      data);
+	if (!data->rx_event) {
+		pr_err("%s: error in add_fd_event\n", __func__);
+		munmap(data->rx_ring.map, size);
+		data->rx_ring.map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef CONFIG_EBPF
+/*
+ * Frames redirected by XDP skip the socket filters: only the ethertype is
+ * checked, ether_rx_cb() checks the rest (lengths within the umem frame)
+ */
+static void ether_xsk_rx_cb(void *_data, const void *frame, int len)
+{
+	struct ether_data *data = _data;
+	const struct ether_header *eh = frame;
 	struct sockaddr_ll from;
-	socklen_t l = sizeof(from);
-	static uint8_t buf[1024];
 
-	stat = recvfrom(data->netif_fd, buf, sizeof(buf), 0,
-			(struct sockaddr *)&from, &l);
-	if (stat < 0) {
-		pr_err("%s, recvfrom: %s\n", __func__, strerror(errno));
+	if (len < sizeof(*eh))
 		return;
+	from = data->addr;
+	memcpy(from.sll_addr, eh->ether_shost, ETHER_ADDR_LEN);
+	ether_rx_cb(&from, eh + 1, len - sizeof(*eh), data);
+}
+
+static void ether_xsk_readable(void *_data)
+{
+	struct ether_data *data = _data;
+
+	xsk_rx(data->xsk, ether_xsk_rx_cb, data);
+}
+
+/*
+ * Lininoio frames received on queue 0 are redirected to an AF_XDP socket,
+ * the AF_PACKET socket still gets the ones received on other queues
+ */
+static int setup_xsk(struct ether_data *data,
+		     const struct lininoio_ether_config *cfg)
+{
+	struct xsk *x;
+
+	/* One frame per umem chunk, no room for jumbo frames */
+	if (ETH_HLEN + data->mtu > XSK_FRAME_SIZE) {
+		pr_err("%s: mtu %d is too big\n", __func__, data->mtu);
+		return -1;
+	}
+	x = malloc(sizeof(*x));
+	if (!x) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (xsk_open(x, data->addr.sll_ifindex, 0, LININOIO_ETH_TYPE,
+		     cfg->xdp == LININOIO_ETHER_XDP_NATIVE ? XSK_F_DRV : 0) < 0) {
+		free(x);
+		return -1;
+	}
+	data->xsk_event = add_fd_event(x->fd, EVT_FD_RD, ether_xsk_readable,
+				       data);
+	if (!data->xsk_event) {
+		pr_err("%s: error in add_fd_event\n", __func__);
+		xsk_close(x);
+		free(x);
+		return -1;
+	}
+	data->xsk = x;
+	return 0;
+}
+#else
+static int setup_xsk(struct ether_data *data,
+		     const struct lininoio_ether_config *cfg)
+{
+	pr_err("%s: built without CONFIG_EBPF\n", __func__);
+	return -1;
+}
+#endif
+
+static int set_qdisc_bypass(int fd)
+{
+	int v = 1;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &v,
+		       sizeof(v)) < 0) {
+		pr_warn("%s, setsockopt(PACKET_QDISC_BYPASS): %s\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Departure times for paced frames, held by an etf qdisc */
+static int setup_txtime(struct ether_data *data,
+			const struct lininoio_ether_config *cfg)
+{
+	struct sock_txtime st = {
+		.clockid = CLOCK_TAI,
+	};
+
+	/* Only sendmmsg() carries per frame control messages */
+	if (data->xsk || data->tx.map || cfg->qdisc_bypass) {
+		pr_warn("%s: SO_TXTIME needs sendmmsg() and a qdisc\n",
+			__func__);
+		return -1;
+	}
+	if (setsockopt(data->netif_fd, SOL_SOCKET, SO_TXTIME, &st,
+		       sizeof(st)) < 0) {
+		pr_warn("%s, setsockopt(SO_TXTIME): %s\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+	data->txtime = 1;
+	return 0;
+}
+
+static int setup_tx_ring(struct ether_data *data,
+			 const struct lininoio_ether_config *cfg)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll addr;
+	int fd, v = TPACKET_V2;
+	size_t size;
+
+	/* Protocol 0, this socket never receives anything */
+	fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd < 0) {
+		pr_err("%s, socket: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0) {
+		pr_err("%s, setsockopt(PACKET_VERSION): %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	/* Don't block on malformed frames, just drop them */
+	v = 1;
+	if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &v, sizeof(v)) < 0) {
+		pr_err("%s, setsockopt(PACKET_LOSS): %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	if (cfg->qdisc_bypass)
+		set_qdisc_bypass(fd);
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = ring_frame_size(data, sizeof(struct tpacket2_hdr),
+					    TX_RING_FRAME_SIZE);
+	req.tp_block_size = max(TX_RING_BLOCK_SIZE, req.tp_frame_size);
+	req.tp_block_nr = TX_RING_BLOCK_NR;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+		TX_RING_BLOCK_NR;
+	if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		pr_err("%s, setsockopt(PACKET_TX_RING): %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = data->addr.sll_ifindex;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pr_err("%s, bind: %s\n", __func__, strerror(errno));
+		goto err;
+	}
+	size = (size_t)req.tp_block_size * req.tp_block_nr;
+	data->tx.map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+	if (data->tx.map == MAP_FAILED) {
+		pr_err("%s, mmap: %s\n", __func__, strerror(errno));
+		data->tx.map = NULL;
+		goto err;
+	}
+	data->tx.frame_size = req.tp_frame_size;
+	data->tx.frame_nr = req.tp_frame_nr;
+	data->tx.head = 0;
+	data->tx.ring_fd = fd;
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static int join_fanout(int fd)
+{
+	struct sock_fprog fprog = {
+		.len = sizeof(fanout_prog) / sizeof(fanout_prog[0]),
+		.filter = fanout_prog,
+	};
+	int v = fanout_id | (PACKET_FANOUT_CBPF << 16);
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &v, sizeof(v)) < 0) {
+		pr_err("%s, setsockopt(PACKET_FANOUT): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog,
+		       sizeof(fprog)) < 0) {
+		pr_err("%s, setsockopt(PACKET_FANOUT_DATA): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int attach_rx_filter(int fd)
+{
+	struct sock_fprog fprog = {
+		.len = sizeof(rx_filter) / sizeof(rx_filter[0]),
+		.filter = rx_filter,
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+		       sizeof(fprog)) < 0) {
+		pr_warn("%s, setsockopt(SO_ATTACH_FILTER): %s\n", __func__,
+			strerror(errno));
+		return -1;
 	}
-	ether_rx_cb(&from, buf, stat, data);
+	return 0;
 }
 
-static int setup_ether_socket(const char *ifname, struct ether_data *data)
+static int setup_ether_socket(const char *ifname, struct ether_data *data,
+			      const struct lininoio_ether_config *cfg)
 {
 	struct ifreq ifr;
 	size_t if_name_len = strlen(ifname);
@@ -695,19 +2541,84 @@ static int setup_ether_socket(const char *ifname, struct ether_data *data)
 		close(fd);
 		return -1;
 	}
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		pr_err("%s, ioctl, SIOCGIFHWADDR: %s\n", __func__,
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+	memcpy(data->hwaddr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+	if (ioctl(fd, SIOCGIFMTU, &ifr) < 0) {
+		pr_warn("%s, ioctl, SIOCGIFMTU: %s, assuming %d\n", __func__,
+			strerror(errno), ETHER_DEFAULT_MTU);
+		ifr.ifr_mtu = ETHER_DEFAULT_MTU;
+	}
+	data->mtu = ifr.ifr_mtu;
+	data->tx.bufs = malloc((size_t)TX_BATCH * data->mtu);
+	if (!data->tx.bufs) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	data->filter_prog_fd = data->filter_map_fd = -1;
+	if ((cfg->ebpf_filter || cfg->alive_offload) &&
+	    setup_ebpf_filter(fd, data, cfg) < 0)
+		pr_warn("%s: cannot setup eBPF filter, falling back to "
+			"classic BPF\n", __func__);
+	/* Not fatal, ether_rx_cb() drops malformed frames too */
+	if (data->filter_prog_fd < 0)
+		attach_rx_filter(fd);
+	if (cfg->rx_threads > 1 && join_fanout(fd) < 0) {
+		close(fd);
+		return -1;
+	}
 	data->netif_fd = fd;
-	data->rx_event = add_fd_event(fd, EVT_FD_RD, _ether_rx_cb, data);
+	data->tx.ring_fd = -1;
+	if (cfg->xdp && setup_xsk(data, cfg) < 0)
+		pr_warn("%s: cannot setup AF_XDP socket, falling back to "
+			"AF_PACKET\n", __func__);
+	if (!data->xsk && cfg->tx_ring && setup_tx_ring(data, cfg) < 0)
+		pr_warn("%s: cannot setup tx ring, falling back to sendmmsg\n",
+			__func__);
+	if (!data->tx.map && cfg->qdisc_bypass)
+		set_qdisc_bypass(fd);
+	data->vring_features = cfg->vring_features;
+	/* Kbit/s to bytes/s */
+	data->pace_max_rate = cfg->pace_rate * 125;
+	if (data->pace_max_rate && cfg->txtime && setup_txtime(data, cfg) < 0)
+		pr_warn("%s: falling back to timer driven pacing\n",
+			__func__);
+	/*
+	 * With io_uring the batch goes through the ring, which copies the
+	 * frames (txtime frames carry control data, they can't be queued)
+	 */
+	data->tx.uring = !data->xsk && !data->tx.map &&
+		fd_events_get_backend() == FD_EVENTS_URING &&
+		data->mtu <= FD_EVENT_SENDMSG_QUEUE_MAX && !data->txtime;
+	if (fd_events_add_post_cb(ether_tx_post, data) < 0) {
+		pr_err("%s: error in fd_events_add_post_cb\n", __func__);
+		close(fd);
+		return -1;
+	}
+	if (cfg->rx_ring_tov >= 0) {
+		if (!setup_rx_ring(fd, data, cfg->rx_ring_tov))
+			return 0;
+		pr_warn("%s: cannot setup rx ring, falling back to recv\n",
+			__func__);
+	}
+	data->rx_event = add_fd_recv_event(fd, data->mtu, _ether_rx_cb, data);
 	if (!data->rx_event) {
-		pr_err("%s: error in add_fd_event\n", __func__);
+		pr_err("%s: error in add_fd_recv_event\n", __func__);
 		close(fd);
 		return -1;
 	}
 	return 0;
 }
 
-int lininoio_ether_init(const char *netif_name)
+static int ether_start(const char *netif_name,
+		       const struct lininoio_ether_config *cfg)
 {
-	int ret, i;
+	int ret;
 	struct ether_data *data;
 
 	data = malloc(sizeof(*data));
@@ -717,26 +2628,112 @@ int lininoio_ether_init(const char *netif_name)
 	}
 	memset(data, 0, sizeof(*data));
 	INIT_LIST_HEAD(&data->nodes);
-	INIT_LIST_HEAD(&data->free_nodes);
-	for (i = 0; i < 7; i++) {
-		struct lininoio_ether_node *en = malloc(sizeof(*en));
-		struct lininoio_node *n = &en->node;
-
-		if (!n) {
-			pr_err("%s, malloc: %s\n", __func__, strerror(errno));
-			return -ENOMEM;
-		}
-		memset(en, 0, sizeof(*en));
-		list_add_tail(&n->list, &data->free_nodes);
-	}
+	INIT_LIST_HEAD(&data->tx.bundles);
+	INIT_LIST_HEAD(&data->tx.stalled);
+	/*
+	 * Reassembly is always available, reliable mode is chosen by the
+	 * protocol handlers
+	 */
+	data->caps = LININOIO_CAP_FRAG | LININOIO_CAP_RELIABLE;
+	if (cfg->bundle)
+		data->caps |= LININOIO_CAP_BUNDLE;
+	init_timeout(&data->sweep_to, sweep_nodes, data);
+	if (slab_cache_init(&data->node_cache,
+			    sizeof(struct lininoio_ether_node),
+			    NODES_PER_SLAB, cfg->max_nodes) < 0)
+		return -EINVAL;
+	if (mac_hash_init(&data->node_hash, NODES_PER_SLAB) < 0)
+		return -ENOMEM;
 
-	ret = setup_ether_socket(netif_name, data);
+	ret = setup_ether_socket(netif_name, data, cfg);
 	if (ret < 0)
 		return ret;
 	
 	return ret;
 }
 
+static void *ether_worker(void *_w)
+{
+	struct ether_worker *w = _w;
+	struct event_loop *l;
+	int stat;
+
+	l = event_loop_new(w->backend);
+	stat = l ? 0 : -1;
+	if (!stat) {
+		/* Node code and protocol handlers use the default loop */
+		event_loop_set_default(l);
+		stat = loop_udev_events_init(l);
+	}
+	if (!stat)
+		stat = ether_start(w->netif_name, w->cfg);
+	/* @w belongs to start_workers(), gone after this */
+	w->stat = stat;
+	sem_post(&w->ready);
+	if (stat < 0)
+		return NULL;
+	loop_fd_events_loop(l);
+	return NULL;
+}
+
+/*
+ * Start cfg->rx_threads threads, each one with its own socket in a fanout
+ * group, its own nodes and its own loop: nothing is shared on the data path.
+ * On error the threads already started keep running, the caller is
+ * expected to exit
+ */
+static int start_workers(const char *netif_name,
+			 const struct lininoio_ether_config *cfg)
+{
+	static struct lininoio_ether_config wcfg;
+	struct ether_worker w;
+	unsigned int i;
+	int ret = 0;
+
+	if (cfg->xdp != LININOIO_ETHER_XDP_NONE) {
+		pr_err("%s: AF_XDP is not supported with rx threads\n",
+		       __func__);
+		return -1;
+	}
+	wcfg = *cfg;
+	fanout_id = getpid() & 0xffff;
+	/* Workers only use @w until they are ready, one at a time */
+	w.netif_name = netif_name;
+	w.cfg = &wcfg;
+	w.backend = fd_events_get_backend();
+	if (sem_init(&w.ready, 0, 0) < 0) {
+		pr_err("%s: sem_init: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < cfg->rx_threads; i++) {
+		errno = pthread_create(&w.thread, NULL, ether_worker, &w);
+		if (errno) {
+			pr_err("%s: pthread_create: %s\n", __func__,
+			       strerror(errno));
+			ret = -1;
+			break;
+		}
+		pthread_detach(w.thread);
+		/* One at a time, fanout indexes follow the join order */
+		sem_wait(&w.ready);
+		if (w.stat < 0) {
+			pr_err("%s: rx thread %u failed\n", __func__, i);
+			ret = -1;
+			break;
+		}
+	}
+	sem_destroy(&w.ready);
+	return ret;
+}
+
+int lininoio_ether_init(const char *netif_name,
+			const struct lininoio_ether_config *cfg)
+{
+	if (cfg->rx_threads > 1)
+		return start_workers(netif_name, cfg);
+	return ether_start(netif_name, cfg);
+}
+
 void ether_exit(struct ether_data *data)
 {
 	free(data);
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <pty.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <getopt.h>
 #include <unistd.h>
@@ -45,11 +46,25 @@
 #include "lininoio-ether.h"
 #include "timeout.h"
 #include "udev-events.h"
+#include "virtio.h"
 
 #define DEFAULT_VERBOSE 0
 #define DEFAULT_PID_FILE_PATH "/var/run/etherd.pid"
 #define DEFAULT_DONT_DAEMONIZE 0
 #define DEFAULT_LOG_TO_STDERR 0
+#define DEFAULT_EVENT_ENGINE "epoll"
+#define DEFAULT_MAX_NODES 1024
+#define DEFAULT_RX_RING_TOV -1
+#define DEFAULT_TX_RING 0
+#define DEFAULT_QDISC_BYPASS 0
+#define DEFAULT_XDP LININOIO_ETHER_XDP_NONE
+#define DEFAULT_RX_THREADS 0
+#define DEFAULT_EBPF_FILTER 0
+#define DEFAULT_ALIVE_OFFLOAD 0
+#define DEFAULT_BUNDLE 0
+#define DEFAULT_PACE_RATE 0
+#define DEFAULT_TXTIME 0
+#define DEFAULT_VRING_FEATURES 0
 
 
 enum opt_index {
@@ -58,12 +73,40 @@ enum opt_index {
 	DONT_DAEMONIZE_OPT_INDEX,
 	PID_FILE_PATH_OPT_INDEX,
 	LOG_TO_STDERR_OPT_INDEX,
+	EVENT_ENGINE_OPT_INDEX,
+	MAX_NODES_OPT_INDEX,
+	RX_RING_OPT_INDEX,
+	TX_RING_OPT_INDEX,
+	QDISC_BYPASS_OPT_INDEX,
+	XDP_OPT_INDEX,
+	RX_THREADS_OPT_INDEX,
+	EBPF_FILTER_OPT_INDEX,
+	ALIVE_OFFLOAD_OPT_INDEX,
+	BUNDLE_OPT_INDEX,
+	PACE_OPT_INDEX,
+	TXTIME_OPT_INDEX,
+	VRING_FEATURES_OPT_INDEX,
 };
 
 static int opt_verbose = DEFAULT_VERBOSE;
 static const char *opt_pid_file_path = DEFAULT_PID_FILE_PATH ;
 static int opt_dont_daemonize = DEFAULT_DONT_DAEMONIZE ;
 static int opt_log_to_stderr = DEFAULT_LOG_TO_STDERR;
+static const char *opt_event_engine = DEFAULT_EVENT_ENGINE;
+static struct lininoio_ether_config ether_config = {
+	.max_nodes = DEFAULT_MAX_NODES,
+	.rx_ring_tov = DEFAULT_RX_RING_TOV,
+	.tx_ring = DEFAULT_TX_RING,
+	.qdisc_bypass = DEFAULT_QDISC_BYPASS,
+	.xdp = DEFAULT_XDP,
+	.rx_threads = DEFAULT_RX_THREADS,
+	.ebpf_filter = DEFAULT_EBPF_FILTER,
+	.alive_offload = DEFAULT_ALIVE_OFFLOAD,
+	.bundle = DEFAULT_BUNDLE,
+	.pace_rate = DEFAULT_PACE_RATE,
+	.txtime = DEFAULT_TXTIME,
+	.vring_features = DEFAULT_VRING_FEATURES,
+};
 
 static const char *netif;
 
@@ -80,13 +123,74 @@ static void help(int argc, char *argv[])
 		DEFAULT_PID_FILE_PATH);
 	fprintf(stderr, "\t-E|--log-to-stderr: log to stderr "
 		"(default is syslog)\n");
+	fprintf(stderr, "\t-e|--event-engine: select, epoll or uring "
+		"(default %s)\n", DEFAULT_EVENT_ENGINE);
+	fprintf(stderr, "\t-n|--max-nodes: max number of associated nodes, "
+		"per rx thread with -T, 0 means no limit (default %d)\n",
+		DEFAULT_MAX_NODES);
+	fprintf(stderr, "\t-r|--rx-ring: use a TPACKET_V3 rx ring, argument is "
+		"the block retire timeout in ms, 0 for kernel default "
+		"(default: no ring)\n");
+	fprintf(stderr, "\t-t|--tx-ring: transmit through a PACKET_TX_RING "
+		"(default is sendmmsg)\n");
+	fprintf(stderr, "\t-q|--qdisc-bypass: bypass the interface qdisc "
+		"on transmit (default %d)\n", DEFAULT_QDISC_BYPASS);
+	fprintf(stderr, "\t-x|--xdp: use an AF_XDP socket, argument is generic "
+		"(copy mode, any driver) or native, not with -T "
+		"(default: no xdp)\n");
+	fprintf(stderr, "\t-T|--rx-threads: number of threads sharing rx "
+		"through PACKET_FANOUT, each one with its own nodes "
+		"(default: no threads)\n");
+	fprintf(stderr, "\t-b|--ebpf-filter: drop data frames from non "
+		"associated nodes in the kernel (default %d)\n",
+		DEFAULT_EBPF_FILTER);
+	fprintf(stderr, "\t-k|--alive-offload: count alive frames in the "
+		"kernel, implies -b (default %d)\n", DEFAULT_ALIVE_OFFLOAD);
+	fprintf(stderr, "\t-B|--bundle: pack data to nodes supporting it in "
+		"bundle frames (default %d)\n", DEFAULT_BUNDLE);
+	fprintf(stderr, "\t-P|--pace: pace transmission to each node, "
+		"argument is the max rate in kbit/s, 0 for no pacing "
+		"(default %d)\n", DEFAULT_PACE_RATE);
+	fprintf(stderr, "\t-X|--txtime: paced frames carry their departure "
+		"time, for an etf qdisc (default %d)\n", DEFAULT_TXTIME);
+	fprintf(stderr, "\t-V|--vring-features: comma separated vring "
+		"features the remote processors are known to accept: "
+		"event_idx, indirect (default: none)\n");
+}
+
+/* Comma separated vring features names to VIRTIO_RING_F_*, -1 on error */
+static int parse_vring_features(char *arg, uint32_t *out)
+{
+	static const struct {
+		const char *name;
+		uint32_t feature;
+	} features[] = {
+		{ "event_idx", VIRTIO_RING_F_EVENT_IDX, },
+		{ "indirect", VIRTIO_RING_F_INDIRECT_DESC, },
+	};
+	char *f, *saveptr = NULL;
+	int i;
+
+	*out = 0;
+	for (f = strtok_r(arg, ",", &saveptr); f;
+	     f = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < ARRAY_SIZE(features); i++)
+			if (!strcmp(f, features[i].name))
+				break;
+		if (i == ARRAY_SIZE(features)) {
+			fprintf(stderr, "invalid vring feature %s\n", f);
+			return -1;
+		}
+		*out |= features[i].feature;
+	}
+	return 0;
 }
 
 
 static int parse_cmdline(int argc, char *argv[])
 {
 	int opt;
-	char *opts = "hvDp:E";
+	char *opts = "hvDp:Ee:n:r:tqx:T:bkBP:XV:";
 	struct option long_options[] = {
 		[HELP_OPT_INDEX] = {
 			.name = "help",
@@ -118,6 +222,88 @@ static int parse_cmdline(int argc, char *argv[])
 			.flag = NULL,
 			.val = LOG_TO_STDERR_OPT_INDEX,
 		},
+		[EVENT_ENGINE_OPT_INDEX] = {
+			.name = "event-engine",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = EVENT_ENGINE_OPT_INDEX,
+		},
+		[MAX_NODES_OPT_INDEX] = {
+			.name = "max-nodes",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = MAX_NODES_OPT_INDEX,
+		},
+		[RX_RING_OPT_INDEX] = {
+			.name = "rx-ring",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = RX_RING_OPT_INDEX,
+		},
+		[TX_RING_OPT_INDEX] = {
+			.name = "tx-ring",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = TX_RING_OPT_INDEX,
+		},
+		[QDISC_BYPASS_OPT_INDEX] = {
+			.name = "qdisc-bypass",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = QDISC_BYPASS_OPT_INDEX,
+		},
+		[XDP_OPT_INDEX] = {
+			.name = "xdp",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = XDP_OPT_INDEX,
+		},
+		[RX_THREADS_OPT_INDEX] = {
+			.name = "rx-threads",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = RX_THREADS_OPT_INDEX,
+		},
+		[EBPF_FILTER_OPT_INDEX] = {
+			.name = "ebpf-filter",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = EBPF_FILTER_OPT_INDEX,
+		},
+		[ALIVE_OFFLOAD_OPT_INDEX] = {
+			.name = "alive-offload",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = ALIVE_OFFLOAD_OPT_INDEX,
+		},
+		[BUNDLE_OPT_INDEX] = {
+			.name = "bundle",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = BUNDLE_OPT_INDEX,
+		},
+		[PACE_OPT_INDEX] = {
+			.name = "pace",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = PACE_OPT_INDEX,
+		},
+		[TXTIME_OPT_INDEX] = {
+			.name = "txtime",
+			.has_arg = 0,
+			.flag = NULL,
+			.val = TXTIME_OPT_INDEX,
+		},
+		[VRING_FEATURES_OPT_INDEX] = {
+			.name = "vring-features",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = VRING_FEATURES_OPT_INDEX,
+		},
+		/* getopt_long() wants a terminating entry */
+		[VRING_FEATURES_OPT_INDEX + 1] = {
+			.name = NULL,
+		},
 	};
 	while ((opt = getopt_long(argc, argv, opts, long_options,
 				  NULL)) != -1) {
@@ -137,6 +323,61 @@ static int parse_cmdline(int argc, char *argv[])
 		case LOG_TO_STDERR_OPT_INDEX:
 		case 'E':
 			opt_log_to_stderr = 1; break;
+		case EVENT_ENGINE_OPT_INDEX:
+		case 'e':
+			opt_event_engine = optarg; break;
+		case MAX_NODES_OPT_INDEX:
+		case 'n':
+			ether_config.max_nodes = strtoul(optarg, NULL, 0);
+			break;
+		case RX_RING_OPT_INDEX:
+		case 'r':
+			ether_config.rx_ring_tov = atoi(optarg); break;
+		case TX_RING_OPT_INDEX:
+		case 't':
+			ether_config.tx_ring = 1; break;
+		case QDISC_BYPASS_OPT_INDEX:
+		case 'q':
+			ether_config.qdisc_bypass = 1; break;
+		case XDP_OPT_INDEX:
+		case 'x':
+			if (!strcmp(optarg, "generic"))
+				ether_config.xdp = LININOIO_ETHER_XDP_GENERIC;
+			else if (!strcmp(optarg, "native"))
+				ether_config.xdp = LININOIO_ETHER_XDP_NATIVE;
+			else {
+				help(argc, argv);
+				exit(127);
+			}
+			break;
+		case RX_THREADS_OPT_INDEX:
+		case 'T':
+			ether_config.rx_threads = strtoul(optarg, NULL, 0);
+			break;
+		case EBPF_FILTER_OPT_INDEX:
+		case 'b':
+			ether_config.ebpf_filter = 1; break;
+		case ALIVE_OFFLOAD_OPT_INDEX:
+		case 'k':
+			ether_config.alive_offload = 1; break;
+		case BUNDLE_OPT_INDEX:
+		case 'B':
+			ether_config.bundle = 1; break;
+		case PACE_OPT_INDEX:
+		case 'P':
+			ether_config.pace_rate = strtoul(optarg, NULL, 0);
+			break;
+		case TXTIME_OPT_INDEX:
+		case 'X':
+			ether_config.txtime = 1; break;
+		case VRING_FEATURES_OPT_INDEX:
+		case 'V':
+			if (parse_vring_features(optarg,
+					&ether_config.vring_features) < 0) {
+				help(argc, argv);
+				exit(127);
+			}
+			break;
 		default:
 			help(argc, argv);
 			break;
@@ -149,12 +390,43 @@ static int parse_cmdline(int argc, char *argv[])
 	}
 	/* First non-option arg is network interface's name */
 	netif = argv[optind++];
+	if (ether_config.rx_threads > 1 &&
+	    ether_config.xdp != LININOIO_ETHER_XDP_NONE) {
+		fprintf(stderr, "-x and -T can't be used together\n");
+		help(argc, argv);
+		exit(127);
+	}
 	return 0;
 }
 
+static int init_events(void)
+{
+	static const char *engines[] = {
+		[FD_EVENTS_SELECT] = "select",
+		[FD_EVENTS_EPOLL] = "epoll",
+		[FD_EVENTS_URING] = "uring",
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(engines); i++)
+		if (!strcmp(opt_event_engine, engines[i]))
+			break;
+	if (i == ARRAY_SIZE(engines)) {
+		pr_err("invalid event engine %s\n", opt_event_engine);
+		return -1;
+	}
+	if (!fd_events_init_backend(i))
+		return 0;
+	if (i == FD_EVENTS_EPOLL)
+		return -1;
+	pr_warn("%s event engine not available, using epoll\n",
+		opt_event_engine);
+	return fd_events_init_backend(FD_EVENTS_EPOLL);
+}
+
 int main(int argc, char *argv[])
 {
-	int stat, nfds, max_fd;
+	int stat;
 	FILE *logf = NULL;
 
 	stat = parse_cmdline(argc, argv);
@@ -169,7 +441,7 @@ int main(int argc, char *argv[])
 
 	logger_init(logf, "etherd");
 
-	if (fd_events_init() < 0) {
+	if (init_events() < 0) {
 		pr_err("Error initializing events\n");
 		exit(129);
 	}
@@ -187,25 +459,11 @@ int main(int argc, char *argv[])
 		exit(130);
 	}
 	//lininoio_ether_init(netif, argc - optind, &argv[optind]);
-	lininoio_ether_init(netif);
+	if (lininoio_ether_init(netif, &ether_config) < 0) {
+		pr_err("Error in lininoio ether initialization\n");
+		exit(132);
+	}
 	
-	while (1) {
-		fd_set fds;
-
-		FD_ZERO(&fds);
-		prepare_fd_events(&fds, NULL, NULL, &max_fd);
-		nfds = max_fd + 1;
-		switch (select(nfds, &fds, NULL, NULL, get_next_timeout())) {
-		case 0:
-			handle_timeouts();
-			break;
-		case -1:
-			pr_err("etherd main, select: %s\n", strerror(errno));
-			break;
-		default:
-			handle_fd_events(&fds, NULL, NULL);
-			break;
-		}
-	};
+	fd_events_loop();
 	return 0;
 }
@@ -0,0 +1,108 @@
+#ifndef __FD_EVENT_INTERNAL_H__
+#define __FD_EVENT_INTERNAL_H__
+
+/*
+ * fd_event internals, shared by fd events backends only.
+ * GNU GPLv2 or later
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include "list.h"
+#include "fd_event.h"
+
+/* Internal flags, never passed by users */
+#define EVT_FD_F_RECV		0x100
+
+struct fd_slot;
+struct uring;
+struct timer_wheel;
+
+struct event_loop {
+	const struct fd_events_ops *ops;
+	enum fd_events_backend backend;
+	struct list_head fd_events[3];
+	struct list_head post_cbs;
+	/*
+	 * Dispatch rounds and cancelled events count: callbacks can cancel
+	 * any event, the dispatch loops must not keep pointers to them
+	 */
+	unsigned long dispatch_seq;
+	unsigned long cancels;
+	/* epoll backend: one slot per fd, indexed by fd number */
+	int epfd;
+	struct fd_slot *slots;
+	int nslots;
+	/* io_uring backend */
+	struct uring *uring;
+	/* Timers, NULL until loop_timeouts_init() */
+	struct timer_wheel *timers;
+	/* udev events, the monitor is NULL until loop_udev_events_init() */
+	void *udev_mon;
+	struct list_head udev_events;
+};
+
+struct fd_event {
+	struct event_loop *loop;
+	int fd;
+	enum fd_event_type type;
+	unsigned int flags;
+	fd_event_cb cb;
+	void *data;
+	/* Receive events only (EVT_FD_F_RECV) */
+	fd_recv_cb recv_cb;
+	void *recv_data;
+	int rx_bufsize;
+	void *rx_buf;
+	/* Datagrams longer than rx_bufsize, dropped */
+	unsigned long rx_dropped;
+	/* Last dispatch round which invoked the event */
+	unsigned long dispatch_seq;
+	/* epoll backend: next event of the same type on the fd */
+	struct fd_event *slot_next;
+	/* io_uring backend state */
+	int inflight;
+	int dispatching;
+	int dead;
+	int bgid;
+	void *bufs;
+	struct list_head list;
+};
+
+struct fd_events_ops {
+	/* Start monitoring @e, which has already been setup */
+	int (*add)(struct fd_event *e);
+	/*
+	 * Start a receive event natively, optional. On error, the receive
+	 * event is emulated with a readable event and recvfrom()
+	 */
+	int (*add_recv)(struct fd_event *e);
+	/* Stop monitoring @e, free it when it is safe to do so */
+	void (*cancel)(struct fd_event *e);
+	int (*wait)(struct event_loop *l, struct timeval *tv);
+	int (*sendmsg)(struct event_loop *l, int fd, const struct msghdr *msg);
+	/* Free the backend's resources (@l has no events), optional */
+	void (*release)(struct event_loop *l);
+};
+
+extern void fd_event_free(struct fd_event *e);
+
+/* Update @tv with the time not slept since @start */
+extern void fd_events_update_tv(struct timeval *tv,
+				const struct timespec *start, int expired);
+
+/* Refresh the cached clock of @l timers, backends do it on wake up */
+extern void loop_timeouts_update_clock(struct event_loop *l);
+
+#ifdef CONFIG_IO_URING
+extern const struct fd_events_ops *uring_fd_events_init(struct event_loop *l);
+#else
+static inline const struct fd_events_ops *
+uring_fd_events_init(struct event_loop *l)
+{
+	return NULL;
+}
+#endif
+
+#endif /* __FD_EVENT_INTERNAL_H__ */
@@ -2,6 +2,8 @@
 #define __FD_EVENT_H__
 
 #include <sys/select.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 
 #include "list.h"
 
@@ -11,21 +13,137 @@ enum fd_event_type {
 	EVT_FD_EXC = 2,
 };
 
+/*
+ * fd_event flags (add_fd_event_flags())
+ *
+ * EVT_FD_F_EDGE: edge triggered event, the callback must drain the fd
+ * (until EAGAIN) every time it is invoked. Honoured by the epoll and
+ * io_uring backends. With epoll, edge triggering is a property of the fd:
+ * if the fd also has level triggered events, the edge triggered ones are
+ * invoked as long as the fd is ready, like with select.
+ */
+#define EVT_FD_F_EDGE		0x1
+
+enum fd_events_backend {
+	FD_EVENTS_SELECT = 0,
+	FD_EVENTS_EPOLL = 1,
+	/* Only available if built with CONFIG_IO_URING */
+	FD_EVENTS_URING = 2,
+};
+
 struct fd_event ;
+struct event_loop;
 
 typedef void (*fd_event_cb)(void *);
 
+/* Invoked at the end of each fd_events_wait() */
+typedef void (*fd_events_post_cb)(void *);
+
+/* Receive events callback, invoked once per received datagram */
+typedef void (*fd_recv_cb)(void *cb_data, const void *buf, int len,
+			   const struct sockaddr *from, socklen_t fromlen);
+
+/*
+ * Several events, of the same type too, can be added on an fd: all of them
+ * are invoked when it is ready
+ */
 extern struct fd_event *add_fd_event(int fd, enum fd_event_type t,
 				     fd_event_cb cb, void *cb_data);
 
+extern struct fd_event *add_fd_event_flags(int fd, enum fd_event_type t,
+					   unsigned int flags,
+					   fd_event_cb cb, void *cb_data);
+
+/*
+ * Datagram receive event: the backend reads from @fd (at most @bufsize
+ * bytes per datagram) and invokes @cb for each received datagram. With the
+ * io_uring backend this is a multishot recvmsg using a provided buffers ring.
+ * Datagrams longer than @bufsize are dropped and counted, never passed
+ * truncated to @cb (see fd_event_rx_dropped()).
+ */
+extern struct fd_event *add_fd_recv_event(int fd, int bufsize,
+					  fd_recv_cb cb, void *cb_data);
+
 extern int cancel_fd_event(struct fd_event *);
 
+/*
+ * Send a datagram. The io_uring backend copies the message and queues it,
+ * all the messages queued during a loop iteration are submitted together.
+ * Returns the number of bytes sent (or queued), -1 on error. Errors of
+ * queued messages are only logged, when they complete. Messages longer
+ * than FD_EVENT_SENDMSG_QUEUE_MAX or with control data are sent at once
+ */
+#define FD_EVENT_SENDMSG_QUEUE_MAX 2048
+
+extern int fd_event_sendmsg(int fd, const struct msghdr *msg);
+
+/*
+ * Register a callback run once per loop iteration, after all the ready
+ * events have been dispatched (flush batched work, for instance)
+ */
+extern int fd_events_add_post_cb(fd_events_post_cb cb, void *cb_data);
+
+/* select() helpers, for users running their own loop */
 extern void handle_fd_events(fd_set *rd, fd_set *wr, fd_set *exc);
 
 extern void prepare_fd_events(fd_set *rd, fd_set *wr, fd_set *exc, int *max_fd);
 
+/*
+ * Event loops: a loop owns its fd events, timeouts and udev events, and
+ * must only be used by the thread running it (one loop per core, for
+ * instance). Events must be added and cancelled by that thread.
+ *
+ * Each thread has a default loop, used by all the functions with no loop
+ * argument. fd_events_init*() create it (timeouts_init() and
+ * udev_events_init() complete it), event_loop_set_default() replaces it.
+ */
+
+/* Init the calling thread's default loop with the epoll backend */
 extern int fd_events_init(void);
 
+extern int fd_events_init_backend(enum fd_events_backend b);
+
+/* New loop with its timers, NULL on error */
+extern struct event_loop *event_loop_new(enum fd_events_backend b);
+
+extern struct event_loop *event_loop_get_default(void);
+extern void event_loop_set_default(struct event_loop *);
+
+/* Backend of the calling thread's default loop */
+extern enum fd_events_backend fd_events_get_backend(void);
+extern enum fd_events_backend loop_fd_events_get_backend(struct event_loop *);
+
+/*
+ * Wait for events and dispatch them. Like select(2) on linux, @tv is updated
+ * with the amount of time not slept. A NULL @tv means wait forever.
+ * Returns the number of ready fds, 0 on timeout, -1 on error.
+ */
+extern int fd_events_wait(struct timeval *tv);
+extern int loop_fd_events_wait(struct event_loop *, struct timeval *tv);
+
+/* Main loop: dispatch fd events and timeouts, never returns */
+extern void fd_events_loop(void);
+extern void loop_fd_events_loop(struct event_loop *);
+
+/* Same as the functions with no loop argument, on loop @l */
+extern struct fd_event *loop_add_fd_event(struct event_loop *l,
+					  int fd, enum fd_event_type t,
+					  fd_event_cb cb, void *cb_data);
+extern struct fd_event *loop_add_fd_event_flags(struct event_loop *l,
+						int fd, enum fd_event_type t,
+						unsigned int flags,
+						fd_event_cb cb, void *cb_data);
+extern struct fd_event *loop_add_fd_recv_event(struct event_loop *l,
+					       int fd, int bufsize,
+					       fd_recv_cb cb, void *cb_data);
+extern int loop_fd_event_sendmsg(struct event_loop *l, int fd,
+				 const struct msghdr *msg);
+extern int loop_fd_events_add_post_cb(struct event_loop *l,
+				      fd_events_post_cb cb, void *cb_data);
+
 extern int fd_event_get_fd(struct fd_event *);
 
+/* Number of datagrams dropped by a receive event because of their length */
+extern unsigned long fd_event_rx_dropped(struct fd_event *);
+
 #endif /* __FD_EVENT_H__ */
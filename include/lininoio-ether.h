@@ -10,6 +10,75 @@
 
 #include "lininoio.h"
 
-extern 	int lininoio_ether_init(const char *netif_name);
+enum lininoio_ether_xdp {
+	LININOIO_ETHER_XDP_NONE = 0,
+	/* Generic XDP, AF_XDP copy mode. Works with any driver (veth too) */
+	LININOIO_ETHER_XDP_GENERIC,
+	/* Native XDP, AF_XDP zero copy if the driver supports it */
+	LININOIO_ETHER_XDP_NATIVE,
+};
+
+struct lininoio_ether_config {
+	/* Max number of associated nodes (per rx thread), 0 means no limit */
+	unsigned int max_nodes;
+	/*
+	 * TPACKET_V3 rx ring blocks retire timeout in ms (0 means kernel
+	 * default), a negative value disables the rx ring
+	 */
+	int rx_ring_tov;
+	/* Transmit through a PACKET_TX_RING instead of sendmmsg() */
+	int tx_ring;
+	/* Set PACKET_QDISC_BYPASS on the transmitting socket */
+	int qdisc_bypass;
+	/*
+	 * Receive and transmit through an AF_XDP socket, needs CONFIG_EBPF.
+	 * Overrides tx_ring. Not supported with rx_threads
+	 */
+	enum lininoio_ether_xdp xdp;
+	/*
+	 * Number of rx threads sharing the interface through PACKET_FANOUT,
+	 * nodes are spread by source MAC. Each thread runs its own loop and
+	 * has its own nodes (max_nodes each). 0 or 1 means no threads, all
+	 * is done by the caller's loop
+	 */
+	unsigned int rx_threads;
+	/*
+	 * Replace the classic BPF rx filter with an eBPF one, which also drops
+	 * data frames from non associated nodes. Needs CONFIG_EBPF
+	 */
+	int ebpf_filter;
+	/*
+	 * Alive frames only update a timestamp in the eBPF filter map and
+	 * are dropped in the kernel, the nodes sweep reads the map. Implies
+	 * ebpf_filter
+	 */
+	int alive_offload;
+	/*
+	 * Pack data to the nodes supporting it in bundle frames, one per
+	 * node and loop iteration (when it fits)
+	 */
+	int bundle;
+	/*
+	 * Pace transmission to each node, max rate in kbit/s (0: no pacing).
+	 * The rate of each node is adapted to the losses and round trip time
+	 * of its reliable channels
+	 */
+	unsigned int pace_rate;
+	/*
+	 * Paced frames carry their departure time (SO_TXTIME, CLOCK_TAI),
+	 * for an etf qdisc on the interface. Needs sendmmsg() (no tx ring,
+	 * no xdp, no qdisc bypass), falls back to timer driven pacing
+	 */
+	int txtime;
+	/*
+	 * VIRTIO_RING_F_* offered to the nodes' remote processors and used
+	 * on their vrings. Whether the other side accepted them can't be
+	 * checked, only set the ones it is known to take
+	 */
+	uint32_t vring_features;
+};
+
+extern 	int lininoio_ether_init(const char *netif_name,
+				const struct lininoio_ether_config *cfg);
 
 #endif /* __LININOIO_ETHER_H__ */
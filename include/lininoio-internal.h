@@ -1,8 +1,10 @@
 #ifndef __LININOIO_PROTO_H__
 #define __LININOIO_PROTO_H__
 
+#include <sys/uio.h>
 #include <linux/r2proc_ioctl.h>
 #include "lininoio.h"
+#include "timeout.h"
 
 /*
  * Lininoio transport protocol functions
@@ -13,13 +15,31 @@
 
 struct lininoio_channel;
 struct lininoio_node;
+struct fd_event;
+struct virtio_vring;
 
 struct lininoio_proto_ops {
 	/* Invoked on node creation */
 	int (*connect)(struct lininoio_channel *, struct lininoio_node *);
-	/* Invoked on reception from node */
+	/*
+	 * Invoked on reception from node. Only p->cdlen and p->data are
+	 * valid: data received in a bundle is passed in place, p->type
+	 * overlaps the previous record
+	 */
 	void (*inbound_packet)(struct lininoio_channel *c,
 			       const struct lininoio_data_packet *p);
+	/*
+	 * Invoked on reception of a whole message from node, optional. Gets
+	 * data packets and reassembled fragments, inbound_packet is not
+	 * used when this is set
+	 */
+	void (*inbound_message)(struct lininoio_channel *c,
+				const void *buf, size_t len);
+	/*
+	 * Ask for reliable delivery if the node supports it, needs
+	 * inbound_message
+	 */
+	int reliable;
 
 	/* Invoked on node's death */
 	void (*disconnect)(struct lininoio_channel *, struct lininoio_node *);
@@ -29,6 +49,38 @@ struct lininoio_proto_ops {
 
 struct lininoio_channel;
 
+/* Max length of a fragmented message */
+#define LININOIO_MAX_MSG_LEN		(64 * 1024)
+
+/* Reassembly of a fragmented message, fragments must come in order */
+struct lininoio_reasm {
+	/* Message being reassembled, NULL if none */
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t received;
+	uint8_t msg_id;
+	/* Evicts the message if the next fragment does not come in time */
+	struct timeout to;
+	/* Messages lost: missing fragments, timeouts, no memory */
+	unsigned long dropped;
+};
+
+struct lininoio_rel_stats {
+	/* Sender: packets found lost (SACK holes or timeouts), retransmitted */
+	unsigned long lost;
+	unsigned long retransmits;
+	/* Receiver: packets received out of order, received twice */
+	unsigned long reordered;
+	unsigned long duplicates;
+	/* Receiver: plain data packets, dropped (only rdata is accepted) */
+	unsigned long unreliable;
+	/* Smoothed round trip time, ms (0: no sample yet) */
+	unsigned int srtt;
+};
+
+/* Reliable mode state, private to lininoio-rel.c */
+struct lininoio_rel;
+
 struct lininoio_channel {
 	uint16_t protocol;
 	uint8_t core_id;
@@ -40,6 +92,17 @@ struct lininoio_channel {
 	/* Filled in by channel connect method */
 	int resources_len;
 	struct fw_rsc_hdr *resources;
+	struct lininoio_reasm reasm;
+	/* Id of the next fragmented message sent */
+	uint8_t tx_msg_id;
+	/* Reliable mode, NULL if not enabled */
+	struct lininoio_rel *rel;
+	struct lininoio_rel_stats rel_stats;
+	/*
+	 * Set by the transport when the host posts receive buffers for
+	 * the channel on a vring (see virtio_vring_rx())
+	 */
+	struct virtio_vring *rx_vring;
 	struct list_head list;
 };
 
@@ -48,19 +111,42 @@ struct lininoio_core {
 	/* Name of related remote processor */
 	char rproc_name[33];
 	struct r2p_processor_data pd;
+	/* Remote processor has been added (R2P_ADD_PROC) */
+	int rproc_added;
+	/* pd.start_fd and pd.stop_fd events */
+	struct fd_event *start_evt;
+	struct fd_event *stop_evt;
 	int nchannels;
 	struct list_head channels;
+	/* Virtio backends, private to the transport */
+	struct list_head backends;
 	struct lininoio_node *node;
 };
 
 struct lininoio_node {
 	char name[16];
-	struct timeout *alive_to;
+	/* Last time a packet was received from this node, ms */
+	uint64_t last_seen;
 	struct lininoio_core *cores[LININOIO_MAX_NCORES];
 	int nchannels;
+	/*
+	 * Max payload of a data packet to this node, set by the transport
+	 * from its link MTU (never more than LININOIO_MAX_DLEN)
+	 */
+	int max_dlen;
+	/* Capabilities enabled at association (LININOIO_CAP_*) */
+	uint8_t caps;
+	/* Current transmit rate to this node, bytes/s, 0 if not paced */
+	unsigned int tx_rate;
 	void *ll_data;
+	/*
+	 * Queue a packet made of @iovcnt pieces for transmission. Data is
+	 * gathered into the transmit engine, so buffers can be reused as
+	 * soon as this returns. Queued packets are flushed at the end of
+	 * the current loop iteration
+	 */
 	int (*send_packet)(struct lininoio_node *,
-			   const struct lininoio_packet *p);
+			   const struct iovec *iov, int iovcnt);
 	struct list_head list;
 	struct lininoio_channel *channels[LININOIO_MAX_NCHANNELS];
 };
@@ -74,6 +160,58 @@ extern int lininoio_register_proto_handler(uint16_t proto_id,
 extern int lininoio_send_packet(struct lininoio_node *,
 				const struct lininoio_packet *packet);
 
+extern int lininoio_send_packetv(struct lininoio_node *,
+				 const struct iovec *iov, int iovcnt);
+
+/*
+ * Send message @buf on channel @c of node @n: a data packet, or fragments
+ * if it is too long and the node supports them. A failure can leave a
+ * partial message, evicted by the node. On reliable channels messages
+ * must fit a single packet (EMSGSIZE otherwise) and are queued until
+ * acknowledged (EAGAIN if too many are waiting)
+ */
+extern int lininoio_send_message(struct lininoio_channel *c,
+				 struct lininoio_node *n,
+				 const void *buf, size_t len);
+
+/*
+ * Same as lininoio_send_message(), the message is made of @iovcnt pieces
+ * (LININOIO_MAX_MSG_IOV at most), gathered straight into the packets
+ */
+#define LININOIO_MAX_MSG_IOV		64
+
+extern int lininoio_send_messagev(struct lininoio_channel *c,
+				  struct lininoio_node *n,
+				  const struct iovec *iov, int iovcnt);
+
+/*
+ * Packets received on channel @c, called by the transports. @len is the
+ * received length of fragment @p (at least its header)
+ */
+extern void lininoio_data_inbound(struct lininoio_channel *c,
+				  const struct lininoio_data_packet *p);
+extern void lininoio_frag_inbound(struct lininoio_channel *c,
+				  const struct lininoio_frag_packet *p,
+				  int len);
+
+/* Free the channel's reassembly buffer, before the channel is freed */
+extern void lininoio_reasm_release(struct lininoio_channel *c);
+
+/*
+ * Reliable mode: lininoio_rel_init() enables it on channel @c of node @n
+ * (at association, once the node has agreed), lininoio_send_message()
+ * then sends reliable data. lininoio_rel_release() must be called before
+ * the channel is freed
+ */
+extern int lininoio_rel_init(struct lininoio_channel *c,
+			     struct lininoio_node *n);
+extern void lininoio_rel_release(struct lininoio_channel *c);
+extern int lininoio_rel_send(struct lininoio_channel *c,
+			     const void *buf, size_t len);
+extern void lininoio_rel_inbound(struct lininoio_channel *c,
+				 const struct lininoio_rdata_packet *p,
+				 int len);
+
 extern int lininoio_init(void);
 
 /* FIXME: IS THIS CORRECT HERE ? */
@@ -21,8 +21,20 @@ enum lininoio_packet_type {
 	LININOIO_PACKET_AREQUEST = 1,
 	LININOIO_PACKET_AREPLY = 2,
 	LININOIO_PACKET_DATA = 3,
+	LININOIO_PACKET_BUNDLE = 4,
+	LININOIO_PACKET_FRAG = 5,
+	LININOIO_PACKET_RDATA = 6,
 };
 
+/*
+ * Capability flags, optional byte following the channel descriptors of an
+ * association request (node capabilities) and the association data of an
+ * association reply (capabilities enabled by the host)
+ */
+#define LININOIO_CAP_BUNDLE		0x01
+#define LININOIO_CAP_FRAG		0x02
+#define LININOIO_CAP_RELIABLE		0x04
+
 #define LININOIO_PROTO_MCUIO_V0		0x0001
 #define LININOIO_PROTO_CONSOLE		0x0002
 #define LININOIO_PROTO_RPMSG		0x0003
@@ -66,16 +78,19 @@ struct lininoio_association_data {
 	uint8_t chan_data[0];
 } __attribute__((packed));
 
+/* Max data length in a chan_dlen/cdlen field (12 bits) */
+#define LININOIO_MAX_DLEN		0xfff
+
 static inline uint16_t lininoio_decode_cdlen(uint16_t cdlen, uint8_t *chan_id)
 {
 	if (chan_id)
 		*chan_id = cdlen >> 12;
-	return cdlen & 0xfff;
+	return cdlen & LININOIO_MAX_DLEN;
 }
 
 static inline uint16_t lininoio_encode_cdlen(uint16_t dlen, uint8_t chan_id)
 {
-	return (((uint16_t)chan_id) << 12) | (dlen & 0xfff);
+	return (((uint16_t)chan_id) << 12) | (dlen & LININOIO_MAX_DLEN);
 }
 
 struct lininoio_areply_packet {
@@ -92,4 +107,52 @@ struct lininoio_data_packet {
 	uint8_t data[0];
 } __attribute__((packed));
 
+/* Bundle: data for several channels */
+
+struct lininoio_bundle_record {
+	uint16_t chan_dlen;
+	uint8_t data[0];
+} __attribute__((packed));
+
+struct lininoio_bundle_packet {
+	uint8_t type;
+	uint8_t nrecords;
+	struct lininoio_bundle_record records[0];
+} __attribute__((packed));
+
+#define LININOIO_BUNDLE_MAX_RECORDS	255
+
+/* Fragment of a message too long for a data packet */
+
+#define LININOIO_FRAG_F_FIRST		0x01
+#define LININOIO_FRAG_F_LAST		0x02
+
+struct lininoio_frag_packet {
+	uint8_t type;
+	/* Channel id and fragment length, as in data packets */
+	uint16_t cdlen;
+	uint8_t flags;
+	uint8_t msg_id;
+	uint32_t offset;
+	uint32_t msg_len;
+	uint8_t data[0];
+} __attribute__((packed));
+
+/* Reliable data, on channels in reliable mode */
+
+/* Max number of packets in flight, size of the SACK bitmap */
+#define LININOIO_REL_WINDOW		32
+
+struct lininoio_rdata_packet {
+	uint8_t type;
+	/* Channel id and data length, zero length packets only carry acks */
+	uint16_t cdlen;
+	uint16_t seq;
+	/* Next sequence number expected from the peer on this channel */
+	uint16_t ack;
+	/* Bit i set: ack + 1 + i received */
+	uint32_t sack;
+	uint8_t data[0];
+} __attribute__((packed));
+
 #endif /* __LININOIO_H__ */
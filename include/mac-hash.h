@@ -0,0 +1,45 @@
+#ifndef __MAC_HASH_H__
+#define __MAC_HASH_H__
+
+/*
+ * Open addressing hash index keyed on (6 bytes MAC address, ifindex)
+ * GNU GPLv2 or later
+ */
+
+#include <stdint.h>
+
+#define MAC_HASH_ADDR_LEN 6
+
+struct mac_hash_slot {
+	uint8_t mac[MAC_HASH_ADDR_LEN];
+	/* Slot is in use */
+	uint8_t used;
+	int ifindex;
+	void *data;
+};
+
+struct mac_hash {
+	/* Number of slots, power of 2 */
+	unsigned int size;
+	unsigned int count;
+	struct mac_hash_slot *slots;
+	/* Last found slot, for back to back lookups of the same key */
+	struct mac_hash_slot *last;
+};
+
+/* @size is a hint for the initial number of entries */
+extern int mac_hash_init(struct mac_hash *, unsigned int size);
+
+extern void mac_hash_destroy(struct mac_hash *);
+
+/* Returns -1 on allocation error or if the key is already there */
+extern int mac_hash_add(struct mac_hash *, const uint8_t *mac, int ifindex,
+			void *data);
+
+extern void *mac_hash_find(struct mac_hash *, const uint8_t *mac,
+			   int ifindex);
+
+/* Returns -1 if the key is not there */
+extern int mac_hash_del(struct mac_hash *, const uint8_t *mac, int ifindex);
+
+#endif /* __MAC_HASH_H__ */
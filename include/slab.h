@@ -0,0 +1,40 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+/*
+ * Simple slab allocator for fixed size objects
+ * GNU GPLv2 or later
+ */
+
+#include <stddef.h>
+#include "list.h"
+
+/* Objects are aligned to and padded to a multiple of this */
+#define SLAB_CACHE_LINE 64
+
+struct slab_cache {
+	/* Object size, cache line aligned */
+	size_t obj_size;
+	unsigned int objs_per_slab;
+	/* Max number of allocated objects, 0 means no limit */
+	unsigned int max_objs;
+	/* Number of allocated objects */
+	unsigned int nobjs;
+	/* Free objects, linked through their first word */
+	void *free_list;
+	struct list_head slabs;
+};
+
+extern int slab_cache_init(struct slab_cache *, size_t obj_size,
+			   unsigned int objs_per_slab, unsigned int max_objs);
+
+/* Frees all the slabs, allocated objects included */
+extern void slab_cache_destroy(struct slab_cache *);
+
+/* O(1) unless a new slab is needed. Returns NULL when max_objs is reached */
+extern void *slab_alloc(struct slab_cache *);
+
+/* O(1), memory is kept in the cache */
+extern void slab_free(struct slab_cache *, void *);
+
+#endif /* __SLAB_H__ */
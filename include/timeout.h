@@ -10,18 +10,80 @@
 #define __TIMEOUT_H__
 
 #include <stdio.h>
+#include <stdint.h>
+
+#include "list.h"
 
 struct timeout ;
+struct event_loop;
+struct timer_wheel;
 
 typedef void (to_handler)(struct timeout *t, void *priv);
 
+/*
+ * Timeouts can be embedded in the user's structures, in this case they must
+ * be initialized with init_timeout() and armed/re-armed with mod_timeout(),
+ * which never allocates memory. Fields are private to timeout.c
+ */
+struct timeout {
+	/* Absolute expiry tick */
+	uint64_t expires;
+	to_handler *handler;
+	void *priv;
+	struct list_head list;
+	int level;
+	int slot;
+	unsigned int flags;
+	/* Timers of the loop the timeout belongs to */
+	struct timer_wheel *wheel;
+};
+
+/*
+ * Needs fd events, timeouts are run by a timerfd fd event.
+ * timeouts_init() sets up the timers of the calling thread's default loop,
+ * the functions with no loop argument work on them. Loops created with
+ * event_loop_new() already have their timers.
+ */
 extern int timeouts_init(void);
+extern int loop_timeouts_init(struct event_loop *);
+
+/*
+ * Cached CLOCK_MONOTONIC time in milliseconds, refreshed by the fd events
+ * backends each time they wake up. Timeouts are relative to this time.
+ */
+extern uint64_t timeouts_now(void);
+extern uint64_t loop_timeouts_now(struct event_loop *);
+extern void timeouts_update_clock(void);
 
 extern struct timeout *schedule_timeout(unsigned long ms,
 					to_handler *toh, void *priv);
+extern struct timeout *loop_schedule_timeout(struct event_loop *,
+					     unsigned long ms,
+					     to_handler *toh, void *priv);
 extern void cancel_timeout(struct timeout *);
+
+/*
+ * Embedded timeouts, bound to a loop by init. mod_timeout() and
+ * del_timeout() must be called by the thread running that loop
+ */
+extern void init_timeout(struct timeout *, to_handler *toh, void *priv);
+extern void loop_init_timeout(struct event_loop *, struct timeout *,
+			      to_handler *toh, void *priv);
+/* (Re)arm timeout to expire in @ms milliseconds */
+extern void mod_timeout(struct timeout *, unsigned long ms);
+/* Disarm timeout, no-op if not pending */
+extern void del_timeout(struct timeout *);
+
+static inline int timeout_pending(const struct timeout *to)
+{
+	return !list_empty(&to->list);
+}
+
+/* For users running their own select() loop */
 extern struct timeval *get_next_timeout(void);
+extern struct timeval *loop_get_next_timeout(struct event_loop *);
 extern void handle_timeouts(void);
+extern void loop_handle_timeouts(struct event_loop *);
 extern void print_timeouts(FILE *);
 
 
@@ -6,6 +6,7 @@
 
 struct udev_event;
 struct udev_device;
+struct event_loop;
 
 typedef void (*uevent_cb)(struct udev_device *dev, const char *path,
 			  void *priv);
@@ -15,9 +16,20 @@ enum udev_event_id {
 	udev_del_virtio_backend = 2,
 };
 
+/*
+ * The functions with no loop argument work on the calling thread's default
+ * loop (see fd_event.h)
+ */
 extern int schedule_udev_event(enum udev_event_id, uevent_cb cb, void *cb_data);
+extern int loop_schedule_udev_event(struct event_loop *, enum udev_event_id,
+				    uevent_cb cb, void *cb_data);
+
+/* Cancel all the events scheduled with @cb_data */
+extern void cancel_udev_events(void *cb_data);
+extern void loop_cancel_udev_events(struct event_loop *, void *cb_data);
 
 extern int udev_events_init(void);
+extern int loop_udev_events_init(struct event_loop *);
 
 
 #endif /* __UDEV_EVENTS_H__ */
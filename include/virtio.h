@@ -7,6 +7,118 @@
 #ifndef __VIRTIO_H__
 #define __VIRTIO_H__
 
+#include <limits.h>
+#include <sys/uio.h>
+#include "list.h"
+#include "virtqueue.h"
+
+struct fd_event;
+struct udev_device;
+
+/*
+ * Device side of a vring living in the r2proc reserved memory: the ring
+ * is at the start of the mapping (@phys physical), buffers are somewhere
+ * else in it. The vring device fd works like an eventfd: it is readable
+ * when the other side kicks, writing to it interrupts the other side.
+ */
+struct virtio_vring {
+	int fd;
+	struct virtqueue *vq;
+	struct metal_io_region io;
+	metal_phys_addr_t phys;
+	/* Pieces of a chain, heads of the chains taken by a drain */
+	struct iovec *iov;
+	uint16_t *heads;
+	/* Chains consumed and not returned yet */
+	struct vring_used_elem *used;
+	int nused;
+	/* In the list of vrings to complete at the end of the loop iteration */
+	struct list_head pending;
+	/* Chains returned unprocessed: bad descriptors or handler errors */
+	unsigned long dropped;
+	/*
+	 * The last drain stopped on a handler's EAGAIN, the chains left are
+	 * still available: drain again when there's room (or on a kick)
+	 */
+	int stalled;
+	/*
+	 * When the other side should kick after a drain (SHORT by default).
+	 * With LONG or EMPTIED the ring must be drained on other events too
+	 */
+	vq_postpone_t postpone;
+	/* Interrupts sent, interrupts the other side asked not to get */
+	unsigned long interrupts;
+	unsigned long interrupts_avoided;
+	/* Receive: data waiting for buffers, in virtio_rx_pkt's */
+	struct list_head backlog;
+	size_t backlog_len;
+	/* Receive: data dropped (too long, backlog full), backlogged */
+	unsigned long rx_dropped;
+	unsigned long rx_backlogged;
+};
+
+/*
+ * Max descriptors in an indirect table (VIRTIO_RING_F_INDIRECT_DESC), longer
+ * chains are dropped. Same as LININOIO_MAX_MSG_IOV
+ */
+#define VIRTIO_VRING_MAX_INDIRECT 64
+
+/* Max data waiting for the other side's receive buffers, per vring */
+#define VIRTIO_VRING_BACKLOG (64 * 1024)
+
+struct virtio_rx_pkt {
+	struct list_head list;
+	size_t len;
+	uint8_t data[0];
+};
+
+/*
+ * Invoked by virtio_vring_drain() with the readable buffers of a chain,
+ * which go back to the other side on return. Returns < 0 on error: with
+ * errno EAGAIN the chain is kept and passed again by the next drain
+ */
+typedef int (virtio_chain_handler)(void *priv, const struct iovec *iov,
+				   int iovcnt);
+
+/*
+ * Attach to the vring of geometry @ring (vaddr ignored) at the start of
+ * the @size bytes at @mem, which the other side sees at @phys. @features
+ * are the negotiated VIRTIO_RING_F_* (EVENT_IDX and INDIRECT_DESC are
+ * supported)
+ */
+extern int virtio_vring_init(struct virtio_vring *, int fd, void *mem,
+			     size_t size, unsigned long phys,
+			     const struct vring_alloc_info *ring,
+			     uint32_t features);
+extern void virtio_vring_release(struct virtio_vring *);
+
+/* Consume the kick which made fd readable */
+extern void virtio_vring_ack(struct virtio_vring *);
+
+/*
+ * Pass all the available chains to @h, then return them with a single
+ * used ring update and interrupt the other side. Stops at the first chain
+ * @h can't take yet (EAGAIN), setting vr->stalled. Malformed chains are
+ * returned unprocessed and counted. Returns the number of chains consumed
+ */
+extern int virtio_vring_drain(struct virtio_vring *,
+			      virtio_chain_handler *h, void *priv);
+
+/*
+ * Receive: copy @len bytes at @buf to the next buffer chain posted by the
+ * other side, or to the backlog if there is none. Chains are returned at
+ * the end of the loop iteration, all together. Returns -1 if data was
+ * dropped
+ */
+extern int virtio_vring_rx(struct virtio_vring *, const void *buf,
+			   size_t len);
+
+/*
+ * Receive: the other side kicked, new buffers are there for the backlog.
+ * Returns the number of backlogged packets delivered
+ */
+extern int virtio_vring_rx_kick(struct virtio_vring *);
+
 struct virtio_backend {
 	char devname[PATH_MAX];
 	int fd;
@@ -14,6 +126,26 @@ struct virtio_backend {
 	void *vring_ptr;
 	unsigned long phy_offset;
 	size_t phy_len;
+	struct virtio_vring vr;
+	int rx;
+	virtio_chain_handler *handler;
+	void *handler_priv;
+};
+
+/*
+ * Optional virtio_backend_add() private data: geometry of the vring and
+ * handler of the chains made available by the other side
+ */
+struct virtio_backend_cfg {
+	unsigned int num;
+	unsigned int align;
+	/* Receive vring: buffers are kept for virtio_vring_rx() */
+	int rx;
+	/* VIRTIO_RING_F_* negotiated, postpone hint (see virtio_vring) */
+	uint32_t features;
+	vq_postpone_t postpone;
+	virtio_chain_handler *handler;
+	void *priv;
 };
 
 void virtio_backend_add(struct udev_device *dev, const char *path, void *priv);
@@ -121,7 +121,9 @@ struct vring {
  * versa. They are at the end for backwards compatibility.
  */
 #define vring_used_event(vr)	((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr)	((vr)->used->ring[(vr)->num].id & 0xFFFF)
+/* used->ring[num], as a u16 after the header and the num elements */
+#define vring_avail_event(vr)	\
+	(((uint16_t *)(vr)->used)[2 + (vr)->num * 4])
 
 static inline int vring_size(unsigned int num, unsigned long align)
 {
@@ -66,6 +66,8 @@ typedef uint8_t boolean;
 #define VQ_RING_DESC_CHAIN_END                         32768
 #define VIRTQUEUE_FLAG_INDIRECT                        0x0001
 #define VIRTQUEUE_FLAG_EVENT_IDX                       0x0002
+/* Device (consumer) side, see virtqueue_attach() */
+#define VIRTQUEUE_FLAG_DEVICE                          0x0004
 #define VIRTQUEUE_MAX_NAME_SZ                          32
 
 /* Support for indirect buffer descriptors. */
@@ -131,17 +133,22 @@ struct virtqueue {
 	/*
 	 * Used by the host side during callback. Cookie
 	 * holds the address of buffer received from other side.
-	 * Other fields in this structure are not used currently.
+	 * Indirect is the table of the descriptor, if any (see
+	 * virtqueue_init_indirect()).
 	 */
 
 	struct vq_desc_extra {
 		void *cookie;
 		struct vring_desc *indirect;
-		uint32_t indirect_paddr;
+		metal_phys_addr_t indirect_paddr;
 		uint16_t ndescs;
 	} vq_descx[0];
 };
 
+/* Bytes of the indirect tables of a ring of num descriptors */
+#define vring_indirect_size(num, max_indirect) \
+	((num) * (max_indirect) * sizeof(struct vring_desc))
+
 /* struct to hold vring specific information */
 struct vring_alloc_info {
 	void *vaddr;
@@ -200,25 +207,55 @@ int virtqueue_create(struct virtio_device *device, unsigned short id,
 		     struct metal_io_region *shm_io,
 		     struct virtqueue **v_queue);
 
+int virtqueue_attach(struct virtio_device *device, unsigned short id,
+		     char *name, struct vring_alloc_info *ring,
+		     void (*callback) (struct virtqueue * vq),
+		     void (*notify) (struct virtqueue * vq),
+		     struct metal_io_region *shm_io,
+		     struct virtqueue **v_queue);
+
+int virtqueue_init_indirect(struct virtqueue *vq, void *mem, int max_indirect);
+
 int virtqueue_add_buffer(struct virtqueue *vq, struct metal_sg *sg,
 			 int readable, int writable, void *cookie);
 
+int virtqueue_add_buffers(struct virtqueue *vq, struct metal_sg *sg,
+			  const int *readable, const int *writable,
+			  void **cookies, int n);
+
 int virtqueue_add_single_buffer(struct virtqueue *vq, void *cookie,
 				struct metal_sg *sg, int writable,
 				boolean has_next);
 
 void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t * len, uint16_t *idx);
 
+int virtqueue_get_buffers(struct virtqueue *vq, void **cookies,
+			  uint32_t *len, int max);
+
 void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t * avail_idx,
 				     uint32_t * len);
 
+int virtqueue_get_available_buffers(struct virtqueue *vq, uint16_t *heads,
+				    int max);
+
 int virtqueue_add_consumed_buffer(struct virtqueue *vq, uint16_t head_idx,
 				  uint32_t len);
 
+int virtqueue_add_consumed_buffers(struct virtqueue *vq,
+				   const struct vring_used_elem *used, int n);
+
 void virtqueue_disable_cb(struct virtqueue *vq);
 
 int virtqueue_enable_cb(struct virtqueue *vq);
 
+int virtqueue_postpone_cb(struct virtqueue *vq, vq_postpone_t hint);
+
+int virtqueue_enable_notify(struct virtqueue *vq, vq_postpone_t hint);
+
+void virtqueue_disable_notify(struct virtqueue *vq);
+
+int virtqueue_need_interrupt(struct virtqueue *vq, uint16_t old_idx);
+
 void virtqueue_kick(struct virtqueue *vq);
 
 void virtqueue_free(struct virtqueue *vq);
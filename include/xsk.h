@@ -0,0 +1,76 @@
+#ifndef __XSK_H__
+#define __XSK_H__
+
+/*
+ * AF_XDP sockets: a single queue XSK with its own UMEM, plus the XDP
+ * program redirecting frames of a given ethertype to it.
+ * Only available if built with CONFIG_EBPF
+ *
+ * GNU GPLv2 or later
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Entries of each ring, must be a power of 2 */
+#define XSK_RING_SIZE 1024
+/* UMEM frames, the first half is for rx (fill ring), the rest for tx */
+#define XSK_FRAME_NR (2 * XSK_RING_SIZE)
+#define XSK_FRAME_SIZE 2048
+
+/* Use native XDP (zero copy if the driver supports it), default is generic */
+#define XSK_F_DRV 0x1
+
+struct xsk_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *ring;
+	void *map;
+	size_t map_size;
+};
+
+struct xsk {
+	int fd;
+	int map_fd;
+	int prog_fd;
+	/* XDP link, program is detached when this is closed */
+	int link_fd;
+	void *umem;
+	struct xsk_ring fill;
+	struct xsk_ring comp;
+	struct xsk_ring rx;
+	struct xsk_ring tx;
+	/* Free tx frames (umem addresses) */
+	uint64_t tx_free[XSK_RING_SIZE];
+	unsigned int tx_nfree;
+};
+
+typedef void (*xsk_rx_cb)(void *cb_data, const void *frame, int len);
+
+/*
+ * Create an XSK bound to @queue_id of @ifindex and attach an XDP program
+ * redirecting frames with ethertype @eth_type to it. Everything else,
+ * including @eth_type frames received on other queues, goes to the stack
+ */
+extern int xsk_open(struct xsk *, int ifindex, int queue_id,
+		    uint16_t eth_type, unsigned int flags);
+
+extern void xsk_close(struct xsk *);
+
+/* Invoke @cb for every received frame, returns number of frames */
+extern int xsk_rx(struct xsk *, xsk_rx_cb cb, void *cb_data);
+
+/*
+ * Get a tx frame buffer of XSK_FRAME_SIZE bytes, NULL if none is free.
+ * The frame is owned by the caller until xsk_tx_submit()
+ */
+extern void *xsk_tx_reserve(struct xsk *);
+
+/* Queue frame @buf (from xsk_tx_reserve()) for transmission */
+extern void xsk_tx_submit(struct xsk *, void *buf, unsigned int len);
+
+/* Make the kernel send submitted frames and reclaim completed ones */
+extern void xsk_tx_kick(struct xsk *);
+
+#endif /* __XSK_H__ */
@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <endian.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/types.h>
@@ -13,6 +14,7 @@
 #include "lininoio-proto-handler.h"
 #include "remoteproc.h"
 #include "fd_event.h"
+#include "virtio.h"
 
 struct console_channel_resources {
 	struct fw_rsc_hdr h;
@@ -70,16 +72,20 @@ static void
 lininoio_console_inbound_packet(struct lininoio_channel *c,
 				const struct lininoio_data_packet *p)
 {
-	//struct console_channel *cc = c->priv;
-	uint16_t len = lininoio_decode_cdlen(p->cdlen, NULL);
-	//struct console_client *client;
+	uint16_t len = lininoio_decode_cdlen(le16toh(p->cdlen), NULL);
 
 	if (!c->priv) {
 		pr_err("%s: channel private data pointer is NULL\n", __func__);
 		return;
 	}
-	/* SEND */
 	pr_debug("%s, len = %u\n", __func__, len);
+	if (!c->rx_vring) {
+		pr_debug("%s: no receive vring yet, dropped\n", __func__);
+		return;
+	}
+	/* p is still in the transport's receive buffer (rx ring) */
+	if (virtio_vring_rx(c->rx_vring, p->data, len) < 0)
+		pr_debug("%s: %u bytes dropped\n", __func__, len);
 }
 
 static void lininoio_console_disconnect(struct lininoio_channel *c,
@@ -134,6 +134,20 @@ static void lininoio_mcuio_inbound_packet(struct lininoio_channel *c,
 		pr_err("%s: write(): %s\n", __func__, strerror(errno));
 }
 
+/* Same, reliable mode: whole messages, in order */
+static void lininoio_mcuio_inbound_message(struct lininoio_channel *c,
+					   const void *buf, size_t len)
+{
+	struct lininoio_mcuio_bus *bus = c->priv;
+
+	if (!bus) {
+		pr_err("%s: channel private data pointer is NULL\n", __func__);
+		return;
+	}
+	if (write(bus->fd, buf, len) < 0)
+		pr_err("%s: write(): %s\n", __func__, strerror(errno));
+}
+
 static void lininoio_mcuio_disconnect(struct lininoio_channel *c,
 				      struct lininoio_node *n)
 {
@@ -160,6 +174,9 @@ static void lininoio_mcuio_disconnect(struct lininoio_channel *c,
 static const struct lininoio_proto_ops mcuio_ops = {
 	.connect = lininoio_mcuio_connect,
 	.inbound_packet = lininoio_mcuio_inbound_packet,
+	.inbound_message = lininoio_mcuio_inbound_message,
+	/* mcuio requests must not be lost or reordered */
+	.reliable = 1,
 	.disconnect = lininoio_mcuio_disconnect,
 };
 
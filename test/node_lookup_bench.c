@@ -0,0 +1,124 @@
+/*
+ * Node lookup benchmark: linear list scan (old mac_to_node()) vs mac hash
+ * index, with 1 to 4096 nodes.
+ *
+ * GNU GPLv2 or later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "list.h"
+#include "logger.h"
+#include "mac-hash.h"
+
+#define DEFAULT_LOOKUPS 1000000
+#define MAX_NODES 4096
+#define IFINDEX 2
+
+struct node {
+	uint8_t mac[MAC_HASH_ADDR_LEN];
+	struct list_head list;
+};
+
+static struct node nodes[MAX_NODES];
+/* Random sequence of node indexes, generated outside the timed loops */
+static int *seq;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct node *list_lookup(struct list_head *h, const uint8_t *mac)
+{
+	struct node *n;
+
+	list_for_each_entry(n, h, list)
+		if (!memcmp(n->mac, mac, sizeof(n->mac)))
+			return n;
+	return NULL;
+}
+
+static int run(int n, int lookups)
+{
+	struct list_head head;
+	struct mac_hash h;
+	uint64_t start;
+	double t_list, t_hash, t_b2b;
+	int i, found = 0;
+
+	INIT_LIST_HEAD(&head);
+	if (mac_hash_init(&h, 0) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		list_add_tail(&nodes[i].list, &head);
+		if (mac_hash_add(&h, nodes[i].mac, IFINDEX, &nodes[i]) < 0) {
+			pr_err("Error adding node to hash\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < lookups; i++)
+		seq[i] = rand() % n;
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++)
+		found += !!list_lookup(&head, nodes[seq[i]].mac);
+	t_list = (double)(now_ns() - start) / lookups;
+
+	start = now_ns();
+	for (i = 0; i < lookups; i++)
+		found += !!mac_hash_find(&h, nodes[seq[i]].mac, IFINDEX);
+	t_hash = (double)(now_ns() - start) / lookups;
+
+	/* Bursts of 16 frames from the same node */
+	start = now_ns();
+	for (i = 0; i < lookups; i++)
+		found += !!mac_hash_find(&h, nodes[seq[i >> 4]].mac, IFINDEX);
+	t_b2b = (double)(now_ns() - start) / lookups;
+
+	mac_hash_destroy(&h);
+	if (found != lookups * 3) {
+		pr_err("Lookup failed\n");
+		return -1;
+	}
+	printf("%5d nodes: list %8.1f ns, hash %6.1f ns, "
+	       "hash back to back %6.1f ns\n", n, t_list, t_hash, t_b2b);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n, lookups = DEFAULT_LOOKUPS;
+
+	logger_init(stderr, "node_lookup_bench");
+	if (argc > 1)
+		lookups = atoi(argv[1]);
+	if (lookups <= 0) {
+		fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+		exit(127);
+	}
+	seq = malloc(lookups * sizeof(*seq));
+	if (!seq) {
+		perror("malloc");
+		exit(127);
+	}
+	srand(1);
+	/* Same OUI for all nodes, like a real deployment */
+	for (i = 0; i < MAX_NODES; i++) {
+		nodes[i].mac[0] = 0x02;
+		nodes[i].mac[1] = 0x00;
+		nodes[i].mac[2] = 0x5e;
+		nodes[i].mac[3] = i >> 8;
+		nodes[i].mac[4] = i;
+		nodes[i].mac[5] = rand();
+	}
+	for (n = 1; n <= MAX_NODES; n *= 2)
+		if (run(n, lookups) < 0)
+			exit(127);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Reliable mode test: two lininoio_rel endpoints exchange messages both
+ * ways over a memory link which loses and reorders packets. Every message
+ * must be delivered once and in order, and the loss, retransmission and
+ * reorder counters must have seen the link's misbehaviour.
+ *
+ * GNU GPLv2 or later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include "common.h"
+#include "fd_event.h"
+#include "timeout.h"
+#include "logger.h"
+#include "lininoio-internal.h"
+
+#define DEFAULT_MSGS 5000
+/* Link: percentage of packets lost, max delay (ms, reorders packets) */
+#define LOSS_PERCENT 10
+#define MAX_DELAY 4
+/* Give up after this, ms */
+#define DEADLINE 30000
+#define MSG_LEN 64
+
+struct endpoint {
+	const char *name;
+	struct lininoio_node n;
+	struct lininoio_channel c;
+	struct endpoint *peer;
+	/* Next message to send, next expected */
+	uint32_t tx_next;
+	uint32_t rx_next;
+	int errors;
+};
+
+struct link_pkt {
+	struct endpoint *to;
+	int len;
+	uint8_t data[0];
+};
+
+static struct endpoint ep[2];
+static uint32_t nmsgs = DEFAULT_MSGS;
+static unsigned long link_sent, link_lost;
+
+static void link_deliver(struct timeout *t, void *_p)
+{
+	struct link_pkt *p = _p;
+
+	lininoio_rel_inbound(&p->to->c, (void *)p->data, p->len);
+	free(p);
+}
+
+/* n->send_packet(): lose, or deliver after a random delay */
+static int link_send(struct lininoio_node *n, const struct iovec *iov,
+		     int iovcnt)
+{
+	struct endpoint *from = container_of(n, struct endpoint, n);
+	struct link_pkt *p;
+	int i, len = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	link_sent++;
+	if (rand() % 100 < LOSS_PERCENT) {
+		link_lost++;
+		return len;
+	}
+	p = malloc(sizeof(*p) + len);
+	if (!p)
+		return -1;
+	p->to = from->peer;
+	p->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&p->data[p->len], iov[i].iov_base, iov[i].iov_len);
+		p->len += iov[i].iov_len;
+	}
+	if (!schedule_timeout(rand() % (MAX_DELAY + 1), link_deliver, p)) {
+		free(p);
+		return -1;
+	}
+	return len;
+}
+
+static void inbound_message(struct lininoio_channel *c, const void *buf,
+			    size_t len)
+{
+	struct endpoint *e = container_of(c, struct endpoint, c);
+	uint32_t id;
+
+	if (len != MSG_LEN) {
+		pr_err("%s: message of %zu bytes\n", e->name, len);
+		e->errors++;
+		return;
+	}
+	memcpy(&id, buf, sizeof(id));
+	if (id != e->rx_next) {
+		pr_err("%s: got message %u, expected %u\n", e->name, id,
+		       e->rx_next);
+		e->errors++;
+	}
+	e->rx_next = id + 1;
+}
+
+static const struct lininoio_proto_ops ops = {
+	.inbound_message = inbound_message,
+	.reliable = 1,
+};
+
+/* Send as many messages as the backlog takes, once per loop iteration */
+static void fill(void *_e)
+{
+	struct endpoint *e = _e;
+	uint8_t buf[MSG_LEN];
+
+	while (e->tx_next < nmsgs) {
+		memset(buf, e->tx_next, sizeof(buf));
+		memcpy(buf, &e->tx_next, sizeof(e->tx_next));
+		if (lininoio_send_message(&e->c, &e->n, buf, sizeof(buf)) < 0) {
+			if (errno != EAGAIN) {
+				pr_err("%s: send: %s\n", e->name,
+				       strerror(errno));
+				e->errors++;
+			}
+			return;
+		}
+		e->tx_next++;
+	}
+}
+
+static int setup(struct endpoint *e, const char *name, struct endpoint *peer)
+{
+	memset(e, 0, sizeof(*e));
+	e->name = name;
+	e->peer = peer;
+	e->n.send_packet = link_send;
+	e->n.caps = LININOIO_CAP_RELIABLE;
+	e->n.nchannels = 1;
+	e->n.channels[0] = &e->c;
+	e->c.ops = &ops;
+	if (lininoio_rel_init(&e->c, &e->n) < 0)
+		return -1;
+	return fd_events_add_post_cb(fill, e);
+}
+
+static int done(void)
+{
+	return ep[0].rx_next >= nmsgs && ep[1].rx_next >= nmsgs;
+}
+
+static int check(struct endpoint *e)
+{
+	struct lininoio_rel_stats *s = &e->c.rel_stats;
+	int ret = e->errors ? -1 : 0;
+
+	printf("%s: received %u, lost %lu, retransmits %lu, reordered %lu, "
+	       "duplicates %lu, srtt %u ms\n", e->name, e->rx_next, s->lost,
+	       s->retransmits, s->reordered, s->duplicates, s->srtt);
+	if (e->rx_next != nmsgs) {
+		pr_err("%s: %u messages missing\n", e->name,
+		       nmsgs - e->rx_next);
+		ret = -1;
+	}
+	/* Enough messages both ways for the link to have hit them all */
+	if (!s->lost || !s->retransmits || !s->reordered || !s->srtt) {
+		pr_err("%s: counters missed the link's losses or reordering\n",
+		       e->name);
+		ret = -1;
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t start;
+	int ret;
+
+	logger_init(stderr, "rel_test");
+	logger_log_upto(LOG_INFO);
+	if (argc > 1)
+		nmsgs = atoi(argv[1]);
+	if (nmsgs < 1000) {
+		fprintf(stderr, "Usage: %s [messages, at least 1000]\n",
+			argv[0]);
+		exit(127);
+	}
+	if (fd_events_init() < 0 || timeouts_init() < 0 ||
+	    lininoio_init() < 0) {
+		pr_err("Error initializing\n");
+		exit(127);
+	}
+	srand(1);
+	if (setup(&ep[0], "a", &ep[1]) < 0 || setup(&ep[1], "b", &ep[0]) < 0) {
+		pr_err("Error setting up endpoints\n");
+		exit(127);
+	}
+	fill(&ep[0]);
+	fill(&ep[1]);
+	start = timeouts_now();
+	while (!done() && timeouts_now() - start < DEADLINE)
+		if (fd_events_wait(NULL) < 0 && errno != EINTR) {
+			pr_err("fd_events_wait: %s\n", strerror(errno));
+			exit(127);
+		}
+	printf("link: %lu packets, %lu lost, %lu ms\n", link_sent, link_lost,
+	       (unsigned long)(timeouts_now() - start));
+	ret = check(&ep[0]);
+	ret |= check(&ep[1]);
+	lininoio_rel_release(&ep[0].c);
+	lininoio_rel_release(&ep[1].c);
+	printf("%s\n", ret ? "FAILED" : "OK");
+	return ret ? 1 : 0;
+}
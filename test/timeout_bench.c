@@ -0,0 +1,245 @@
+/*
+ * Timeouts engine benchmark: per packet cost of the alive timeout
+ * refresh (cancel + schedule) with an increasing number of live timeouts.
+ * Wheel operations are O(1), but above about 10k live timeouts the cost
+ * grows with the working set: each refresh touches a random timeout and
+ * its list neighbours, which are less and less likely to be in cache.
+ *
+ * Then timeouts spread over all the wheel levels are expired on a fake
+ * clock jumping forward by random steps, crossing every level's cascades:
+ * each must fire at the first handle_timeouts() after its expiry, never
+ * before, and in expiry order.
+ *
+ * GNU GPLv2 or later
+ */
+#define _GNU_SOURCE /* RTLD_NEXT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "fd_event.h"
+#include "timeout.h"
+#include "logger.h"
+
+#define DEFAULT_OPS 1000000
+#define ALIVE_TIMEOUT 2000
+
+/* Expiry run: timeouts, up to 2^EXPIRE_BITS ms, clock steps up to ms */
+#define EXPIRE_TIMEOUTS 100000
+#define EXPIRE_BITS 24
+#define MAX_STEP 512
+
+static const int live_timers[] = { 1, 100, 1000, 10000, 100000, 1000000, };
+
+/* When not 0, CLOCK_MONOTONIC as seen by the timeouts engine, ms */
+static uint64_t fake_ms;
+
+/* Interposed on the C library's for the engine */
+int clock_gettime(clockid_t id, struct timespec *ts)
+{
+	static int (*real)(clockid_t, struct timespec *);
+
+	if (fake_ms && id == CLOCK_MONOTONIC) {
+		ts->tv_sec = fake_ms / 1000;
+		ts->tv_nsec = (fake_ms % 1000) * 1000000;
+		return 0;
+	}
+	if (!real)
+		real = dlsym(RTLD_NEXT, "clock_gettime");
+	return real(id, ts);
+}
+
+static void dummy_handler(struct timeout *t, void *priv)
+{
+}
+
+/* Not faked */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* cancel_timeout() + schedule_timeout() per packet */
+static double run_alloc(int n, int ops)
+{
+	struct timeout **t;
+	uint64_t start, stop;
+	int i, j;
+
+	t = calloc(n, sizeof(*t));
+	if (!t) {
+		perror("calloc");
+		return -1;
+	}
+	/* Spread live timeouts over the alive period */
+	for (i = 0; i < n; i++) {
+		t[i] = schedule_timeout(rand() % ALIVE_TIMEOUT + 1,
+					dummy_handler, NULL);
+		if (!t[i]) {
+			pr_err("Error scheduling timeout\n");
+			return -1;
+		}
+	}
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		/* One packet from a random node: refresh its alive timeout */
+		j = rand() % n;
+		cancel_timeout(t[j]);
+		t[j] = schedule_timeout(ALIVE_TIMEOUT, dummy_handler, NULL);
+	}
+	stop = now_ns();
+	for (i = 0; i < n; i++)
+		cancel_timeout(t[i]);
+	free(t);
+	return (double)(stop - start) / ops;
+}
+
+/* mod_timeout() of an embedded timeout per packet */
+static double run_embedded(int n, int ops)
+{
+	struct timeout *t;
+	uint64_t start, stop;
+	int i;
+
+	t = calloc(n, sizeof(*t));
+	if (!t) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		init_timeout(&t[i], dummy_handler, NULL);
+		mod_timeout(&t[i], rand() % ALIVE_TIMEOUT + 1);
+	}
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		mod_timeout(&t[rand() % n], ALIVE_TIMEOUT);
+	stop = now_ns();
+	for (i = 0; i < n; i++)
+		del_timeout(&t[i]);
+	free(t);
+	return (double)(stop - start) / ops;
+}
+
+static int run(int n, int ops)
+{
+	double a, e;
+
+	a = run_alloc(n, ops);
+	e = run_embedded(n, ops);
+	if (a < 0 || e < 0)
+		return -1;
+	printf("%8d live timeouts: %7.1f ns/packet (schedule/cancel), "
+	       "%7.1f ns/packet (mod_timeout)\n", n, a, e);
+	return 0;
+}
+
+struct expiry {
+	struct timeout t;
+	uint64_t expires;
+};
+
+/* Fake clock at the previous handle_timeouts(), last expiry fired */
+static uint64_t prev_ms, last_expires;
+static unsigned long fired, early, late, misordered;
+
+static void expiry_handler(struct timeout *t, void *priv)
+{
+	struct expiry *e = priv;
+
+	fired++;
+	if (e->expires > fake_ms)
+		early++;
+	/* Should have fired at the previous handle_timeouts() */
+	else if (e->expires <= prev_ms)
+		late++;
+	if (e->expires < last_expires)
+		misordered++;
+	last_expires = e->expires;
+}
+
+/*
+ * Leaves the wheel hours ahead of the real clock, later timeouts would
+ * expire at the first handle_timeouts(): run last
+ */
+static int run_expiry(int n)
+{
+	struct expiry *e;
+	struct timespec ts;
+	uint64_t start, stop, end;
+	unsigned long steps = 0;
+	int i;
+
+	e = calloc(n, sizeof(*e));
+	if (!e) {
+		perror("calloc");
+		return -1;
+	}
+	/* Not behind the wheel, at an odd offset from the level boundaries */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	fake_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1009;
+	handle_timeouts();
+	prev_ms = fake_ms;
+	fired = early = late = misordered = last_expires = 0;
+	for (i = 0; i < n; i++) {
+		/* As many in each power of two: all the levels get some */
+		e[i].expires = fake_ms + 1 +
+			rand() % (1UL << (rand() % EXPIRE_BITS));
+		init_timeout(&e[i].t, expiry_handler, &e[i]);
+		mod_timeout(&e[i].t, e[i].expires - fake_ms);
+	}
+	end = fake_ms + (1UL << EXPIRE_BITS);
+	start = now_ns();
+	while (fake_ms <= end) {
+		prev_ms = fake_ms;
+		fake_ms += 1 + rand() % MAX_STEP;
+		handle_timeouts();
+		steps++;
+	}
+	stop = now_ns();
+	for (i = 0; i < n; i++)
+		del_timeout(&e[i].t);
+	free(e);
+	fake_ms = 0;
+	printf("%8d timeouts over %lu s, %lu clock steps: %lu fired, "
+	       "%lu early, %lu late, %lu out of order, %.1f ns/expiry\n", n,
+	       (unsigned long)(1UL << EXPIRE_BITS) / 1000, steps, fired, early,
+	       late, misordered, (double)(stop - start) / n);
+	if (fired != n || early || late || misordered) {
+		pr_err("Timeouts not expired on time\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ops = DEFAULT_OPS;
+
+	logger_init(stderr, "timeout_bench");
+	if (argc > 1)
+		ops = atoi(argv[1]);
+	if (ops <= 0) {
+		fprintf(stderr, "Usage: %s [packets]\n", argv[0]);
+		exit(127);
+	}
+	if (fd_events_init() < 0) {
+		pr_err("Error initializing fd events\n");
+		exit(127);
+	}
+	if (timeouts_init() < 0) {
+		pr_err("Error initializing timeouts\n");
+		exit(127);
+	}
+	srand(1);
+	for (i = 0; i < sizeof(live_timers)/sizeof(live_timers[0]); i++)
+		if (run(live_timers[i], ops) < 0)
+			exit(127);
+	if (run_expiry(EXPIRE_TIMEOUTS) < 0)
+		exit(127);
+	return 0;
+}
@@ -0,0 +1,489 @@
+/*
+ * Virtqueue benchmark: per buffer vs batched add/get on a memory backed
+ * vring, driver and device side in the same thread. Each round the driver
+ * posts a batch of buffers and kicks, the device consumes and returns
+ * them, the driver reclaims them. Chains of several pieces are run both
+ * direct and through indirect tables, checking that the device side
+ * (virtio_vring_drain()) gets back the pieces the driver posted. Last,
+ * a driver kicking each buffer and a device with a limited budget per
+ * drain run with and without EVENT_IDX: with it kicks and interrupts must
+ * be suppressed, and none of those needed lost.
+ *
+ * GNU GPLv2 or later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "logger.h"
+#include "virtqueue.h"
+#include "virtio.h"
+
+#define DEFAULT_BUFFERS 1000000
+#define RING_NUM 256
+#define RING_ALIGN 4096
+#define BUF_SIZE 64
+#define PHYS_BASE 0x80000000UL
+/* Pieces of a chain in the direct/indirect runs */
+#define PIECES 4
+/*
+ * EVENT_IDX run: driver bursts of 1 to BURST buffers, device budget per
+ * drain alternating every PHASE rounds between faster and slower than that
+ */
+#define BURST 16
+#define FAST_BUDGET 24
+#define SLOW_BUDGET 4
+#define PHASE 50
+
+static const int batch_sizes[] = { 1, 4, 16, 64, 256, };
+
+static uint8_t *mem;
+static size_t mem_size;
+/* Indirect tables, after the ring */
+static void *pool;
+static metal_phys_addr_t phys = PHYS_BASE;
+static struct metal_io_region io;
+static unsigned long notifications;
+
+static void count_notify(struct virtqueue *vq)
+{
+	notifications++;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fresh ring, @drv is the driver side and @dev the device side */
+static int setup(struct virtqueue **drv, struct virtqueue **dev)
+{
+	struct vring_alloc_info ring = {
+		.vaddr = mem,
+		.align = RING_ALIGN,
+		.num_descs = RING_NUM,
+	};
+
+	memset(mem, 0, mem_size);
+	if (virtqueue_create(NULL, 0, "drv", &ring, NULL, count_notify, &io,
+			     drv) != VQUEUE_SUCCESS)
+		return -1;
+	if (virtqueue_attach(NULL, 0, "dev", &ring, NULL, NULL, &io,
+			     dev) != VQUEUE_SUCCESS)
+		return -1;
+	return 0;
+}
+
+static struct metal_sg *sg_of(int i)
+{
+	static struct metal_sg sg[RING_NUM];
+
+	sg[i].virt = mem + mem_size - (RING_NUM - i) * BUF_SIZE;
+	sg[i].io = &io;
+	sg[i].len = BUF_SIZE;
+	return &sg[i];
+}
+
+/* One buffer at a time */
+static double run_single(int batch, int buffers)
+{
+	struct virtqueue *drv, *dev;
+	uint64_t start;
+	uint32_t len;
+	uint16_t head;
+	int done, i;
+
+	if (setup(&drv, &dev) < 0)
+		return -1;
+	notifications = 0;
+	start = now_ns();
+	for (done = 0; done < buffers; done += batch) {
+		for (i = 0; i < batch; i++) {
+			virtqueue_add_buffer(drv, sg_of(i), 1, 0, sg_of(i));
+			virtqueue_kick(drv);
+		}
+		for (i = 0; i < batch; i++) {
+			virtqueue_get_available_buffer(dev, &head, &len);
+			virtqueue_add_consumed_buffer(dev, head, len);
+		}
+		for (i = 0; i < batch; i++)
+			if (!virtqueue_get_buffer(drv, &len, NULL))
+				return -1;
+	}
+	start = now_ns() - start;
+	virtqueue_free(drv);
+	virtqueue_free(dev);
+	return (double)start / done;
+}
+
+/* Batches: one index publish and one notification decision each */
+static double run_batch(int batch, int buffers)
+{
+	struct virtqueue *drv, *dev;
+	static int readable[RING_NUM], writable[RING_NUM];
+	static void *cookies[RING_NUM];
+	static uint16_t heads[RING_NUM];
+	static struct vring_used_elem used[RING_NUM];
+	uint64_t start;
+	int done, i, n;
+
+	if (setup(&drv, &dev) < 0)
+		return -1;
+	for (i = 0; i < batch; i++) {
+		readable[i] = 1;
+		writable[i] = 0;
+		cookies[i] = sg_of(i);
+	}
+	notifications = 0;
+	start = now_ns();
+	for (done = 0; done < buffers; done += batch) {
+		virtqueue_add_buffers(drv, sg_of(0), readable, writable,
+				      cookies, batch);
+		virtqueue_kick(drv);
+		n = virtqueue_get_available_buffers(dev, heads, batch);
+		for (i = 0; i < n; i++) {
+			used[i].id = heads[i];
+			used[i].len = BUF_SIZE;
+		}
+		virtqueue_add_consumed_buffers(dev, used, n);
+		if (virtqueue_get_buffers(drv, cookies, NULL, batch) != batch)
+			return -1;
+	}
+	start = now_ns() - start;
+	virtqueue_free(drv);
+	virtqueue_free(dev);
+	return (double)start / done;
+}
+
+static struct metal_sg psg[RING_NUM][PIECES];
+
+/* The buffers of sg_of(), PIECES pieces each */
+static void setup_pieces(void)
+{
+	int i, j;
+
+	for (i = 0; i < RING_NUM; i++)
+		for (j = 0; j < PIECES; j++) {
+			psg[i][j].virt = (uint8_t *)sg_of(i)->virt +
+				j * (BUF_SIZE / PIECES);
+			psg[i][j].io = &io;
+			psg[i][j].len = BUF_SIZE / PIECES;
+		}
+}
+
+struct chain_check {
+	/* Next chain expected, mismatches */
+	int next;
+	unsigned long errors;
+};
+
+/* virtio_vring_drain() handler: same pieces as posted, in order */
+static int check_chain(void *priv, const struct iovec *iov, int iovcnt)
+{
+	struct chain_check *c = priv;
+	struct metal_sg *sg = psg[c->next++ % RING_NUM];
+	int i;
+
+	if (iovcnt != PIECES) {
+		c->errors++;
+		return 0;
+	}
+	for (i = 0; i < iovcnt; i++)
+		if (iov[i].iov_base != sg[i].virt || iov[i].iov_len != sg[i].len)
+			c->errors++;
+	return 0;
+}
+
+/*
+ * Chains of PIECES pieces, direct or through an indirect table each, the
+ * device side walks them with virtio_vring_drain()
+ */
+static double run_chains(int batch, int buffers, int indirect)
+{
+	struct vring_alloc_info ring = {
+		.vaddr = mem,
+		.align = RING_ALIGN,
+		.num_descs = RING_NUM,
+	};
+	static int readable[RING_NUM], writable[RING_NUM];
+	static void *cookies[RING_NUM];
+	struct chain_check c = { 0, 0, };
+	struct virtqueue *drv;
+	struct virtio_vring vr;
+	uint64_t start;
+	int done, i, fd;
+
+	memset(mem, 0, mem_size);
+	setup_pieces();
+	if (virtqueue_create(NULL, 0, "drv", &ring, NULL, count_notify, &io,
+			     &drv) != VQUEUE_SUCCESS)
+		return -1;
+	if (indirect && virtqueue_init_indirect(drv, pool, PIECES) !=
+	    VQUEUE_SUCCESS)
+		return -1;
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0 || virtio_vring_init(&vr, fd, mem, mem_size, PHYS_BASE,
+					&ring, indirect ?
+					VIRTIO_RING_F_INDIRECT_DESC : 0) < 0)
+		return -1;
+	for (i = 0; i < batch; i++) {
+		readable[i] = PIECES;
+		writable[i] = 0;
+		cookies[i] = psg[i];
+	}
+	notifications = 0;
+	start = now_ns();
+	for (done = 0; done < buffers; done += batch) {
+		c.next = 0;
+		if (virtqueue_add_buffers(drv, psg[0], readable, writable,
+					  cookies, batch) != VQUEUE_SUCCESS)
+			return -1;
+		/* A single ring descriptor per chain, pointing to its table */
+		if (indirect && drv->vq_free_cnt != RING_NUM - batch)
+			return -1;
+		virtqueue_kick(drv);
+		if (virtio_vring_drain(&vr, check_chain, &c) != batch ||
+		    c.next != batch)
+			return -1;
+		if (virtqueue_get_buffers(drv, cookies, NULL, batch) != batch)
+			return -1;
+	}
+	start = now_ns() - start;
+	if (c.errors || vr.dropped) {
+		pr_err("%s: %lu pieces mismatched, %lu chains dropped\n",
+		       indirect ? "indirect" : "direct", c.errors, vr.dropped);
+		return -1;
+	}
+	virtio_vring_release(&vr);
+	virtqueue_free(drv);
+	close(fd);
+	return (double)start / done;
+}
+
+static int run(int batch, int buffers)
+{
+	double s, b;
+	unsigned long ns, nb;
+
+	s = run_single(batch, buffers);
+	ns = notifications;
+	b = run_batch(batch, buffers);
+	nb = notifications;
+	if (s < 0 || b < 0) {
+		pr_err("Error running batch %d\n", batch);
+		return -1;
+	}
+	printf("batch %3d: per buffer %6.1f ns/buffer (%lu kicks), "
+	       "batched %6.1f ns/buffer (%lu kicks)\n", batch, s, ns, b, nb);
+	return 0;
+}
+
+/* Chains of PIECES pieces: direct ones only fit RING_NUM / PIECES */
+static int run_pieces(int batch, int buffers)
+{
+	double d = 0, i;
+
+	if (batch * PIECES <= RING_NUM) {
+		d = run_chains(batch, buffers, 0);
+		if (d < 0) {
+			pr_err("Error running direct chains, batch %d\n",
+			       batch);
+			return -1;
+		}
+	}
+	i = run_chains(batch, buffers, 1);
+	if (i < 0) {
+		pr_err("Error running indirect chains, batch %d\n", batch);
+		return -1;
+	}
+	if (d)
+		printf("batch %3d, %d pieces: direct %6.1f ns/buffer, "
+		       "indirect %6.1f ns/buffer\n", batch, PIECES, d, i);
+	else
+		printf("batch %3d, %d pieces: direct doesn't fit, "
+		       "indirect %6.1f ns/buffer\n", batch, PIECES, i);
+	return 0;
+}
+
+struct notify_stats {
+	unsigned long rounds;
+	unsigned long kicks;
+	unsigned long drains;
+	unsigned long interrupts;
+	unsigned long avoided;
+};
+
+static int budget;
+static unsigned long consumed;
+
+/* virtio_vring_drain() handler: stalls once the budget is spent */
+static int consume_budget(void *priv, const struct iovec *iov, int iovcnt)
+{
+	if (!budget) {
+		errno = EAGAIN;
+		return -1;
+	}
+	budget--;
+	consumed++;
+	return 0;
+}
+
+/*
+ * The device drains only when kicked (or when it stalled, as its owner
+ * would after making room), the driver reclaims only when interrupted. A
+ * round in which neither side can move means a kick or an interrupt was
+ * suppressed while needed
+ */
+static int run_notify(int buffers, int event_idx, struct notify_stats *st)
+{
+	struct vring_alloc_info ring = {
+		.vaddr = mem,
+		.align = RING_ALIGN,
+		.num_descs = RING_NUM,
+	};
+	static void *cookies[RING_NUM];
+	struct virtqueue *drv;
+	struct virtio_vring vr;
+	unsigned long seen = 0;
+	int posted = 0, reclaimed = 0, step = 0, progress, burst, fd, i, n;
+	uint64_t v;
+
+	memset(mem, 0, mem_size);
+	if (virtqueue_create(NULL, 0, "drv", &ring, NULL, count_notify, &io,
+			     &drv) != VQUEUE_SUCCESS)
+		return -1;
+	if (event_idx)
+		drv->vq_flags |= VIRTQUEUE_FLAG_EVENT_IDX;
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0 || virtio_vring_init(&vr, fd, mem, mem_size, PHYS_BASE,
+					&ring, event_idx ?
+					VIRTIO_RING_F_EVENT_IDX : 0) < 0)
+		return -1;
+	virtqueue_enable_cb(drv);
+	notifications = 0;
+	consumed = 0;
+	memset(st, 0, sizeof(*st));
+	while (reclaimed < buffers) {
+		progress = 0;
+		/* Driver: a burst, kicking after each buffer */
+		burst = 1 + step++ % BURST;
+		for (i = 0; i < burst && posted < buffers; i++) {
+			if (virtqueue_add_buffer(drv, sg_of(i), 1, 0,
+						 sg_of(i)) != VQUEUE_SUCCESS)
+				break;
+			virtqueue_kick(drv);
+			posted++;
+			progress = 1;
+		}
+		/* Device */
+		if (notifications != seen || vr.stalled) {
+			seen = notifications;
+			budget = (step / PHASE) % 2 ? SLOW_BUDGET :
+				FAST_BUDGET;
+			if (virtio_vring_drain(&vr, consume_budget, NULL) > 0)
+				progress = 1;
+			st->drains++;
+		}
+		/*
+		 * Driver: reclaim on interrupts, then ask for the next one
+		 * once 3/4 of the buffers in flight are used
+		 */
+		if (read(fd, &v, sizeof(v)) > 0) {
+			do {
+				virtqueue_disable_cb(drv);
+				n = virtqueue_get_buffers(drv, cookies, NULL,
+							  RING_NUM);
+				reclaimed += n;
+				if (n)
+					progress = 1;
+			} while (virtqueue_postpone_cb(drv, VQ_POSTPONE_LONG));
+		}
+		if (!progress) {
+			pr_err("%s: stuck, %d posted, %lu consumed, %d "
+			       "reclaimed: a kick or an interrupt was lost\n",
+			       event_idx ? "event_idx" : "plain", posted,
+			       consumed, reclaimed);
+			return -1;
+		}
+	}
+	st->rounds = step;
+	st->kicks = notifications;
+	st->interrupts = vr.interrupts;
+	st->avoided = vr.interrupts_avoided;
+	if (consumed != buffers || vr.dropped) {
+		pr_err("%s: %lu buffers consumed out of %d, %lu dropped\n",
+		       event_idx ? "event_idx" : "plain", consumed, buffers,
+		       vr.dropped);
+		return -1;
+	}
+	virtio_vring_release(&vr);
+	virtqueue_free(drv);
+	close(fd);
+	return 0;
+}
+
+static int run_event_idx(int buffers)
+{
+	struct notify_stats p, e;
+
+	if (run_notify(buffers, 0, &p) < 0 || run_notify(buffers, 1, &e) < 0)
+		return -1;
+	printf("plain:     %d buffers, %lu kicks, %lu drains, %lu interrupts "
+	       "(%lu avoided)\n", buffers, p.kicks, p.drains, p.interrupts,
+	       p.avoided);
+	printf("event_idx: %d buffers, %lu kicks, %lu drains, %lu interrupts "
+	       "(%lu avoided)\n", buffers, e.kicks, e.drains, e.interrupts,
+	       e.avoided);
+	/* Too short to get out of the first (fast device) phase */
+	if (e.rounds <= PHASE)
+		return 0;
+	if (e.kicks >= p.kicks || e.interrupts >= p.interrupts) {
+		pr_err("event_idx: kicks or interrupts not suppressed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, buffers = DEFAULT_BUFFERS;
+
+	logger_init(stderr, "virtqueue_bench");
+	if (argc > 1)
+		buffers = atoi(argv[1]);
+	if (buffers <= 0) {
+		fprintf(stderr, "Usage: %s [buffers]\n", argv[0]);
+		exit(127);
+	}
+	/* Ring, indirect tables, then the buffers */
+	mem_size = ((vring_size(RING_NUM, RING_ALIGN) + 15) & ~15) +
+		vring_indirect_size(RING_NUM, PIECES) + RING_NUM * BUF_SIZE;
+	mem = aligned_alloc(RING_ALIGN, (mem_size + RING_ALIGN - 1) &
+			    ~(RING_ALIGN - 1));
+	if (!mem) {
+		perror("aligned_alloc");
+		exit(127);
+	}
+	pool = mem + ((vring_size(RING_NUM, RING_ALIGN) + 15) & ~15);
+	io.virt = mem;
+	io.physmap = &phys;
+	io.size = mem_size;
+	io.page_shift = sizeof(metal_phys_addr_t) * 8 - 1;
+	io.page_mask = (metal_phys_addr_t)-1;
+	for (i = 0; i < sizeof(batch_sizes)/sizeof(batch_sizes[0]); i++)
+		if (run(batch_sizes[i], buffers) < 0)
+			exit(127);
+	for (i = 0; i < sizeof(batch_sizes)/sizeof(batch_sizes[0]); i++)
+		if (run_pieces(batch_sizes[i], buffers) < 0)
+			exit(127);
+	if (run_event_idx(buffers) < 0)
+		exit(127);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Minimal eBPF helpers, thin wrappers around the bpf() syscall
+ *
+ * GNU GPLv2 or later
+ */
+#ifdef CONFIG_EBPF
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "ebpf.h"
+
+#define EBPF_LOG_SIZE 4096
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int ebpf_map_create(enum bpf_map_type type, unsigned int key_size,
+		    unsigned int value_size, unsigned int max_entries)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+int ebpf_prog_load(enum bpf_prog_type type, const struct bpf_insn *insns,
+		   unsigned int insn_cnt)
+{
+	static char log[EBPF_LOG_SIZE];
+	union bpf_attr attr;
+	int ret;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = type;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = insn_cnt;
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = 0;
+	ret = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (ret < 0 && log[0])
+		pr_err("%s: verifier says:\n%s\n", __func__, log);
+	return ret;
+}
+
+int ebpf_xdp_attach(int prog_fd, int ifindex, unsigned int xdp_flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = xdp_flags;
+	return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+int ebpf_socket_attach(int prog_fd, int sock_fd)
+{
+	return setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_BPF, &prog_fd,
+			  sizeof(prog_fd));
+}
+
+int ebpf_map_update(int map_fd, const void *key, const void *value,
+		    uint64_t flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	attr.flags = flags;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+int ebpf_map_lookup(int map_fd, const void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+int ebpf_map_delete(int map_fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	return sys_bpf(BPF_MAP_DELETE_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+#endif /* CONFIG_EBPF */
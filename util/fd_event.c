@@ -7,113 +7,679 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <linux/stddef.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "list.h"
 #include "logger.h"
 #include "fd_event.h"
+#include "fd_event-internal.h"
+#include "timeout.h"
 
-struct fd_event {
-	int fd;
-	fd_event_cb cb;
+/* Max number of ready fds returned by a single epoll_wait() */
+#define EPOLL_MAX_EVENTS 64
+
+/*
+ * epoll backend: one slot per fd, indexed by fd number. epoll only allows
+ * one registration per fd, so the slot keeps the union of the requested
+ * events. The fd is edge triggered only if all its events are: edge
+ * triggered callbacks drain the fd, invoking them while it is ready
+ * is harmless
+ */
+struct fd_slot {
+	/* Events of each type, chained by slot_next in registration order */
+	struct fd_event *evt[3];
+	uint32_t events;
+	/* Level triggered events */
+	int nlevel;
+};
+
+struct fd_events_post {
+	fd_events_post_cb cb;
 	void *data;
 	struct list_head list;
 };
 
-static struct list_head fd_events[3];
+/*
+ * Loop used by the API with no loop argument. Each thread calling
+ * fd_events_init_backend() gets its own default loop
+ */
+static __thread struct event_loop *default_loop;
 
-int fd_events_init(void)
+static const uint32_t epoll_mask[] = {
+	[EVT_FD_RD] = EPOLLIN,
+	[EVT_FD_WR] = EPOLLOUT,
+	[EVT_FD_EXC] = EPOLLPRI,
+};
+
+void fd_event_free(struct fd_event *e)
+{
+	free(e->rx_buf);
+	free(e);
+}
+
+static void do_handle_fd_events(struct event_loop *l, fd_set *fds,
+				struct list_head *h)
 {
+	struct fd_event *e, *tmp;
+	unsigned long seq, cancels;
+
+	if (!fds)
+		return;
+	seq = ++l->dispatch_seq;
+restart:
+	list_for_each_entry_safe(e, tmp, h, list) {
+		/* Native receive events have no readable callback */
+		if (!e->cb || e->dispatch_seq == seq || !FD_ISSET(e->fd, fds))
+			continue;
+		e->dispatch_seq = seq;
+		cancels = l->cancels;
+		e->cb(e->data);
+		/* tmp may be gone: start over, skipping the events invoked */
+		if (l->cancels != cancels)
+			goto restart;
+	}
+}
+
+
+static void loop_handle_fd_events(struct event_loop *l, fd_set *rd_fds,
+				  fd_set *wr_fds, fd_set *exc_fds)
+{
+	fd_set *fds[] = {
+		rd_fds, wr_fds, exc_fds,
+	};
 	enum fd_event_type t;
 
+	loop_timeouts_update_clock(l);
 	for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++)
-		INIT_LIST_HEAD(&fd_events[t]);
+		do_handle_fd_events(l, fds[t], &l->fd_events[t]);
+}
+
+void handle_fd_events(fd_set *rd_fds, fd_set *wr_fds, fd_set *exc_fds)
+{
+	loop_handle_fd_events(default_loop, rd_fds, wr_fds, exc_fds);
+}
+
+static void do_prepare_fd_events(fd_set *fds, struct list_head *h, int *max_fd)
+{
+	struct fd_event *e;
+
+	if (!fds)
+		return;
+	list_for_each_entry(e, h, list) {
+		if (e->fd > *max_fd)
+			*max_fd = e->fd;
+		FD_SET(e->fd, fds);
+	}
+}
+
+static void loop_prepare_fd_events(struct event_loop *l, fd_set *rd_fds,
+				   fd_set *wr_fds, fd_set *exc_fds,
+				   int *max_fd)
+{
+	fd_set *fds[] = {
+		rd_fds, wr_fds, exc_fds,
+	};
+	enum fd_event_type t;
+	*max_fd = -1;
+
+	for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++)
+		do_prepare_fd_events(fds[t], &l->fd_events[t], max_fd);
+}
+
+void prepare_fd_events(fd_set *rd_fds, fd_set *wr_fds, fd_set *exc_fds,
+		       int *max_fd)
+{
+	loop_prepare_fd_events(default_loop, rd_fds, wr_fds, exc_fds, max_fd);
+}
+
+/* select backend */
+
+static int select_add_fd_event(struct fd_event *e)
+{
 	return 0;
 }
 
-struct fd_event *add_fd_event(int fd, enum fd_event_type t,
-			      fd_event_cb cb, void *cb_data)
+static void select_cancel_fd_event(struct fd_event *e)
+{
+	fd_event_free(e);
+}
+
+static int select_wait(struct event_loop *l, struct timeval *tv)
+{
+	fd_set rd, wr, exc;
+	int max_fd, ret;
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	FD_ZERO(&exc);
+	loop_prepare_fd_events(l, &rd, &wr, &exc, &max_fd);
+	ret = select(max_fd + 1, &rd, &wr, &exc, tv);
+	if (ret > 0)
+		loop_handle_fd_events(l, &rd, &wr, &exc);
+	return ret;
+}
+
+static int sync_sendmsg(struct event_loop *l, int fd,
+			const struct msghdr *msg)
+{
+	return sendmsg(fd, msg, 0);
+}
+
+static const struct fd_events_ops select_ops = {
+	.add = select_add_fd_event,
+	.cancel = select_cancel_fd_event,
+	.wait = select_wait,
+	.sendmsg = sync_sendmsg,
+};
+
+/* epoll backend */
+
+static struct fd_slot *get_slot(struct event_loop *l, int fd)
+{
+	struct fd_slot *s;
+	int n;
+
+	if (fd < l->nslots)
+		return &l->slots[fd];
+	for (n = l->nslots ? l->nslots : 64; n <= fd; n <<= 1)
+		;
+	s = realloc(l->slots, n * sizeof(*s));
+	if (!s) {
+		pr_err("%s: realloc: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+	memset(&s[l->nslots], 0, (n - l->nslots) * sizeof(*s));
+	l->slots = s;
+	l->nslots = n;
+	return &l->slots[fd];
+}
+
+/* @quiet: don't log errors, the caller expects and ignores them */
+static int epoll_update(struct event_loop *l, int fd, struct fd_slot *s,
+			uint32_t old_events, int quiet)
+{
+	struct epoll_event ev = {
+		.events = s->events | (s->nlevel ? 0 : EPOLLET),
+		.data.fd = fd,
+	};
+	int op;
+
+	if (!s->events)
+		op = EPOLL_CTL_DEL;
+	else
+		op = old_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(l->epfd, op, fd, &ev) < 0) {
+		if (quiet)
+			return -1;
+		pr_err("%s: epoll_ctl(%d): %s\n", __func__, fd,
+		       strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int epoll_add_fd_event(struct fd_event *e)
+{
+	struct fd_slot *s = get_slot(e->loop, e->fd);
+	struct fd_event **pe;
+	uint32_t old_events;
+	int level = !(e->flags & EVT_FD_F_EDGE), old_edge;
+
+	if (!s)
+		return -1;
+	old_events = s->events;
+	old_edge = !s->nlevel;
+	s->events |= epoll_mask[e->type];
+	s->nlevel += level;
+	if ((s->events != old_events || old_edge != !s->nlevel) &&
+	    epoll_update(e->loop, e->fd, s, old_events, 0) < 0) {
+		s->events = old_events;
+		s->nlevel -= level;
+		return -1;
+	}
+	for (pe = &s->evt[e->type]; *pe; pe = &(*pe)->slot_next)
+		;
+	e->slot_next = NULL;
+	*pe = e;
+	return 0;
+}
+
+static void epoll_cancel_fd_event(struct fd_event *e)
+{
+	struct fd_slot *s = &e->loop->slots[e->fd];
+	struct fd_event **pe;
+	uint32_t old_events = s->events;
+	int old_edge = !s->nlevel;
+
+	for (pe = &s->evt[e->type]; *pe != e; pe = &(*pe)->slot_next)
+		;
+	*pe = e->slot_next;
+	if (!(e->flags & EVT_FD_F_EDGE))
+		s->nlevel--;
+	if (!s->evt[e->type])
+		s->events &= ~epoll_mask[e->type];
+	/*
+	 * fd might have been closed already (EBADF, or ENOENT if it was
+	 * reused), which removed it from the set: ignore errors
+	 */
+	if (s->events != old_events || old_edge != !s->nlevel)
+		epoll_update(e->loop, e->fd, s, old_events, 1);
+	fd_event_free(e);
+}
+
+static void epoll_dispatch(struct event_loop *l,
+			   const struct epoll_event *evs, int n)
+{
+	enum fd_event_type t;
+	unsigned long seq;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int fd = evs[i].data.fd;
+		uint32_t r = evs[i].events;
+
+		/* select() reports errors and hangups as rd/wr readiness */
+		if (r & (EPOLLERR | EPOLLHUP))
+			r |= EPOLLIN | EPOLLOUT;
+		for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++) {
+			struct fd_event *e;
+
+			if (!(r & epoll_mask[t]))
+				continue;
+			/*
+			 * Look the slot up every time: a callback could have
+			 * cancelled events or grown the slots array. Skip the
+			 * events invoked already
+			 */
+			seq = ++l->dispatch_seq;
+			while (1) {
+				for (e = l->slots[fd].evt[t];
+				     e && e->dispatch_seq == seq;
+				     e = e->slot_next)
+					;
+				if (!e)
+					break;
+				e->dispatch_seq = seq;
+				e->cb(e->data);
+			}
+		}
+	}
+}
+
+void fd_events_update_tv(struct timeval *tv, const struct timespec *start,
+			 int expired)
+{
+	struct timespec end;
+	struct timeval elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed.tv_sec = end.tv_sec - start->tv_sec;
+	elapsed.tv_usec = (end.tv_nsec - start->tv_nsec) / 1000;
+	if (elapsed.tv_usec < 0) {
+		elapsed.tv_sec--;
+		elapsed.tv_usec += 1000000;
+	}
+	if (expired || !timercmp(&elapsed, tv, <))
+		timerclear(tv);
+	else
+		timersub(tv, &elapsed, tv);
+}
+
+static int epoll_wait_events(struct event_loop *l, struct timeval *tv)
+{
+	struct epoll_event evs[EPOLL_MAX_EVENTS];
+	struct timespec start;
+	int ms = -1, ret;
+
+	if (tv) {
+		ms = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	ret = epoll_wait(l->epfd, evs, ARRAY_SIZE(evs), ms);
+	loop_timeouts_update_clock(l);
+	if (tv)
+		fd_events_update_tv(tv, &start, !ret);
+	if (ret > 0)
+		epoll_dispatch(l, evs, ret);
+	return ret;
+}
+
+static void epoll_release(struct event_loop *l)
+{
+	close(l->epfd);
+	free(l->slots);
+	l->epfd = -1;
+	l->slots = NULL;
+	l->nslots = 0;
+}
+
+static const struct fd_events_ops epoll_ops = {
+	.add = epoll_add_fd_event,
+	.cancel = epoll_cancel_fd_event,
+	.wait = epoll_wait_events,
+	.sendmsg = sync_sendmsg,
+	.release = epoll_release,
+};
+
+static struct event_loop *loop_alloc(enum fd_events_backend b)
+{
+	struct event_loop *l;
+	enum fd_event_type t;
+
+	l = malloc(sizeof(*l));
+	if (!l) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+	memset(l, 0, sizeof(*l));
+	for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++)
+		INIT_LIST_HEAD(&l->fd_events[t]);
+	INIT_LIST_HEAD(&l->post_cbs);
+	INIT_LIST_HEAD(&l->udev_events);
+	l->epfd = -1;
+	l->backend = b;
+	switch (b) {
+	case FD_EVENTS_SELECT:
+		l->ops = &select_ops;
+		break;
+	case FD_EVENTS_EPOLL:
+		l->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (l->epfd < 0) {
+			pr_err("%s: epoll_create1: %s\n", __func__,
+			       strerror(errno));
+			goto err;
+		}
+		l->ops = &epoll_ops;
+		break;
+	case FD_EVENTS_URING:
+		l->ops = uring_fd_events_init(l);
+		if (!l->ops) {
+			pr_err("%s: io_uring backend not available\n",
+			       __func__);
+			goto err;
+		}
+		break;
+	default:
+		goto err;
+	}
+	return l;
+
+err:
+	free(l);
+	return NULL;
+}
+
+/* Free a loop with no events */
+static void loop_free(struct event_loop *l)
+{
+	if (l->ops->release)
+		l->ops->release(l);
+	free(l);
+}
+
+struct event_loop *event_loop_new(enum fd_events_backend b)
+{
+	struct event_loop *l = loop_alloc(b);
+
+	if (!l)
+		return NULL;
+	if (loop_timeouts_init(l) < 0) {
+		loop_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+struct event_loop *event_loop_get_default(void)
+{
+	return default_loop;
+}
+
+void event_loop_set_default(struct event_loop *l)
+{
+	default_loop = l;
+}
+
+int fd_events_init_backend(enum fd_events_backend b)
+{
+	struct event_loop *l = loop_alloc(b);
+
+	if (!l)
+		return -1;
+	default_loop = l;
+	return 0;
+}
+
+int fd_events_init(void)
+{
+	return fd_events_init_backend(FD_EVENTS_EPOLL);
+}
+
+enum fd_events_backend loop_fd_events_get_backend(struct event_loop *l)
+{
+	return l->backend;
+}
+
+enum fd_events_backend fd_events_get_backend(void)
+{
+	return loop_fd_events_get_backend(default_loop);
+}
+
+static struct fd_event *new_fd_event(struct event_loop *l,
+				     int fd, enum fd_event_type t,
+				     unsigned int flags,
+				     fd_event_cb cb, void *cb_data)
 {
 	struct fd_event *out;
-	struct list_head *l;
 
 	switch (t) {
 	case EVT_FD_RD:
 	case EVT_FD_WR:
 	case EVT_FD_EXC:
-		l = &fd_events[t];
 		break;
 	default:
 		return NULL;
 	}
+	if (fd < 0)
+		return NULL;
 
 	out = malloc(sizeof(*out));
 	if (!out)
 		return NULL;
+	memset(out, 0, sizeof(*out));
+	out->loop = l;
 	out->fd = fd;
+	out->type = t;
+	out->flags = flags;
 	out->cb = cb;
 	out->data = cb_data;
-	list_add_tail(&out->list, l);
 	return out;
 }
 
+struct fd_event *loop_add_fd_event_flags(struct event_loop *l,
+					 int fd, enum fd_event_type t,
+					 unsigned int flags,
+					 fd_event_cb cb, void *cb_data)
+{
+	struct fd_event *out = new_fd_event(l, fd, t, flags, cb, cb_data);
+
+	if (!out)
+		return NULL;
+	if (l->ops->add(out) < 0) {
+		fd_event_free(out);
+		return NULL;
+	}
+	list_add_tail(&out->list, &l->fd_events[t]);
+	return out;
+}
+
+struct fd_event *loop_add_fd_event(struct event_loop *l,
+				   int fd, enum fd_event_type t,
+				   fd_event_cb cb, void *cb_data)
+{
+	return loop_add_fd_event_flags(l, fd, t, 0, cb, cb_data);
+}
+
+struct fd_event *add_fd_event_flags(int fd, enum fd_event_type t,
+				    unsigned int flags,
+				    fd_event_cb cb, void *cb_data)
+{
+	return loop_add_fd_event_flags(default_loop, fd, t, flags, cb,
+				       cb_data);
+}
+
+struct fd_event *add_fd_event(int fd, enum fd_event_type t,
+			      fd_event_cb cb, void *cb_data)
+{
+	return loop_add_fd_event_flags(default_loop, fd, t, 0, cb, cb_data);
+}
+
+/* Receive events emulation for backends with no native support */
+static void recv_readable(void *_e)
+{
+	struct fd_event *e = _e;
+	struct sockaddr_storage from;
+	socklen_t l = sizeof(from);
+	int stat;
+
+	/* MSG_TRUNC: get the real length of the datagram */
+	stat = recvfrom(e->fd, e->rx_buf, e->rx_bufsize, MSG_TRUNC,
+			(struct sockaddr *)&from, &l);
+	if (stat < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			pr_err("%s, recvfrom: %s\n", __func__,
+			       strerror(errno));
+		return;
+	}
+	if (stat > e->rx_bufsize) {
+		if (!e->rx_dropped++)
+			pr_warn("%s: fd %d: %d bytes datagram truncated (buffer is %d bytes), dropped\n",
+				__func__, e->fd, stat, e->rx_bufsize);
+		return;
+	}
+	e->recv_cb(e->recv_data, e->rx_buf, stat,
+		   (struct sockaddr *)&from, l);
+}
+
+struct fd_event *loop_add_fd_recv_event(struct event_loop *l,
+					int fd, int bufsize,
+					fd_recv_cb cb, void *cb_data)
+{
+	struct fd_event *out;
+	int stat;
+
+	if (!cb || bufsize <= 0)
+		return NULL;
+	out = new_fd_event(l, fd, EVT_FD_RD, EVT_FD_F_RECV, NULL, NULL);
+	if (!out)
+		return NULL;
+	out->recv_cb = cb;
+	out->recv_data = cb_data;
+	out->rx_bufsize = bufsize;
+	/* Fall back to readable event + recvfrom() if needed */
+	stat = l->ops->add_recv ? l->ops->add_recv(out) : -1;
+	if (stat < 0) {
+		out->cb = recv_readable;
+		out->data = out;
+		out->rx_buf = malloc(bufsize);
+		stat = out->rx_buf ? l->ops->add(out) : -1;
+	}
+	if (stat < 0) {
+		fd_event_free(out);
+		return NULL;
+	}
+	list_add_tail(&out->list, &l->fd_events[EVT_FD_RD]);
+	return out;
+}
+
+struct fd_event *add_fd_recv_event(int fd, int bufsize,
+				   fd_recv_cb cb, void *cb_data)
+{
+	return loop_add_fd_recv_event(default_loop, fd, bufsize, cb, cb_data);
+}
 
 int cancel_fd_event(struct fd_event *e)
 {
+	e->loop->cancels++;
 	list_del(&e->list);
-	free(e);
+	e->loop->ops->cancel(e);
 	return 0;
 }
 
-static void do_handle_fd_events(fd_set *fds, struct list_head *h)
+int loop_fd_event_sendmsg(struct event_loop *l, int fd,
+			  const struct msghdr *msg)
 {
-	struct fd_event *e;
+	return l->ops->sendmsg(l, fd, msg);
+}
 
-	list_for_each_entry(e, h, list) {
-		if (FD_ISSET(e->fd, fds))
-			e->cb(e->data);
+int fd_event_sendmsg(int fd, const struct msghdr *msg)
+{
+	return loop_fd_event_sendmsg(default_loop, fd, msg);
+}
+
+int loop_fd_events_add_post_cb(struct event_loop *l,
+			       fd_events_post_cb cb, void *cb_data)
+{
+	struct fd_events_post *p = malloc(sizeof(*p));
+
+	if (!p) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		return -1;
 	}
+	p->cb = cb;
+	p->data = cb_data;
+	list_add_tail(&p->list, &l->post_cbs);
+	return 0;
 }
 
+int fd_events_add_post_cb(fd_events_post_cb cb, void *cb_data)
+{
+	return loop_fd_events_add_post_cb(default_loop, cb, cb_data);
+}
 
-void handle_fd_events(fd_set *rd_fds, fd_set *wr_fds, fd_set *exc_fds)
+int loop_fd_events_wait(struct event_loop *l, struct timeval *tv)
 {
-	fd_set *fds[] = {
-		rd_fds, wr_fds, exc_fds,
-	};
-	enum fd_event_type t;
+	struct fd_events_post *p;
+	int ret, err;
 
-	for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++)
-		do_handle_fd_events(fds[t], &fd_events[t]);
+	ret = l->ops->wait(l, tv);
+	err = errno;
+	list_for_each_entry(p, &l->post_cbs, list)
+		p->cb(p->data);
+	errno = err;
+	return ret;
 }
 
-static void do_prepare_fd_events(fd_set *fds, struct list_head *h, int *max_fd)
+int fd_events_wait(struct timeval *tv)
 {
-	struct fd_event *e;
-
-	list_for_each_entry(e, h, list) {
-		if (e->fd > *max_fd)
-			*max_fd = e->fd;
-		FD_SET(e->fd, fds);
-	}
+	return loop_fd_events_wait(default_loop, tv);
 }
 
-void prepare_fd_events(fd_set *rd_fds, fd_set *wr_fds, fd_set *exc_fds,
-		       int *max_fd)
+void loop_fd_events_loop(struct event_loop *l)
 {
-	fd_set *fds[] = {
-		rd_fds, wr_fds, exc_fds,
-	};
-	enum fd_event_type t;
-	*max_fd = -1;
+	/* Timeouts are dispatched by their timerfd event */
+	while (1)
+		if (loop_fd_events_wait(l, NULL) < 0 && errno != EINTR)
+			pr_err("%s: %s\n", __func__, strerror(errno));
+}
 
-	for (t = EVT_FD_RD; t <= EVT_FD_EXC; t++)
-		do_prepare_fd_events(fds[t], &fd_events[t], max_fd);
+void fd_events_loop(void)
+{
+	loop_fd_events_loop(default_loop);
 }
 
 int fd_event_get_fd(struct fd_event *e)
 {
 	return e->fd;
 }
+
+unsigned long fd_event_rx_dropped(struct fd_event *e)
+{
+	return e->rx_dropped;
+}
@@ -0,0 +1,631 @@
+/*
+ * io_uring based fd events backend
+ *
+ * GNU GPLv2 or later
+ */
+#ifdef CONFIG_IO_URING
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "list.h"
+#include "logger.h"
+#include "fd_event.h"
+#include "fd_event-internal.h"
+#include "timeout.h"
+
+#define URING_ENTRIES 256
+/* Provided buffers per receive event, must be a power of 2 */
+#define URING_RECV_BUFS 64
+/* Max length of a queued tx datagram, longer ones are sent synchronously */
+#define URING_TX_BUF_SIZE FD_EVENT_SENDMSG_QUEUE_MAX
+
+/*
+ * sqe/cqe user_data: fd_event pointers (at least 8 bytes aligned), tx
+ * buffers pointers with bit 0 set or 0 for cancel requests
+ */
+#define URING_UD_TX 0x1UL
+
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Local sq tail and last published tail */
+	unsigned sqe_tail;
+	unsigned sqe_published;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	int next_bgid;
+	struct list_head free_tx;
+	/* Cancelled events whose cancel sqe didn't fit in the sq yet */
+	struct list_head pending_cancels;
+};
+
+struct uring_tx {
+	struct msghdr mh;
+	struct iovec iov;
+	struct sockaddr_storage name;
+	struct list_head list;
+	uint8_t buf[URING_TX_BUF_SIZE];
+};
+
+/* Provided buffers ring for a receive event */
+struct uring_recv_bufs {
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint8_t *mem;
+	int buf_size;
+	/* recvmsg template: only name and control lengths are relevant */
+	struct msghdr mh;
+};
+
+
+static const uint32_t poll_mask[] = {
+	[EVT_FD_RD] = POLLIN,
+	[EVT_FD_WR] = POLLOUT,
+	[EVT_FD_EXC] = POLLPRI,
+};
+
+static int uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete,
+		       unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+/*
+ * Publish queued sqes and (if @wait) wait for at least one completion,
+ * at most for @tv (forever if @tv is NULL)
+ */
+static int uring_submit(struct uring *r, int wait, struct timeval *tv)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit = r->sqe_tail - r->sqe_published;
+	unsigned flags = 0;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	r->sqe_published = r->sqe_tail;
+	if (!wait) {
+		if (!to_submit)
+			return 0;
+		return uring_enter(r, to_submit, 0, 0, NULL, 0);
+	}
+	memset(&arg, 0, sizeof(arg));
+	if (tv) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (uintptr_t)&ts;
+	}
+	flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	return uring_enter(r, to_submit, 1, flags, &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head, idx;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (r->sqe_tail - head >= r->sq_entries) {
+		/* sq is full, flush it */
+		if (uring_submit(r, 0, NULL) < 0) {
+			pr_err("%s: io_uring_enter: %s\n", __func__,
+			       strerror(errno));
+			return NULL;
+		}
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (r->sqe_tail - head >= r->sq_entries)
+			return NULL;
+	}
+	idx = r->sqe_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	r->sq_array[idx] = idx;
+	r->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static int uring_arm_poll(struct fd_event *e)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(e->loop->uring);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = e->fd;
+	sqe->poll32_events = poll_mask[e->type];
+	/* Multishot poll only reports new wakeups, that is edge triggering */
+	if (e->flags & EVT_FD_F_EDGE)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uintptr_t)e;
+	e->inflight = 1;
+	return 0;
+}
+
+static int uring_arm_recv(struct fd_event *e)
+{
+	struct uring_recv_bufs *rb = e->bufs;
+	struct io_uring_sqe *sqe = uring_get_sqe(e->loop->uring);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = e->fd;
+	sqe->addr = (uintptr_t)&rb->mh;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	/* MSG_TRUNC: payloadlen is the real length of the datagram */
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = e->bgid;
+	sqe->user_data = (uintptr_t)e;
+	e->inflight = 1;
+	return 0;
+}
+
+static void recv_buf_give(struct uring_recv_bufs *rb, int bid)
+{
+	struct io_uring_buf *b;
+	uint16_t tail = rb->br->tail;
+
+	b = &rb->br->bufs[tail & (URING_RECV_BUFS - 1)];
+	b->addr = (uintptr_t)(rb->mem + bid * rb->buf_size);
+	b->len = rb->buf_size;
+	b->bid = bid;
+	__atomic_store_n(&rb->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void recv_bufs_free(struct fd_event *e)
+{
+	struct uring_recv_bufs *rb = e->bufs;
+	struct uring *r = e->loop->uring;
+	struct io_uring_buf_reg reg;
+
+	if (!rb)
+		return;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = e->bgid;
+	syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING,
+		&reg, 1);
+	munmap(rb->br, rb->br_size);
+	free(rb->mem);
+	free(rb);
+	e->bufs = NULL;
+}
+
+static int uring_add_recv(struct fd_event *e)
+{
+	struct uring *r = e->loop->uring;
+	struct uring_recv_bufs *rb;
+	struct io_uring_buf_reg reg;
+	int i;
+
+	rb = malloc(sizeof(*rb));
+	if (!rb)
+		return -1;
+	memset(rb, 0, sizeof(*rb));
+	rb->mh.msg_namelen = sizeof(struct sockaddr_storage);
+	rb->buf_size = sizeof(struct io_uring_recvmsg_out) +
+		rb->mh.msg_namelen + e->rx_bufsize;
+	rb->buf_size = (rb->buf_size + 63) & ~63;
+	rb->br_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+	rb->br = mmap(NULL, rb->br_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rb->br == MAP_FAILED) {
+		free(rb);
+		return -1;
+	}
+	rb->mem = malloc(URING_RECV_BUFS * rb->buf_size);
+	if (!rb->mem)
+		goto err0;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)rb->br;
+	reg.ring_entries = URING_RECV_BUFS;
+	reg.bgid = r->next_bgid;
+	if (syscall(__NR_io_uring_register, r->fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		pr_info("%s: no provided buffers rings (%s), using poll\n",
+			__func__, strerror(errno));
+		goto err1;
+	}
+	e->bgid = r->next_bgid++;
+	e->bufs = rb;
+	for (i = 0; i < URING_RECV_BUFS; i++)
+		recv_buf_give(rb, i);
+	if (uring_arm_recv(e) < 0) {
+		recv_bufs_free(e);
+		return -1;
+	}
+	return 0;
+
+err1:
+	free(rb->mem);
+err0:
+	munmap(rb->br, rb->br_size);
+	free(rb);
+	return -1;
+}
+
+/* Free @e if nobody (kernel or a callback) is using it any more */
+static void uring_release(struct fd_event *e)
+{
+	if (e->inflight || e->dispatching)
+		return;
+	/* Completed before its cancel could be queued */
+	list_del(&e->list);
+	recv_bufs_free(e);
+	fd_event_free(e);
+}
+
+static int uring_add(struct fd_event *e)
+{
+	return uring_arm_poll(e);
+}
+
+static int uring_queue_cancel(struct fd_event *e)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(e->loop->uring);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = e->bufs ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)e;
+	sqe->user_data = 0;
+	return 0;
+}
+
+/*
+ * Queue the cancels which didn't fit in the sq, before the next submission.
+ * Until then their events stay dead and allocated, completions are ignored
+ */
+static void uring_flush_cancels(struct uring *r)
+{
+	struct fd_event *e, *n;
+
+	list_for_each_entry_safe(e, n, &r->pending_cancels, list) {
+		if (uring_queue_cancel(e) < 0)
+			return;
+		list_del_init(&e->list);
+	}
+}
+
+static void uring_cancel(struct fd_event *e)
+{
+	struct uring *r = e->loop->uring;
+
+	e->dead = 1;
+	/* Off the loop's lists already, e->list tracks pending cancels now */
+	INIT_LIST_HEAD(&e->list);
+	if (e->inflight && uring_queue_cancel(e) < 0) {
+		/* uring_get_sqe() already tried to flush the sq, retry later */
+		pr_debug("%s: sq full, cancel of fd %d deferred\n",
+			 __func__, e->fd);
+		list_add_tail(&e->list, &r->pending_cancels);
+		return;
+	}
+	uring_release(e);
+}
+
+static void uring_poll_complete(struct fd_event *e,
+				const struct io_uring_cqe *cqe)
+{
+	if (cqe->res < 0) {
+		if (cqe->res != -ECANCELED)
+			pr_err("%s: fd %d: %s\n", __func__, e->fd,
+			       strerror(-cqe->res));
+		return;
+	}
+	e->dispatching = 1;
+	e->cb(e->data);
+	e->dispatching = 0;
+	if (e->dead) {
+		uring_release(e);
+		return;
+	}
+	if (!e->inflight)
+		uring_arm_poll(e);
+}
+
+static void uring_recv_complete(struct fd_event *e,
+				const struct io_uring_cqe *cqe)
+{
+	struct uring_recv_bufs *rb = e->bufs;
+	struct io_uring_recvmsg_out *out;
+	uint8_t *buf, *name, *payload;
+	int bid, len, avail;
+
+	if (cqe->res < 0) {
+		/* ENOBUFS: all buffers were in use, just rearm */
+		if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+			pr_err("%s: fd %d: %s\n", __func__, e->fd,
+			       strerror(-cqe->res));
+		goto end;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		goto end;
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = rb->mem + bid * rb->buf_size;
+	out = (struct io_uring_recvmsg_out *)buf;
+	name = buf + sizeof(*out);
+	payload = name + rb->mh.msg_namelen + rb->mh.msg_controllen;
+	avail = cqe->res - (payload - buf);
+	len = out->payloadlen;
+	if ((out->flags & MSG_TRUNC) || len > avail) {
+		if (!e->rx_dropped++)
+			pr_warn("%s: fd %d: %d bytes datagram truncated (buffer is %d bytes), dropped\n",
+				__func__, e->fd, len, e->rx_bufsize);
+		recv_buf_give(rb, bid);
+		goto end;
+	}
+	e->dispatching = 1;
+	e->recv_cb(e->recv_data, payload, len, (struct sockaddr *)name,
+		   min(out->namelen, rb->mh.msg_namelen));
+	e->dispatching = 0;
+	if (e->dead) {
+		uring_release(e);
+		return;
+	}
+	recv_buf_give(rb, bid);
+end:
+	if (!e->inflight && !e->dead)
+		uring_arm_recv(e);
+}
+
+static void uring_tx_complete(struct uring *r, struct uring_tx *tx,
+			      const struct io_uring_cqe *cqe)
+{
+	if (cqe->res < 0)
+		pr_err("%s: sendmsg: %s\n", __func__, strerror(-cqe->res));
+	list_add(&tx->list, &r->free_tx);
+}
+
+static void uring_handle_cqe(struct uring *r, const struct io_uring_cqe *cqe)
+{
+	struct fd_event *e;
+
+	if (!cqe->user_data)
+		return;
+	if (cqe->user_data & URING_UD_TX) {
+		uring_tx_complete(r, (void *)(uintptr_t)(cqe->user_data &
+							 ~URING_UD_TX), cqe);
+		return;
+	}
+	e = (void *)(uintptr_t)cqe->user_data;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		e->inflight = 0;
+	if (e->dead) {
+		uring_release(e);
+		return;
+	}
+	if (e->flags & EVT_FD_F_RECV)
+		uring_recv_complete(e, cqe);
+	else
+		uring_poll_complete(e, cqe);
+}
+
+static int uring_reap(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe cqe;
+	int n = 0;
+
+	for ( ; head != tail; head++, n++) {
+		/* Copy and release the cqe, callbacks may submit new sqes */
+		cqe = r->cqes[head & *r->cq_mask];
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+		uring_handle_cqe(r, &cqe);
+	}
+	return n;
+}
+
+static int uring_wait(struct event_loop *l, struct timeval *tv)
+{
+	struct uring *r = l->uring;
+	struct timespec start;
+	int ret, n, err;
+
+	if (tv)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	uring_flush_cancels(r);
+	ret = uring_submit(r, 1, tv);
+	err = errno;
+	loop_timeouts_update_clock(l);
+	if (ret < 0 && err != ETIME && err != EINTR)
+		pr_err("%s: io_uring_enter: %s\n", __func__, strerror(err));
+	n = uring_reap(r);
+	if (tv)
+		fd_events_update_tv(tv, &start, !n);
+	if (n)
+		return n;
+	if (!tv || (ret < 0 && err != ETIME)) {
+		errno = ret < 0 ? err : EINTR;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queued sends are fire-and-forget: their errors can only be logged on
+ * completion (uring_tx_complete()). Messages which can't be queued (too
+ * long for a tx buffer, with control data, no sqe) are sent right away
+ * and sendmsg()'s errors returned
+ */
+static int uring_sendmsg(struct event_loop *l, int fd,
+			 const struct msghdr *msg)
+{
+	struct uring *r = l->uring;
+	struct io_uring_sqe *sqe;
+	struct uring_tx *tx;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+	if (len > URING_TX_BUF_SIZE || msg->msg_controllen ||
+	    msg->msg_namelen > sizeof(tx->name))
+		return sendmsg(fd, msg, 0);
+	if (!list_empty(&r->free_tx)) {
+		tx = list_first_entry(&r->free_tx, struct uring_tx, list);
+		list_del(&tx->list);
+	} else {
+		tx = malloc(sizeof(*tx));
+		if (!tx)
+			return sendmsg(fd, msg, 0);
+	}
+	sqe = uring_get_sqe(r);
+	if (!sqe) {
+		list_add(&tx->list, &r->free_tx);
+		return sendmsg(fd, msg, 0);
+	}
+	for (i = 0, len = 0; i < msg->msg_iovlen; i++) {
+		memcpy(&tx->buf[len], msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		len += msg->msg_iov[i].iov_len;
+	}
+	tx->iov.iov_base = tx->buf;
+	tx->iov.iov_len = len;
+	memset(&tx->mh, 0, sizeof(tx->mh));
+	if (msg->msg_name) {
+		memcpy(&tx->name, msg->msg_name, msg->msg_namelen);
+		tx->mh.msg_name = &tx->name;
+		tx->mh.msg_namelen = msg->msg_namelen;
+	}
+	tx->mh.msg_iov = &tx->iov;
+	tx->mh.msg_iovlen = 1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&tx->mh;
+	sqe->len = 1;
+	sqe->user_data = (uintptr_t)tx | URING_UD_TX;
+	return len;
+}
+
+/* Loops with no events and no sends in flight (failed event_loop_new()) */
+static void uring_release_loop(struct event_loop *l)
+{
+	struct uring *r = l->uring;
+	struct uring_tx *tx, *tmp;
+
+	list_for_each_entry_safe(tx, tmp, &r->free_tx, list) {
+		list_del(&tx->list);
+		free(tx);
+	}
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->cq_ptr, r->cq_size);
+	munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+	free(r);
+	l->uring = NULL;
+}
+
+static const struct fd_events_ops uring_ops = {
+	.add = uring_add,
+	.add_recv = uring_add_recv,
+	.cancel = uring_cancel,
+	.wait = uring_wait,
+	.sendmsg = uring_sendmsg,
+	.release = uring_release_loop,
+};
+
+const struct fd_events_ops *uring_fd_events_init(struct event_loop *l)
+{
+	struct uring *r;
+	struct io_uring_params p;
+	struct io_uring_sqe *sqes;
+	void *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0 && errno == EINVAL) {
+		/* Older kernel */
+		memset(&p, 0, sizeof(p));
+		fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	}
+	if (fd < 0) {
+		pr_err("%s: io_uring_setup: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		pr_err("%s: kernel is too old\n", __func__);
+		goto err0;
+	}
+	r = malloc(sizeof(*r));
+	if (!r) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		goto err0;
+	}
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err1;
+	cq = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto err2;
+	sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err3;
+	r->fd = fd;
+	r->sq_entries = p.sq_entries;
+	r->sq_ptr = sq;
+	r->sq_head = sq + p.sq_off.head;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->sqes = sqes;
+	r->sqe_tail = r->sqe_published = *r->sq_tail;
+	r->cq_ptr = cq;
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = cq + p.cq_off.ring_mask;
+	r->cqes = cq + p.cq_off.cqes;
+	r->next_bgid = 0;
+	INIT_LIST_HEAD(&r->free_tx);
+	INIT_LIST_HEAD(&r->pending_cancels);
+	l->uring = r;
+	return &uring_ops;
+
+err3:
+	munmap(cq, r->cq_size);
+err2:
+	munmap(sq, r->sq_size);
+err1:
+	pr_err("%s: mmap: %s\n", __func__, strerror(errno));
+	free(r);
+err0:
+	close(fd);
+	return NULL;
+}
+
+#endif /* CONFIG_IO_URING */
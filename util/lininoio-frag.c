@@ -0,0 +1,253 @@
+/*
+ * Lininoio messages: messages too long for a data packet are sent as a
+ * sequence of fragments, which are reassembled in order into a per channel
+ * buffer. Reassembly memory is bounded for all channels together, and
+ * messages whose fragments stop coming are evicted by a timeout.
+ *
+ * GNU GPLv2 or later
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <endian.h>
+#include "common.h"
+#include "logger.h"
+#include "timeout.h"
+#include "lininoio-internal.h"
+
+/* Memory available for reassembly, all channels together */
+#ifndef LININOIO_REASM_MEM
+#define LININOIO_REASM_MEM (4 * 1024 * 1024)
+#endif
+
+/* Max time between two fragments of a message, ms */
+#define LININOIO_REASM_TIMEOUT 500
+
+/* Reassembly memory in use, channels can live in different threads */
+static size_t reasm_mem;
+
+static void reasm_free(struct lininoio_reasm *r)
+{
+	if (!r->buf)
+		return;
+	del_timeout(&r->to);
+	free(r->buf);
+	r->buf = NULL;
+	__atomic_sub_fetch(&reasm_mem, r->len, __ATOMIC_RELAXED);
+}
+
+static void reasm_drop(struct lininoio_channel *c, const char *why)
+{
+	struct lininoio_reasm *r = &c->reasm;
+
+	pr_debug("channel %u: message %u dropped (%s)\n", c->id, r->msg_id,
+		 why);
+	r->dropped++;
+	reasm_free(r);
+}
+
+static void reasm_expired(struct timeout *t, void *_c)
+{
+	reasm_drop(_c, "timeout");
+}
+
+static int reasm_alloc(struct lininoio_channel *c, uint32_t len)
+{
+	struct lininoio_reasm *r = &c->reasm;
+
+	if (__atomic_add_fetch(&reasm_mem, len, __ATOMIC_RELAXED) >
+	    LININOIO_REASM_MEM)
+		goto err;
+	r->buf = malloc(len);
+	if (!r->buf)
+		goto err;
+	r->len = len;
+	r->received = 0;
+	init_timeout(&r->to, reasm_expired, c);
+	return 0;
+
+err:
+	__atomic_sub_fetch(&reasm_mem, len, __ATOMIC_RELAXED);
+	return -1;
+}
+
+void lininoio_reasm_release(struct lininoio_channel *c)
+{
+	reasm_free(&c->reasm);
+}
+
+void lininoio_data_inbound(struct lininoio_channel *c,
+			   const struct lininoio_data_packet *p)
+{
+	if (!c->ops) {
+		pr_debug("%s: no handler for packet\n", __func__);
+		return;
+	}
+	/* Reliable channels carry rdata only, plain data bypasses ordering */
+	if (c->rel) {
+		pr_debug("%s: channel %u: plain data in reliable mode\n",
+			 __func__, c->id);
+		c->rel_stats.unreliable++;
+		return;
+	}
+	if (c->ops->inbound_message)
+		c->ops->inbound_message(c, p->data,
+					lininoio_decode_cdlen(le16toh(p->cdlen),
+							      NULL));
+	else if (c->ops->inbound_packet)
+		c->ops->inbound_packet(c, p);
+	else
+		pr_debug("%s: no handler for packet\n", __func__);
+}
+
+void lininoio_frag_inbound(struct lininoio_channel *c,
+			   const struct lininoio_frag_packet *p, int len)
+{
+	struct lininoio_reasm *r = &c->reasm;
+	uint16_t dlen = lininoio_decode_cdlen(le16toh(p->cdlen), NULL);
+	uint32_t offset = le32toh(p->offset), msg_len = le32toh(p->msg_len);
+
+	if (sizeof(*p) + dlen > len) {
+		pr_err("%s: truncated fragment\n", __func__);
+		return;
+	}
+	if (!r->buf || p->msg_id != r->msg_id || msg_len != r->len) {
+		/* First fragment lost, or message already dropped */
+		if (!(p->flags & LININOIO_FRAG_F_FIRST))
+			return;
+		/* Previous message never completed */
+		if (r->buf)
+			reasm_drop(c, "incomplete");
+		r->msg_id = p->msg_id;
+		if (offset || !msg_len || msg_len > LININOIO_MAX_MSG_LEN) {
+			pr_err("%s: invalid fragmented message\n", __func__);
+			r->dropped++;
+			return;
+		}
+		if (reasm_alloc(c, msg_len) < 0) {
+			pr_err("%s: no memory for a %u bytes message\n",
+			       __func__, msg_len);
+			r->dropped++;
+			return;
+		}
+	}
+	/* Retransmitted fragment */
+	if (offset + dlen <= r->received)
+		return;
+	if (offset != r->received || offset + dlen > r->len ||
+	    !(p->flags & LININOIO_FRAG_F_LAST) != (offset + dlen < r->len)) {
+		reasm_drop(c, "missing fragment");
+		return;
+	}
+	memcpy(r->buf + offset, p->data, dlen);
+	r->received += dlen;
+	if (r->received < r->len) {
+		mod_timeout(&r->to, LININOIO_REASM_TIMEOUT);
+		return;
+	}
+	if (!c->ops || !c->ops->inbound_message)
+		pr_debug("%s: no handler for message\n", __func__);
+	else
+		c->ops->inbound_message(c, r->buf, r->len);
+	reasm_free(r);
+}
+
+/*
+ * Fill @dst with the pieces of @iov making @len bytes from @offset on.
+ * Returns the number of pieces
+ */
+static int iov_slice(struct iovec *dst, const struct iovec *iov, int iovcnt,
+		     size_t offset, size_t len)
+{
+	int i, n = 0;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+		dst[n].iov_base = iov[i].iov_base + offset;
+		dst[n].iov_len = min(iov[i].iov_len - offset, len);
+		len -= dst[n++].iov_len;
+		offset = 0;
+	}
+	return n;
+}
+
+int lininoio_send_messagev(struct lininoio_channel *c,
+			   struct lininoio_node *n,
+			   const struct iovec *iov, int iovcnt)
+{
+	int max = n->max_dlen ? : LININOIO_MAX_DLEN;
+	struct iovec piov[LININOIO_MAX_MSG_IOV + 1];
+	uint8_t rbuf[LININOIO_MAX_DLEN];
+	struct lininoio_data_packet dp;
+	struct lininoio_frag_packet fp;
+	size_t len = 0, offset, flen;
+	int i;
+
+	if (iovcnt > LININOIO_MAX_MSG_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	/* Reliable channels never fragment, and copy to their window */
+	if (c->rel) {
+		if (iovcnt == 1)
+			return lininoio_rel_send(c, iov[0].iov_base, len);
+		if (len > sizeof(rbuf)) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		for (i = 0, offset = 0; i < iovcnt; offset += iov[i++].iov_len)
+			memcpy(rbuf + offset, iov[i].iov_base, iov[i].iov_len);
+		return lininoio_rel_send(c, rbuf, len);
+	}
+	if (len <= max) {
+		dp.type = LININOIO_PACKET_DATA;
+		dp.cdlen = htole16(lininoio_encode_cdlen(len, c->id));
+		piov[0].iov_base = &dp;
+		piov[0].iov_len = sizeof(dp);
+		memcpy(&piov[1], iov, iovcnt * sizeof(*iov));
+		return lininoio_send_packetv(n, piov, iovcnt + 1);
+	}
+	if (!(n->caps & LININOIO_CAP_FRAG) || len > LININOIO_MAX_MSG_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	/* Fragments fill the same frames as the biggest data packets */
+	max -= sizeof(fp) - sizeof(dp);
+	fp.type = LININOIO_PACKET_FRAG;
+	fp.msg_id = c->tx_msg_id++;
+	fp.msg_len = htole32(len);
+	piov[0].iov_base = &fp;
+	piov[0].iov_len = sizeof(fp);
+	for (offset = 0; offset < len; offset += flen) {
+		flen = min(len - offset, (size_t)max);
+		fp.cdlen = htole16(lininoio_encode_cdlen(flen, c->id));
+		fp.flags = 0;
+		if (!offset)
+			fp.flags |= LININOIO_FRAG_F_FIRST;
+		if (offset + flen == len)
+			fp.flags |= LININOIO_FRAG_F_LAST;
+		fp.offset = htole32(offset);
+		i = iov_slice(&piov[1], iov, iovcnt, offset, flen);
+		if (lininoio_send_packetv(n, piov, i + 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int lininoio_send_message(struct lininoio_channel *c,
+			  struct lininoio_node *n,
+			  const void *buf, size_t len)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+
+	return lininoio_send_messagev(c, n, &iov, 1);
+}
@@ -0,0 +1,397 @@
+/*
+ * Lininoio reliable mode: data on a reliable channel is sent in sequenced
+ * rdata packets, at most LININOIO_REL_WINDOW of them in flight. The
+ * receiver buffers out of order packets and acknowledges them with a
+ * selective ack bitmap, piggybacked on its own data when there is some
+ * (acks are delayed a little for this). Holes with enough packets acked
+ * above them are retransmitted at once, the retransmission timeout is
+ * adapted to the measured round trip time.
+ *
+ * GNU GPLv2 or later
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <endian.h>
+#include "common.h"
+#include "logger.h"
+#include "timeout.h"
+#include "lininoio-internal.h"
+
+#define REL_WINDOW		LININOIO_REL_WINDOW
+/* Messages waiting for room in the window */
+#define REL_MAX_BACKLOG		256
+/* Retransmission timeout, ms */
+#define REL_RTO_INIT		100
+#define REL_RTO_MIN		10
+#define REL_RTO_MAX		1000
+/* Max time an ack waits for reverse data, ms (less than REL_RTO_MIN) */
+#define REL_ACK_DELAY		2
+/* Packets acked above a hole before it is retransmitted */
+#define REL_DUP_THRESH		3
+
+struct rel_pkt {
+	/* Backlog */
+	struct list_head list;
+	uint16_t seq;
+	/* Last transmission, ms */
+	uint64_t sent;
+	int retransmits;
+	int fast_retransmitted;
+	size_t len;
+	uint8_t data[0];
+};
+
+struct lininoio_rel {
+	struct lininoio_channel *c;
+	struct lininoio_node *n;
+	/* Sender: oldest unacked, next sequence number */
+	uint16_t snd_una;
+	uint16_t snd_nxt;
+	/* Packets in flight, by sequence number. NULL: acked */
+	struct rel_pkt *snd_buf[REL_WINDOW];
+	struct list_head backlog;
+	int backlog_len;
+	struct timeout rto_to;
+	/* Round trip time estimate, ms */
+	unsigned int srtt;
+	unsigned int rttvar;
+	/* Retransmission timeout from the estimate, and backed off */
+	unsigned int rto_base;
+	unsigned int rto;
+	/* Receiver: next expected, received after it (bit i: rcv_nxt + 1 + i) */
+	uint16_t rcv_nxt;
+	uint32_t rcv_sack;
+	struct rel_pkt *rcv_buf[REL_WINDOW];
+	int ack_pending;
+	struct timeout ack_to;
+};
+
+static inline struct rel_pkt **snd_slot(struct lininoio_rel *r, uint16_t seq)
+{
+	return &r->snd_buf[seq % REL_WINDOW];
+}
+
+static inline struct rel_pkt **rcv_slot(struct lininoio_rel *r, uint16_t seq)
+{
+	return &r->rcv_buf[seq % REL_WINDOW];
+}
+
+/* Send packet @p or, if NULL, a pure ack */
+static int rel_xmit(struct lininoio_rel *r, struct rel_pkt *p)
+{
+	struct lininoio_rdata_packet h;
+	struct iovec iov[2];
+	int iovcnt = 1;
+
+	h.type = LININOIO_PACKET_RDATA;
+	h.cdlen = htole16(lininoio_encode_cdlen(p ? p->len : 0, r->c->id));
+	h.seq = htole16(p ? p->seq : r->snd_nxt);
+	h.ack = htole16(r->rcv_nxt);
+	h.sack = htole32(r->rcv_sack);
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	if (p) {
+		iov[1].iov_base = p->data;
+		iov[1].iov_len = p->len;
+		iovcnt++;
+		p->sent = timeouts_now();
+		if (!timeout_pending(&r->rto_to))
+			mod_timeout(&r->rto_to, r->rto);
+	}
+	r->ack_pending = 0;
+	del_timeout(&r->ack_to);
+	return lininoio_send_packetv(r->n, iov, iovcnt);
+}
+
+static void rel_retransmit(struct lininoio_rel *r, struct rel_pkt *p)
+{
+	pr_debug("channel %u: retransmitting %u\n", r->c->id, p->seq);
+	r->c->rel_stats.lost++;
+	r->c->rel_stats.retransmits++;
+	p->retransmits++;
+	rel_xmit(r, p);
+}
+
+/* Give the next backlogged message a sequence number and send it */
+static void rel_fill_window(struct lininoio_rel *r)
+{
+	struct rel_pkt *p;
+
+	while (!list_empty(&r->backlog) &&
+	       (uint16_t)(r->snd_nxt - r->snd_una) < REL_WINDOW) {
+		p = list_first_entry(&r->backlog, struct rel_pkt, list);
+		list_del(&p->list);
+		r->backlog_len--;
+		p->seq = r->snd_nxt++;
+		*snd_slot(r, p->seq) = p;
+		rel_xmit(r, p);
+	}
+}
+
+/* RFC 6298, with a 1 ms clock granularity */
+static void rel_rtt_sample(struct lininoio_rel *r, unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (!r->srtt) {
+		r->srtt = rtt ? : 1;
+		r->rttvar = rtt / 2;
+	} else {
+		delta = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+		r->rttvar = (3 * r->rttvar + delta) / 4;
+		r->srtt = (7 * r->srtt + rtt) / 8 ? : 1;
+	}
+	r->c->rel_stats.srtt = r->srtt;
+	r->rto_base = r->srtt + max(1U, 4 * r->rttvar);
+	r->rto_base = min(max(r->rto_base, (unsigned int)REL_RTO_MIN),
+			  (unsigned int)REL_RTO_MAX);
+}
+
+static void rel_ack_inbound(struct lininoio_rel *r, uint16_t ack,
+			    uint32_t sack)
+{
+	uint16_t inflight = r->snd_nxt - r->snd_una, seq;
+	uint64_t now = timeouts_now();
+	struct rel_pkt *p, **slot;
+	int i, acked = 0, above;
+
+	/* Stale ack, or acking data never sent */
+	if ((uint16_t)(ack - r->snd_una) > inflight)
+		return;
+	for (seq = r->snd_una; seq != ack; seq++) {
+		slot = snd_slot(r, seq);
+		p = *slot;
+		if (!p)
+			continue;
+		/* Karn: retransmitted packets give no sample */
+		if (!p->retransmits)
+			rel_rtt_sample(r, now - p->sent);
+		free(p);
+		*slot = NULL;
+		acked = 1;
+	}
+	r->snd_una = ack;
+	inflight = r->snd_nxt - r->snd_una;
+	for (i = 0; sack && i < REL_WINDOW; i++) {
+		seq = ack + 1 + i;
+		if (!(sack & (1U << i)) ||
+		    (uint16_t)(seq - r->snd_una) >= inflight)
+			continue;
+		slot = snd_slot(r, seq);
+		free(*slot);
+		*slot = NULL;
+	}
+	/* Fast retransmit: holes with enough packets selectively acked above */
+	for (seq = r->snd_una; sack && seq != r->snd_nxt; seq++) {
+		p = *snd_slot(r, seq);
+		if (!p || p->fast_retransmitted)
+			continue;
+		i = (uint16_t)(seq - ack);
+		above = __builtin_popcount(i ? sack >> i : sack);
+		if (above < REL_DUP_THRESH)
+			break;
+		p->fast_retransmitted = 1;
+		rel_retransmit(r, p);
+	}
+	if (acked) {
+		/* The peer is alive, stop backing off */
+		r->rto = r->rto_base;
+		if (r->snd_una == r->snd_nxt)
+			del_timeout(&r->rto_to);
+		else
+			mod_timeout(&r->rto_to, r->rto);
+	}
+	rel_fill_window(r);
+}
+
+/* All the packets not acked yet are considered lost */
+static void rel_rto_expired(struct timeout *t, void *_r)
+{
+	struct lininoio_rel *r = _r;
+	struct rel_pkt *p;
+	uint16_t seq;
+
+	r->rto = min(r->rto * 2, (unsigned int)REL_RTO_MAX);
+	for (seq = r->snd_una; seq != r->snd_nxt; seq++) {
+		p = *snd_slot(r, seq);
+		if (!p)
+			continue;
+		p->fast_retransmitted = 0;
+		rel_retransmit(r, p);
+	}
+}
+
+static void rel_ack_expired(struct timeout *t, void *_r)
+{
+	struct lininoio_rel *r = _r;
+
+	if (r->ack_pending)
+		rel_xmit(r, NULL);
+}
+
+static void rel_deliver(struct lininoio_rel *r, const void *buf, size_t len)
+{
+	struct lininoio_channel *c = r->c;
+
+	if (c->ops && c->ops->inbound_message)
+		c->ops->inbound_message(c, buf, len);
+	else
+		pr_debug("%s: no handler for message\n", __func__);
+}
+
+/* rcv_nxt has been received, returns true if the next one is buffered */
+static int rel_rcv_advance(struct lininoio_rel *r)
+{
+	int next = r->rcv_sack & 1;
+
+	r->rcv_nxt++;
+	r->rcv_sack >>= 1;
+	return next;
+}
+
+static void rel_data_inbound(struct lininoio_rel *r, uint16_t seq,
+			     const void *buf, size_t len)
+{
+	struct lininoio_channel *c = r->c;
+	uint16_t d = seq - r->rcv_nxt;
+	struct rel_pkt *p, **slot;
+	int next;
+
+	if (!d) {
+		next = rel_rcv_advance(r);
+		rel_deliver(r, buf, len);
+		while (next) {
+			slot = rcv_slot(r, r->rcv_nxt);
+			p = *slot;
+			*slot = NULL;
+			next = rel_rcv_advance(r);
+			rel_deliver(r, p->data, p->len);
+			free(p);
+		}
+		/*
+		 * Ack every other packet at once, and at once if the sender
+		 * is recovering a loss
+		 */
+		if (r->rcv_sack || r->ack_pending) {
+			rel_xmit(r, NULL);
+			return;
+		}
+		r->ack_pending = 1;
+		mod_timeout(&r->ack_to, REL_ACK_DELAY);
+		return;
+	}
+	if (d > REL_WINDOW) {
+		/* Before rcv_nxt: the ack was lost */
+		if (d & 0x8000)
+			c->rel_stats.duplicates++;
+		else
+			pr_debug("channel %u: %u out of window\n", c->id, seq);
+		rel_xmit(r, NULL);
+		return;
+	}
+	if (r->rcv_sack & (1U << (d - 1))) {
+		c->rel_stats.duplicates++;
+	} else {
+		p = malloc(sizeof(*p) + len);
+		if (!p) {
+			pr_err("%s: no memory for packet %u\n", __func__, seq);
+			return;
+		}
+		p->len = len;
+		memcpy(p->data, buf, len);
+		*rcv_slot(r, seq) = p;
+		r->rcv_sack |= 1U << (d - 1);
+		c->rel_stats.reordered++;
+	}
+	rel_xmit(r, NULL);
+}
+
+void lininoio_rel_inbound(struct lininoio_channel *c,
+			  const struct lininoio_rdata_packet *p, int len)
+{
+	struct lininoio_rel *r = c->rel;
+	uint16_t dlen = lininoio_decode_cdlen(le16toh(p->cdlen), NULL);
+
+	if (!r) {
+		pr_debug("%s: channel %u not in reliable mode\n", __func__,
+			 c->id);
+		return;
+	}
+	if (sizeof(*p) + dlen > len) {
+		pr_err("%s: truncated packet\n", __func__);
+		return;
+	}
+	rel_ack_inbound(r, le16toh(p->ack), le32toh(p->sack));
+	if (dlen)
+		rel_data_inbound(r, le16toh(p->seq), p->data, dlen);
+}
+
+int lininoio_rel_send(struct lininoio_channel *c, const void *buf,
+		      size_t len)
+{
+	struct lininoio_rel *r = c->rel;
+	int max = r->n->max_dlen ? : LININOIO_MAX_DLEN;
+	struct rel_pkt *p;
+
+	max -= sizeof(struct lininoio_rdata_packet) -
+		sizeof(struct lininoio_data_packet);
+	if (!len || len > max) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (r->backlog_len >= REL_MAX_BACKLOG) {
+		errno = EAGAIN;
+		return -1;
+	}
+	p = malloc(sizeof(*p) + len);
+	if (!p)
+		return -1;
+	memset(p, 0, sizeof(*p));
+	p->len = len;
+	memcpy(p->data, buf, len);
+	list_add_tail(&p->list, &r->backlog);
+	r->backlog_len++;
+	rel_fill_window(r);
+	return 0;
+}
+
+int lininoio_rel_init(struct lininoio_channel *c, struct lininoio_node *n)
+{
+	struct lininoio_rel *r = malloc(sizeof(*r));
+
+	if (!r) {
+		pr_err("%s: no memory for channel %u\n", __func__, c->id);
+		return -1;
+	}
+	memset(r, 0, sizeof(*r));
+	r->c = c;
+	r->n = n;
+	r->rto_base = r->rto = REL_RTO_INIT;
+	INIT_LIST_HEAD(&r->backlog);
+	init_timeout(&r->rto_to, rel_rto_expired, r);
+	init_timeout(&r->ack_to, rel_ack_expired, r);
+	c->rel = r;
+	return 0;
+}
+
+void lininoio_rel_release(struct lininoio_channel *c)
+{
+	struct lininoio_rel *r = c->rel;
+	struct rel_pkt *p, *tmp;
+	int i;
+
+	if (!r)
+		return;
+	del_timeout(&r->rto_to);
+	del_timeout(&r->ack_to);
+	for (i = 0; i < REL_WINDOW; i++) {
+		free(r->snd_buf[i]);
+		free(r->rcv_buf[i]);
+	}
+	list_for_each_entry_safe(p, tmp, &r->backlog, list)
+		free(p);
+	free(r);
+	c->rel = NULL;
+}
@@ -14,6 +14,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <linux/if_packet.h>
@@ -26,6 +28,12 @@
 #include "timeout.h"
 
 static const struct lininoio_proto_ops **lininoio_ops = NULL;
+/*
+ * Process wide, shared by all the event loops: handlers are loaded once.
+ * Protects lininoio_ops[]: handlers are loaded on the first association
+ * using them, possibly from several loop threads at the same time
+ */
+static pthread_mutex_t lininoio_ops_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int lininoio_init(void)
 {
@@ -41,16 +49,20 @@ int lininoio_init(void)
 
 const struct lininoio_proto_ops *lininoio_find_proto_ops(uint16_t proto_id)
 {
+	const struct lininoio_proto_ops *out;
+
 	if (!lininoio_ops)
 		return NULL;
 	if (proto_id >= LININOIO_N_PROTOS)
 		return NULL;
+	pthread_mutex_lock(&lininoio_ops_lock);
 	if (!lininoio_ops[proto_id]) {
 		/* Handler not found, try loading it */
 		struct lininoio_proto_handler *h;
 
 		h = load_lininoio_proto_handler(LIBDIR, proto_id);
 		if (!h) {
+			pthread_mutex_unlock(&lininoio_ops_lock);
 			pr_err("%s: no handler for proto 0x%04x\n",
 			       __func__, proto_id);
 			return NULL;
@@ -60,7 +72,9 @@ const struct lininoio_proto_ops *lininoio_find_proto_ops(uint16_t proto_id)
 			       __func__);
 		lininoio_ops[proto_id] = h->data->ops;
 	}
-	return lininoio_ops[proto_id];
+	out = lininoio_ops[proto_id];
+	pthread_mutex_unlock(&lininoio_ops_lock);
+	return out;
 }
 
 int lininoio_register_proto_handler(uint16_t proto_id,
@@ -70,16 +84,68 @@ int lininoio_register_proto_handler(uint16_t proto_id,
 		return -1;
 	if (proto_id >= LININOIO_N_PROTOS)
 		return -1;
+	pthread_mutex_lock(&lininoio_ops_lock);
 	lininoio_ops[proto_id] = ops;
+	pthread_mutex_unlock(&lininoio_ops_lock);
 	return 0;
 }
 
-int lininoio_send_packet(struct lininoio_node *n,
-			 const struct lininoio_packet *packet)
+int lininoio_send_packetv(struct lininoio_node *n,
+			  const struct iovec *iov, int iovcnt)
 {
 	if (!lininoio_ops)
 		return -1;
 	if (!n->send_packet)
 		return -1;
-	return n->send_packet(n, packet);
+	return n->send_packet(n, iov, iovcnt);
+}
+
+/* Length of contiguous packet @packet, -1 if unknown */
+static int lininoio_packet_len(struct lininoio_node *n,
+			       const struct lininoio_packet *packet)
+{
+	const struct lininoio_data_packet *dp;
+	const struct lininoio_frag_packet *fp;
+	const struct lininoio_areply_packet *ap;
+	const struct lininoio_association_data *ad;
+	int i, len;
+
+	switch (packet->type) {
+	case LININOIO_PACKET_DATA:
+		dp = (const void *)packet;
+		return sizeof(*dp) + lininoio_decode_cdlen(le16toh(dp->cdlen),
+							   NULL);
+	case LININOIO_PACKET_FRAG:
+		fp = (const void *)packet;
+		return sizeof(*fp) + lininoio_decode_cdlen(le16toh(fp->cdlen),
+							   NULL);
+	case LININOIO_PACKET_AREPLY:
+		ap = (const void *)packet;
+		len = sizeof(*ap);
+		for (i = 0; i < n->nchannels; i++) {
+			ad = (const void *)packet + len;
+			len += sizeof(*ad) +
+				lininoio_decode_cdlen(le16toh(ad->chan_dlen),
+						      NULL);
+		}
+		return len;
+	default:
+		return -1;
+	}
+}
+
+int lininoio_send_packet(struct lininoio_node *n,
+			 const struct lininoio_packet *packet)
+{
+	struct iovec iov;
+	int len = lininoio_packet_len(n, packet);
+
+	if (len < 0) {
+		pr_err("%s: unsupported packet type %d\n", __func__,
+		       packet->type);
+		return -1;
+	}
+	iov.iov_base = (void *)packet;
+	iov.iov_len = len;
+	return lininoio_send_packetv(n, &iov, 1);
 }
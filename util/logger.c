@@ -15,6 +15,10 @@ struct logger {
     char *ident;
 };
 
+/*
+ * Process wide, shared by all the event loops: set up once by
+ * logger_init() before any loop thread starts, read only afterwards
+ */
 static struct logger *process_logger;
 
 int logger_init(FILE *f, char *ident)
@@ -44,9 +48,12 @@ static int __logger_log_file(int prio, const char *fmt, va_list ap)
     gethostname(hostname, sizeof(hostname));
     /* Delete the final '\n' */
     date[strlen(date) - 1] = 0;
+    /* Don't mix lines from different loop threads */
+    flockfile(process_logger->f);
     fprintf(process_logger->f, "%s %s %s: ", date, hostname,
 	    process_logger->ident);
     vfprintf(process_logger->f, fmt, ap);
+    funlockfile(process_logger->f);
     return 0;
 }
 
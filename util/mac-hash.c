@@ -0,0 +1,169 @@
+/*
+ * Open addressing (linear probing) hash index keyed on MAC address and
+ * ifindex. Deletion shifts back the following entries, so there are no
+ * tombstones and lookups never scan more than the current cluster.
+ *
+ * GNU GPLv2 or later
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "logger.h"
+#include "mac-hash.h"
+
+#define MAC_HASH_MIN_SIZE 16
+
+static inline uint64_t mac_key(const uint8_t *mac, int ifindex)
+{
+	uint64_t k = 0;
+
+	memcpy(&k, mac, MAC_HASH_ADDR_LEN);
+	return k ^ ((uint64_t)(uint16_t)ifindex << 48);
+}
+
+static inline unsigned int mac_hash_index(const struct mac_hash *h,
+					  const uint8_t *mac, int ifindex)
+{
+	/* Fibonacci hashing, the top bits are the well mixed ones */
+	return (mac_key(mac, ifindex) * 0x9e3779b97f4a7c15ULL) >>
+		(64 - __builtin_ctz(h->size));
+}
+
+static inline int slot_match(const struct mac_hash_slot *s,
+			     const uint8_t *mac, int ifindex)
+{
+	return s->used && s->ifindex == ifindex &&
+		!memcmp(s->mac, mac, MAC_HASH_ADDR_LEN);
+}
+
+static int mac_hash_alloc(struct mac_hash *h, unsigned int size)
+{
+	h->slots = calloc(size, sizeof(*h->slots));
+	if (!h->slots) {
+		pr_err("%s: cannot allocate hash table\n", __func__);
+		return -1;
+	}
+	h->size = size;
+	h->count = 0;
+	h->last = NULL;
+	return 0;
+}
+
+int mac_hash_init(struct mac_hash *h, unsigned int size)
+{
+	unsigned int s = MAC_HASH_MIN_SIZE;
+
+	/* Keep the load factor under 1/2 */
+	while (s < size * 2)
+		s <<= 1;
+	return mac_hash_alloc(h, s);
+}
+
+void mac_hash_destroy(struct mac_hash *h)
+{
+	free(h->slots);
+	h->slots = NULL;
+	h->size = h->count = 0;
+	h->last = NULL;
+}
+
+static struct mac_hash_slot *mac_hash_lookup(struct mac_hash *h,
+					     const uint8_t *mac, int ifindex)
+{
+	unsigned int mask = h->size - 1, i;
+	struct mac_hash_slot *s;
+
+	for (i = mac_hash_index(h, mac, ifindex); ; i = (i + 1) & mask) {
+		s = &h->slots[i];
+		if (!s->used)
+			return NULL;
+		if (slot_match(s, mac, ifindex))
+			return s;
+	}
+}
+
+static void mac_hash_insert(struct mac_hash *h, const uint8_t *mac,
+			    int ifindex, void *data)
+{
+	unsigned int mask = h->size - 1, i;
+	struct mac_hash_slot *s;
+
+	for (i = mac_hash_index(h, mac, ifindex); h->slots[i].used;
+	     i = (i + 1) & mask)
+		;
+	s = &h->slots[i];
+	memcpy(s->mac, mac, MAC_HASH_ADDR_LEN);
+	s->ifindex = ifindex;
+	s->data = data;
+	s->used = 1;
+	h->count++;
+}
+
+static int mac_hash_grow(struct mac_hash *h)
+{
+	struct mac_hash_slot *old = h->slots;
+	unsigned int i, old_size = h->size;
+
+	if (mac_hash_alloc(h, old_size * 2) < 0) {
+		h->slots = old;
+		h->size = old_size;
+		return -1;
+	}
+	for (i = 0; i < old_size; i++)
+		if (old[i].used)
+			mac_hash_insert(h, old[i].mac, old[i].ifindex,
+					old[i].data);
+	free(old);
+	return 0;
+}
+
+int mac_hash_add(struct mac_hash *h, const uint8_t *mac, int ifindex,
+		 void *data)
+{
+	if (mac_hash_lookup(h, mac, ifindex))
+		return -1;
+	if ((h->count + 1) * 2 > h->size && mac_hash_grow(h) < 0)
+		return -1;
+	mac_hash_insert(h, mac, ifindex, data);
+	return 0;
+}
+
+void *mac_hash_find(struct mac_hash *h, const uint8_t *mac, int ifindex)
+{
+	struct mac_hash_slot *s = h->last;
+
+	if (s && slot_match(s, mac, ifindex))
+		return s->data;
+	s = mac_hash_lookup(h, mac, ifindex);
+	if (!s)
+		return NULL;
+	h->last = s;
+	return s->data;
+}
+
+int mac_hash_del(struct mac_hash *h, const uint8_t *mac, int ifindex)
+{
+	unsigned int mask = h->size - 1, i, j, k;
+	struct mac_hash_slot *s = mac_hash_lookup(h, mac, ifindex);
+
+	if (!s)
+		return -1;
+	/* Entries are moved around, drop the cache */
+	h->last = NULL;
+	h->count--;
+	i = s - h->slots;
+	/*
+	 * Backward shift: move back any following entry of the cluster
+	 * whose home slot k is not cyclically in (i, j]
+	 */
+	for (j = (i + 1) & mask; h->slots[j].used; j = (j + 1) & mask) {
+		k = mac_hash_index(h, h->slots[j].mac, h->slots[j].ifindex);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+	h->slots[i].used = 0;
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Simple slab allocator for fixed size objects: slabs of objs_per_slab
+ * cache line aligned objects are allocated on demand, freed objects go
+ * to a free list and are never given back until the cache is destroyed.
+ *
+ * GNU GPLv2 or later
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "list.h"
+#include "logger.h"
+#include "slab.h"
+
+struct slab {
+	struct list_head list;
+} __attribute__((aligned(SLAB_CACHE_LINE)));
+
+int slab_cache_init(struct slab_cache *c, size_t obj_size,
+		    unsigned int objs_per_slab, unsigned int max_objs)
+{
+	if (!obj_size || !objs_per_slab)
+		return -1;
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	c->obj_size = (obj_size + SLAB_CACHE_LINE - 1) &
+		~(size_t)(SLAB_CACHE_LINE - 1);
+	c->objs_per_slab = objs_per_slab;
+	c->max_objs = max_objs;
+	c->nobjs = 0;
+	c->free_list = NULL;
+	INIT_LIST_HEAD(&c->slabs);
+	return 0;
+}
+
+void slab_cache_destroy(struct slab_cache *c)
+{
+	struct slab *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &c->slabs, list) {
+		list_del(&s->list);
+		free(s);
+	}
+	c->free_list = NULL;
+	c->nobjs = 0;
+}
+
+static int slab_grow(struct slab_cache *c)
+{
+	struct slab *s;
+	char *obj;
+	unsigned int i;
+	int stat;
+
+	stat = posix_memalign((void **)&s, SLAB_CACHE_LINE,
+			      sizeof(*s) + c->objs_per_slab * c->obj_size);
+	if (stat) {
+		pr_err("%s: posix_memalign: %s\n", __func__, strerror(stat));
+		return -1;
+	}
+	list_add_tail(&s->list, &c->slabs);
+	obj = (char *)(s + 1);
+	for (i = 0; i < c->objs_per_slab; i++, obj += c->obj_size) {
+		*(void **)obj = c->free_list;
+		c->free_list = obj;
+	}
+	return 0;
+}
+
+void *slab_alloc(struct slab_cache *c)
+{
+	void *out;
+
+	if (c->max_objs && c->nobjs >= c->max_objs)
+		return NULL;
+	if (!c->free_list && slab_grow(c) < 0)
+		return NULL;
+	out = c->free_list;
+	c->free_list = *(void **)out;
+	c->nobjs++;
+	return out;
+}
+
+void slab_free(struct slab_cache *c, void *obj)
+{
+	if (!obj)
+		return;
+	*(void **)obj = c->free_list;
+	c->free_list = obj;
+	c->nobjs--;
+}
@@ -7,37 +7,192 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <linux/stddef.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
+#include "common.h"
+#include "fd_event.h"
+#include "fd_event-internal.h"
 #include "list.h"
 #include "logger.h"
 #include "timeout.h"
 
-struct timeout {
-	struct timeval expires;
-	to_handler *handler;
-	void *priv;
-	struct list_head list;
-	int armed;
+/*
+ * Hierarchical timing wheel (see the classic linux timers implementation).
+ * One tick is one millisecond of CLOCK_MONOTONIC.
+ * Level 0 has one slot per tick for the next 256 ticks, each of the 4 upper
+ * levels has 64 slots, each slot covering 64 slots of the lower level.
+ * Timers are moved (cascaded) to the lower level when the lower level wraps.
+ * Insertion and cancellation are O(1), expiry runs a whole slot at a time.
+ *
+ * Expiry is driven by a timerfd armed with the absolute tick of the next
+ * wheel event and registered as a normal fd event, so that timeouts are
+ * handled even when the loop never goes idle.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+#define TV_SHIFT(l) (TVR_BITS + (l) * TVN_BITS)
+#define MAX_TIMEOUT_TICKS ((1ULL << TV_SHIFT(TVN_LEVELS)) - 1)
+
+/* Timer not in the wheel (being expired) */
+#define TIMEOUT_DETACHED -1
+
+/* struct timeout flags */
+/* Allocated by schedule_timeout(), freed on expiry or cancellation */
+#define TIMEOUT_F_ALLOCATED 0x1
+
+/* Timers of an event loop */
+struct timer_wheel {
+	/* Next tick to be processed */
+	uint64_t now;
+	unsigned long count;
+	struct list_head tv1[TVR_SIZE];
+	struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+	/* Non empty slots bitmaps */
+	uint64_t tv1_map[TVR_SIZE / 64];
+	uint64_t tvn_map[TVN_LEVELS];
+	/* Timeout whose handler is being run */
+	struct timeout *running;
+	/* Set while running expired timeouts, the timerfd is armed at the end */
+	int expiring;
+	int tfd;
+	struct fd_event *tfd_event;
+	/* Tick the timerfd is armed for, UINT64_MAX if disarmed */
+	uint64_t armed_tick;
+	/* Cached clock, refreshed once per loop iteration */
+	uint64_t now_ms;
+	/* get_next_timeout() result */
+	struct timeval next_tv;
 };
 
-struct list_head timeouts;
+static uint64_t clock_ms(void)
+{
+	struct timespec ts;
 
-int timeouts_init(void)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Timers of the calling thread's default loop */
+static struct event_loop *default_timers_loop(void)
 {
-	INIT_LIST_HEAD(&timeouts);
+	struct event_loop *l = event_loop_get_default();
+
+	assert(l && l->timers);
+	return l;
+}
+
+void loop_timeouts_update_clock(struct event_loop *l)
+{
+	if (l->timers)
+		l->timers->now_ms = clock_ms();
+}
+
+void timeouts_update_clock(void)
+{
+	loop_timeouts_update_clock(default_timers_loop());
+}
+
+uint64_t loop_timeouts_now(struct event_loop *l)
+{
+	return l->timers->now_ms;
+}
+
+uint64_t timeouts_now(void)
+{
+	return loop_timeouts_now(default_timers_loop());
+}
+
+static void arm_timerfd(struct timer_wheel *w, uint64_t tick)
+{
+	struct itimerspec its;
+
+	if (w->tfd < 0 || tick == w->armed_tick)
+		return;
+	memset(&its, 0, sizeof(its));
+	if (tick != UINT64_MAX) {
+		its.it_value.tv_sec = tick / 1000;
+		its.it_value.tv_nsec = (tick % 1000) * 1000000;
+		/* A zero it_value disarms the timer */
+		if (!tick)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		pr_err("%s: timerfd_settime: %s\n", __func__, strerror(errno));
+		return;
+	}
+	w->armed_tick = tick;
+}
+
+static void timerfd_cb(void *_w);
+
+int loop_timeouts_init(struct event_loop *l)
+{
+	struct timer_wheel *w;
+	int i, j;
+
+	w = malloc(sizeof(*w));
+	if (!w) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	memset(w, 0, sizeof(*w));
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&w->tv1[i]);
+	for (i = 0; i < TVN_LEVELS; i++)
+		for (j = 0; j < TVN_SIZE; j++)
+			INIT_LIST_HEAD(&w->tvn[i][j]);
+	memset(w->tv1_map, 0, sizeof(w->tv1_map));
+	memset(w->tvn_map, 0, sizeof(w->tvn_map));
+	w->count = 0;
+	w->now_ms = clock_ms();
+	w->now = w->now_ms;
+
+	w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (w->tfd < 0) {
+		pr_err("%s: timerfd_create: %s\n", __func__, strerror(errno));
+		free(w);
+		return -1;
+	}
+	w->armed_tick = UINT64_MAX;
+	w->tfd_event = loop_add_fd_event(l, w->tfd, EVT_FD_RD, timerfd_cb, w);
+	if (!w->tfd_event) {
+		pr_err("%s: cannot add timerfd event\n", __func__);
+		close(w->tfd);
+		free(w);
+		return -1;
+	}
+	l->timers = w;
 	return 0;
 }
 
+int timeouts_init(void)
+{
+	struct event_loop *l = event_loop_get_default();
+
+	if (!l) {
+		pr_err("%s: fd events not initialized\n", __func__);
+		return -1;
+	}
+	return loop_timeouts_init(l);
+}
+
 #ifdef DEBUG
 static void print_timeout(const char *prev, struct timeout *to)
 {
 	pr_debug("%s ", prev);
-	pr_debug("%p, expires %lu.%06u\n", to,
-		 (unsigned long)to->expires.tv_sec,
-		 (unsigned int)to->expires.tv_usec);
+	pr_debug("%p, expires %llu\n", to, (unsigned long long)to->expires);
 }
 #else
 static inline void print_timeout(const char *prev, struct timeout *to)
@@ -45,10 +200,112 @@ static inline void print_timeout(const char *prev, struct timeout *to)
 }
 #endif
 
-struct timeout *schedule_timeout(unsigned long ms, to_handler *toh,
-				 void *priv)
+static inline struct list_head *slot_head(struct timer_wheel *w, int level,
+					   int slot)
+{
+	return level ? &w->tvn[level - 1][slot] : &w->tv1[slot];
+}
+
+static inline void slot_set(struct timer_wheel *w, int level, int slot)
+{
+	if (level)
+		w->tvn_map[level - 1] |= 1ULL << slot;
+	else
+		w->tv1_map[slot >> 6] |= 1ULL << (slot & 63);
+}
+
+static inline void slot_clear(struct timer_wheel *w, int level, int slot)
+{
+	if (level)
+		w->tvn_map[level - 1] &= ~(1ULL << slot);
+	else
+		w->tv1_map[slot >> 6] &= ~(1ULL << (slot & 63));
+}
+
+static void wheel_add(struct timer_wheel *w, struct timeout *to)
 {
-	struct timeout *to, *ptr;
+	uint64_t expires = to->expires;
+	int64_t idx = expires - w->now;
+	int level, slot;
+
+	if (idx < 0) {
+		/* Already expired, run at next tick */
+		level = 0;
+		slot = w->now & TVR_MASK;
+	} else if (idx < TVR_SIZE) {
+		level = 0;
+		slot = expires & TVR_MASK;
+	} else {
+		if (idx > MAX_TIMEOUT_TICKS) {
+			expires = w->now + MAX_TIMEOUT_TICKS;
+			idx = MAX_TIMEOUT_TICKS;
+		}
+		for (level = 1; idx >= (1LL << TV_SHIFT(level)); level++)
+			;
+		slot = (expires >> TV_SHIFT(level - 1)) & TVN_MASK;
+	}
+	to->level = level;
+	to->slot = slot;
+	list_add_tail(&to->list, slot_head(w, level, slot));
+	slot_set(w, level, slot);
+}
+
+static void wheel_del(struct timer_wheel *w, struct timeout *to)
+{
+	list_del_init(&to->list);
+	w->count--;
+	if (to->level == TIMEOUT_DETACHED)
+		return;
+	if (list_empty(slot_head(w, to->level, to->slot)))
+		slot_clear(w, to->level, to->slot);
+}
+
+void loop_init_timeout(struct event_loop *l, struct timeout *to,
+		       to_handler *toh, void *priv)
+{
+	to->handler = toh;
+	to->priv = priv;
+	to->flags = 0;
+	to->wheel = l->timers;
+	INIT_LIST_HEAD(&to->list);
+}
+
+void init_timeout(struct timeout *to, to_handler *toh, void *priv)
+{
+	loop_init_timeout(default_timers_loop(), to, toh, priv);
+}
+
+void mod_timeout(struct timeout *to, unsigned long ms)
+{
+	struct timer_wheel *w = to->wheel;
+
+	assert(to->handler);
+	/* schedule_timeout() timeouts are freed after their handler runs */
+	assert(to != w->running);
+	if (timeout_pending(to))
+		wheel_del(w, to);
+	to->expires = w->now_ms + ms;
+	print_timeout("\tInserting ", to);
+	wheel_add(w, to);
+	w->count++;
+	/*
+	 * Re-arm only if this expires earlier than the armed tick, pushing a
+	 * timeout forward costs no syscall (the timerfd may fire early)
+	 */
+	if (!w->expiring && max(to->expires, w->now) < w->armed_tick)
+		arm_timerfd(w, max(to->expires, w->now));
+}
+
+void del_timeout(struct timeout *to)
+{
+	if (timeout_pending(to))
+		wheel_del(to->wheel, to);
+}
+
+struct timeout *loop_schedule_timeout(struct event_loop *l, unsigned long ms,
+				      to_handler *toh, void *priv)
+{
+	struct timeout *to;
 
 	if (!toh)
 		/* An handler is mandatory */
@@ -59,80 +316,226 @@ struct timeout *schedule_timeout(unsigned long ms, to_handler *toh,
 		perror("allocating timeout structure");
 		return NULL;
 	}
-	to->expires.tv_sec = ms/1000;
-	to->expires.tv_usec = (ms*1000)%1000000;
-	to->handler = toh;
-	to->priv = priv;
-	to->armed = 1;
-
-	print_timeout("\tInserting ", to);
-
-	if (list_empty(&timeouts)) {
-		print_timeout("List empty, inserted ", to);
-		list_add_tail(&to->list, &timeouts);
-		return to;
-	}
-	list_for_each_entry(ptr, &timeouts, list) {
-		if (ptr->armed)
-			print_timeout("ptr = ", ptr);
-		if(timercmp(&to->expires, &ptr->expires, <)) {
-			struct timeval __tv;
-			timersub(&ptr->expires, &to->expires, &__tv);
-			ptr->expires = __tv;
-			list_add_tail(&to->list, &ptr->list);
-			return to;
-		} else {
-			struct timeval __tv;
-			timersub(&to->expires, &ptr->expires, &__tv);
-			to->expires = __tv;
-		}
-	}
-	list_add_tail(&to->list, &ptr->list);
+	loop_init_timeout(l, to, toh, priv);
+	to->flags = TIMEOUT_F_ALLOCATED;
+	mod_timeout(to, ms);
 	return to;
 }
 
+struct timeout *schedule_timeout(unsigned long ms, to_handler *toh,
+				 void *priv)
+{
+	return loop_schedule_timeout(default_timers_loop(), ms, toh, priv);
+}
+
 void cancel_timeout(struct timeout *to)
 {
-	to->armed = 0;
+	if (!to)
+		return;
+	/* Handler is cancelling its own timeout, it will be freed later */
+	if (to == to->wheel->running)
+		return;
+	del_timeout(to);
+	free(to);
 }
 
-struct timeval *get_next_timeout(void)
+/* Move all the timers in slot @slot of level @level to lower levels */
+static int cascade(struct timer_wheel *w, int level, int slot)
 {
-	struct timeout *to = NULL;
-	if (list_empty(&timeouts))
-		return NULL;
-	to = list_entry(timeouts.next, struct timeout, list);
-	return &to->expires;
+	struct list_head tmp, *h = slot_head(w, level, slot);
+	struct timeout *to;
+
+	INIT_LIST_HEAD(&tmp);
+	list_splice_init(h, &tmp);
+	slot_clear(w, level, slot);
+	while (!list_empty(&tmp)) {
+		to = list_first_entry(&tmp, struct timeout, list);
+		list_del(&to->list);
+		wheel_add(w, to);
+	}
+	return slot;
 }
 
-void handle_timeouts(void)
+#define TVN_INDEX(l) ((w->now >> TV_SHIFT(l)) & TVN_MASK)
+
+/* First non empty tv1 slot in [@from, TVR_SIZE), TVR_SIZE if none */
+static int tv1_next_slot(struct timer_wheel *w, int from)
+{
+	int i = from >> 6;
+	uint64_t m;
+
+	if (from >= TVR_SIZE)
+		return TVR_SIZE;
+	m = w->tv1_map[i] & (~0ULL << (from & 63));
+	while (!m) {
+		if (++i >= ARRAY_SIZE(w->tv1_map))
+			return TVR_SIZE;
+		m = w->tv1_map[i];
+	}
+	return (i << 6) + __builtin_ctzll(m);
+}
+
+static void expire_slot(struct timer_wheel *w, int slot)
 {
-	struct timeout *to, *tmp;
-	struct timeval zerot = { .tv_sec = 0, .tv_usec = 0 };
+	struct list_head work;
+	struct timeout *to;
 	to_handler *h;
-	assert(!list_empty(&timeouts));
 
-	list_for_each_entry_safe(to, tmp, &timeouts, list) {
-		if (!timercmp(&to->expires, &zerot, ==))
-			break;
-		list_del_init(&to->list);
+	INIT_LIST_HEAD(&work);
+	list_splice_init(&w->tv1[slot], &work);
+	slot_clear(w, 0, slot);
+	/* Handlers can cancel timeouts in the work list too */
+	list_for_each_entry(to, &work, list)
+		to->level = TIMEOUT_DETACHED;
+	while (!list_empty(&work)) {
+		to = list_first_entry(&work, struct timeout, list);
+		wheel_del(w, to);
 		h = to->handler;
 		assert(h);
-		if (to->armed)
+		if (!(to->flags & TIMEOUT_F_ALLOCATED)) {
+			/* Handler can re-arm or free embedded timeouts */
 			h(to, to->priv);
+			continue;
+		}
+		w->running = to;
+		h(to, to->priv);
+		w->running = NULL;
 		pr_debug("%s: freeing %p\n", __func__, to);
 		free(to);
-	};
+	}
+}
+
+/* Tick of the next wheel event (expiry or cascade), wheel must not be empty */
+static uint64_t next_event(struct timer_wheel *w)
+{
+	int idx = w->now & TVR_MASK, s, l;
+	uint64_t out, cur, t;
+
+	out = UINT64_MAX;
+	s = tv1_next_slot(w, idx);
+	if (s < TVR_SIZE) {
+		out = w->now + s - idx;
+		/* No cascade can happen before out */
+		if (idx)
+			return out;
+	} else {
+		s = tv1_next_slot(w, 0);
+		if (s < idx)
+			out = w->now + TVR_SIZE + s - idx;
+	}
+	/* Check the first cascade of a non empty slot */
+	for (l = 0; l < TVN_LEVELS; l++) {
+		uint64_t map = w->tvn_map[l];
+		int d;
+
+		if (!map)
+			continue;
+		/*
+		 * First slot to be cascaded: the current one if we're
+		 * exactly on its boundary (not processed yet), the next one
+		 * otherwise
+		 */
+		cur = w->now >> TV_SHIFT(l);
+		if (w->now & ((1ULL << TV_SHIFT(l)) - 1))
+			cur++;
+		/* Rotate so that bit 0 is the first slot to be cascaded */
+		d = cur & TVN_MASK;
+		map = (map >> d) | (d ? map << (TVN_SIZE - d) : 0);
+		t = (cur + __builtin_ctzll(map)) << TV_SHIFT(l);
+		out = min(out, t);
+	}
+	return out;
+}
+
+static void run_timers(struct timer_wheel *w, uint64_t upto)
+{
+	int idx, l;
+
+	while (w->now <= upto) {
+		if (!w->count) {
+			w->now = upto + 1;
+			break;
+		}
+		idx = w->now & TVR_MASK;
+		if (!idx)
+			for (l = 0; l < TVN_LEVELS; l++)
+				if (cascade(w, l + 1, TVN_INDEX(l)))
+					break;
+		w->now++;
+		if (!list_empty(&w->tv1[idx]))
+			expire_slot(w, idx);
+		/* Skip empty slots and cascades of empty slots */
+		if (w->count)
+			w->now = min(next_event(w), upto + 1);
+	}
+}
+
+struct timeval *loop_get_next_timeout(struct event_loop *l)
+{
+	struct timer_wheel *w = l->timers;
+	struct timeval *tv = &w->next_tv;
+	uint64_t now, next;
+
+	if (!w->count)
+		return NULL;
+	now = clock_ms();
+	next = next_event(w);
+	if (next <= now)
+		next = now;
+	tv->tv_sec = (next - now) / 1000;
+	tv->tv_usec = ((next - now) % 1000) * 1000;
+	return tv;
+}
+
+struct timeval *get_next_timeout(void)
+{
+	return loop_get_next_timeout(default_timers_loop());
+}
+
+static void expire_timeouts(struct timer_wheel *w)
+{
+	w->expiring = 1;
+	run_timers(w, w->now_ms);
+	w->expiring = 0;
+	arm_timerfd(w, w->count ? next_event(w) : UINT64_MAX);
+}
+
+static void timerfd_cb(void *_w)
+{
+	struct timer_wheel *w = _w;
+	uint64_t expirations;
+
+	if (read(w->tfd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		pr_err("%s: read: %s\n", __func__, strerror(errno));
+	/* One shot timer, not armed any more */
+	w->armed_tick = UINT64_MAX;
+	expire_timeouts(w);
+}
+
+void loop_handle_timeouts(struct event_loop *l)
+{
+	loop_timeouts_update_clock(l);
+	expire_timeouts(l->timers);
+}
+
+void handle_timeouts(void)
+{
+	loop_handle_timeouts(default_timers_loop());
 }
 
 #ifdef DEBUG
 void print_timeouts(FILE *f)
 {
+	struct timer_wheel *w = default_timers_loop()->timers;
 	struct timeout *ptr;
+	int l, s;
+
 	fprintf(f, "List of scheduled timeouts\n");
-	list_for_each_entry(ptr, &timeouts, list)
-		fprintf(f, "\to %p, expires %lu.%06u\n", ptr,
-			(unsigned long)ptr->expires.tv_sec,
-			(unsigned int)ptr->expires.tv_usec);
+	for (l = 0; l <= TVN_LEVELS; l++)
+		for (s = 0; s < (l ? TVN_SIZE : TVR_SIZE); s++)
+			list_for_each_entry(ptr, slot_head(w, l, s), list)
+				fprintf(f, "\to %p, expires %llu\n", ptr,
+					(unsigned long long)ptr->expires);
 }
 #endif /* DEBUG */
@@ -7,6 +7,7 @@
 #include "list.h"
 #include "logger.h"
 #include "fd_event.h"
+#include "fd_event-internal.h"
 #include "udev-events.h"
 
 struct udev_event {
@@ -16,8 +17,6 @@ struct udev_event {
 	struct list_head list;
 };
 
-static struct list_head udev_events;
-
 struct udev_action {
 	const char *a;
 	enum udev_event_id id;
@@ -51,7 +50,8 @@ static int _action_to_id(const char *action, enum udev_event_id *out)
 
 static void do_udev_event(void *arg)
 {
-	struct udev_monitor *mon = arg;
+	struct event_loop *l = arg;
+	struct udev_monitor *mon = l->udev_mon;
 	struct udev_device *dev;
 	const char *action, *path;
 	enum udev_event_id id;
@@ -71,7 +71,7 @@ static void do_udev_event(void *arg)
 	pr_info("   Subsystem: %s\n", udev_device_get_subsystem(dev));
 	pr_info("   Devtype: %s\n", udev_device_get_devtype(dev));	
 	pr_info("   Action: %s\n", action);
-	list_for_each_entry_safe(ptr, tmp, &udev_events, list) {
+	list_for_each_entry_safe(ptr, tmp, &l->udev_events, list) {
 		if (ptr->id == id) {
 			ptr->cb(dev, path, ptr->cb_data);
 			//list_del(&ptr->list);
@@ -84,7 +84,8 @@ static void do_udev_event(void *arg)
 #define SUBSYS "r2proc-backend-devs"
 #define DEVTYP "*"
 
-int udev_events_init(void)
+/* Each loop has its own udev monitor */
+int loop_udev_events_init(struct event_loop *l)
 {
 	struct udev *udev;
 	struct udev_monitor *mon;
@@ -99,12 +100,18 @@ int udev_events_init(void)
 	udev_monitor_filter_add_match_subsystem_devtype(mon, SUBSYS, NULL);
 	udev_monitor_enable_receiving(mon);
 	fd = udev_monitor_get_fd(mon);
-	add_fd_event(fd, EVT_FD_RD, do_udev_event, mon);
-	INIT_LIST_HEAD(&udev_events);
+	l->udev_mon = mon;
+	loop_add_fd_event(l, fd, EVT_FD_RD, do_udev_event, l);
 	return 0;
 }
 
-int schedule_udev_event(enum udev_event_id id, uevent_cb cb, void *cb_data)
+int udev_events_init(void)
+{
+	return loop_udev_events_init(event_loop_get_default());
+}
+
+int loop_schedule_udev_event(struct event_loop *l, enum udev_event_id id,
+			     uevent_cb cb, void *cb_data)
 {
 	struct udev_event *evt = malloc(sizeof(*evt));
 
@@ -115,6 +122,29 @@ int schedule_udev_event(enum udev_event_id id, uevent_cb cb, void *cb_data)
 	evt->id = id;
 	evt->cb = cb;
 	evt->cb_data = cb_data;
-	list_add_tail(&evt->list, &udev_events);
+	list_add_tail(&evt->list, &l->udev_events);
 	return 0;
 }
+
+int schedule_udev_event(enum udev_event_id id, uevent_cb cb, void *cb_data)
+{
+	return loop_schedule_udev_event(event_loop_get_default(), id, cb,
+					cb_data);
+}
+
+void loop_cancel_udev_events(struct event_loop *l, void *cb_data)
+{
+	struct udev_event *ptr, *tmp;
+
+	list_for_each_entry_safe(ptr, tmp, &l->udev_events, list) {
+		if (ptr->cb_data == cb_data) {
+			list_del(&ptr->list);
+			free(ptr);
+		}
+	}
+}
+
+void cancel_udev_events(void *cb_data)
+{
+	loop_cancel_udev_events(event_loop_get_default(), cb_data);
+}
@@ -22,35 +22,405 @@
 #include "timeout.h"
 #include "udev-events.h"
 #include "logger.h"
+#include "common.h"
 #include "virtqueue.h"
 #include "virtio.h"
 
 #include "remoteproc.h"
 
+/* Geometry of the vrings set up by the lininoio handlers */
+#define VIRTIO_DEF_VRING_NUM 4
+#define VIRTIO_DEF_VRING_ALIGN 16
+
+int virtio_vring_init(struct virtio_vring *vr, int fd, void *mem,
+		      size_t size, unsigned long phys,
+		      const struct vring_alloc_info *ring, uint32_t features)
+{
+	struct vring_alloc_info info = *ring;
+	int stat;
+
+	memset(vr, 0, sizeof(*vr));
+	vr->fd = fd;
+	INIT_LIST_HEAD(&vr->pending);
+	INIT_LIST_HEAD(&vr->backlog);
+	vr->phys = phys;
+	/* A single contiguous page: physical = phys + offset */
+	vr->io.virt = mem;
+	vr->io.physmap = &vr->phys;
+	vr->io.size = size;
+	vr->io.page_shift = sizeof(metal_phys_addr_t) * 8 - 1;
+	vr->io.page_mask = (metal_phys_addr_t)-1;
+	if (vring_size(info.num_descs, info.align) > size) {
+		pr_err("%s: vring does not fit %zu bytes\n", __func__, size);
+		return -1;
+	}
+	info.vaddr = mem;
+	stat = virtqueue_attach(NULL, 0, "vring", &info, NULL, NULL, &vr->io,
+				&vr->vq);
+	if (stat != VQUEUE_SUCCESS) {
+		pr_err("%s: error %d attaching vring\n", __func__, stat);
+		return -1;
+	}
+	if (features & VIRTIO_RING_F_EVENT_IDX)
+		vr->vq->vq_flags |= VIRTQUEUE_FLAG_EVENT_IDX;
+	if (features & VIRTIO_RING_F_INDIRECT_DESC)
+		vr->vq->vq_flags |= VIRTQUEUE_FLAG_INDIRECT;
+	/* Direct descriptors before an indirect table, then the table */
+	vr->iov = malloc((info.num_descs + VIRTIO_VRING_MAX_INDIRECT) *
+			 sizeof(*vr->iov));
+	vr->used = malloc(info.num_descs * sizeof(*vr->used));
+	vr->heads = malloc(info.num_descs * sizeof(*vr->heads));
+	if (!vr->iov || !vr->used || !vr->heads) {
+		pr_err("%s: malloc(): %s\n", __func__, strerror(errno));
+		virtio_vring_release(vr);
+		return -1;
+	}
+	virtqueue_enable_notify(vr->vq, VQ_POSTPONE_SHORT);
+	return 0;
+}
+
+static void vring_complete(struct virtio_vring *vr);
+
+void virtio_vring_release(struct virtio_vring *vr)
+{
+	struct virtio_rx_pkt *p, *tmp;
+
+	/* Never attached */
+	if (!vr->vq)
+		return;
+	vring_complete(vr);
+	list_for_each_entry_safe(p, tmp, &vr->backlog, list) {
+		list_del(&p->list);
+		free(p);
+	}
+	vr->backlog_len = 0;
+	virtqueue_free(vr->vq);
+	free(vr->iov);
+	free(vr->used);
+	free(vr->heads);
+	vr->vq = NULL;
+	vr->iov = NULL;
+	vr->used = NULL;
+	vr->heads = NULL;
+}
+
+void virtio_vring_ack(struct virtio_vring *vr)
+{
+	uint64_t v;
+
+	if (read(vr->fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		pr_err("%s: read(): %s\n", __func__, strerror(errno));
+}
+
+static void virtio_vring_notify(struct virtio_vring *vr)
+{
+	uint64_t v = 1;
+
+	vr->interrupts++;
+	if (write(vr->fd, &v, sizeof(v)) < 0)
+		pr_err("%s: write(): %s\n", __func__, strerror(errno));
+}
+
+/*
+ * Readable (@write == 0) or writable (@write == VRING_DESC_F_WRITE) pieces
+ * of the chain starting at @head, in vr->iov. A descriptor can point to an
+ * indirect table of up to VIRTIO_VRING_MAX_INDIRECT descriptors, which ends
+ * the chain. Descriptors are copied before being checked, the other side
+ * could change them.
+ * Returns the number of pieces, -1 if the chain is invalid
+ */
+static int vring_chain_iov(struct virtio_vring *vr, uint16_t head, int write)
+{
+	struct virtqueue *vq = vr->vq;
+	struct vring_desc *table = vq->vq_ring.desc, d;
+	unsigned long offset;
+	uint16_t idx = head;
+	int i, num = vq->vq_nentries, n = 0, indirect = 0;
+
+	for (i = 0; i < num; i++) {
+		if (idx >= num)
+			return -1;
+		memcpy(&d, &table[idx], sizeof(d));
+		if (d.flags & VRING_DESC_F_INDIRECT) {
+			/* Negotiated, one level, no descriptors after it */
+			if (!(vq->vq_flags & VIRTQUEUE_FLAG_INDIRECT) ||
+			    indirect || (d.flags & VRING_DESC_F_NEXT) ||
+			    !d.len || d.len % sizeof(d) ||
+			    d.len > VIRTIO_VRING_MAX_INDIRECT * sizeof(d))
+				return -1;
+			offset = metal_io_phys_to_offset(&vr->io, d.addr);
+			if (offset == METAL_BAD_OFFSET ||
+			    d.len > vr->io.size - offset)
+				return -1;
+			table = metal_io_virt(&vr->io, offset);
+			num = d.len / sizeof(d);
+			idx = 0;
+			i = -1;
+			indirect = 1;
+			continue;
+		}
+		if ((d.flags & VRING_DESC_F_WRITE) == write && d.len) {
+			offset = metal_io_phys_to_offset(&vr->io, d.addr);
+			if (offset == METAL_BAD_OFFSET ||
+			    d.len > vr->io.size - offset)
+				return -1;
+			vr->iov[n].iov_base = metal_io_virt(&vr->io, offset);
+			vr->iov[n++].iov_len = d.len;
+		}
+		if (!(d.flags & VRING_DESC_F_NEXT))
+			return n;
+		idx = d.next;
+	}
+	/* Loop in the chain */
+	return -1;
+}
+
+/*
+ * Return the chains consumed so far with a single used ring update, and
+ * interrupt the other side
+ */
+static void vring_complete(struct virtio_vring *vr)
+{
+	uint16_t old_idx = vr->vq->vq_ring.used->idx;
+
+	if (!vr->nused)
+		return;
+	virtqueue_add_consumed_buffers(vr->vq, vr->used, vr->nused);
+	vr->nused = 0;
+	if (!list_empty(&vr->pending))
+		list_del_init(&vr->pending);
+	/* Maybe the other side asked for an interrupt later on */
+	if (virtqueue_need_interrupt(vr->vq, old_idx))
+		virtio_vring_notify(vr);
+	else
+		vr->interrupts_avoided++;
+}
+
+/* Chains consumed in this loop iteration, completed at its end */
+static __thread struct list_head vring_pending;
+static __thread int vring_pending_init;
+
+static void vring_complete_pending(void *unused)
+{
+	struct virtio_vring *vr, *tmp;
+
+	list_for_each_entry_safe(vr, tmp, &vring_pending, pending)
+		vring_complete(vr);
+}
+
+/* Chain @head consumed, @len bytes written to it */
+static void vring_used(struct virtio_vring *vr, uint16_t head, uint32_t len)
+{
+	/* A bad head can't be returned */
+	if (head >= vr->vq->vq_nentries)
+		return;
+	vr->used[vr->nused].id = head;
+	vr->used[vr->nused].len = len;
+	if (++vr->nused == vr->vq->vq_nentries)
+		vring_complete(vr);
+}
+
+/* Get the next available chain, VQ_RING_DESC_CHAIN_END if none */
+static uint16_t vring_next_chain(struct virtio_vring *vr)
+{
+	uint16_t head = VQ_RING_DESC_CHAIN_END;
+	uint32_t len;
+
+	/* NULL is also returned for a bad head buffer address */
+	virtqueue_get_available_buffer(vr->vq, &head, &len);
+	return head;
+}
+
+int virtio_vring_drain(struct virtio_vring *vr, virtio_chain_handler *h,
+		       void *priv)
+{
+	int ret = 0, niov, i, n;
+
+	vr->stalled = 0;
+	do {
+		/* No kicks while draining */
+		virtqueue_disable_notify(vr->vq);
+		while ((n = virtqueue_get_available_buffers(vr->vq, vr->heads,
+						vr->vq->vq_nentries))) {
+			for (i = 0; i < n; i++) {
+				niov = vring_chain_iov(vr, vr->heads[i], 0);
+				if (niov < 0) {
+					vr->dropped++;
+				} else if (h(priv, vr->iov, niov) < 0) {
+					/*
+					 * No room for now: leave this chain
+					 * and the next ones available
+					 */
+					if (errno == EAGAIN) {
+						vr->vq->vq_available_idx -=
+							n - i;
+						vr->stalled = 1;
+						break;
+					}
+					vr->dropped++;
+				}
+				/* Nothing written to the buffers */
+				vring_used(vr, vr->heads[i], 0);
+			}
+			ret += i;
+			if (vr->stalled)
+				break;
+		}
+		vring_complete(vr);
+		if (vr->stalled) {
+			/* A kick retries too, if the owner doesn't first */
+			virtqueue_enable_notify(vr->vq, vr->postpone);
+			break;
+		}
+		/* Chains may have come before kicks were enabled again */
+	} while (virtqueue_enable_notify(vr->vq, vr->postpone));
+	return ret;
+}
+
+/*
+ * Copy @len bytes at @buf to the next chain posted by the other side.
+ * Returns 0 if there is none
+ */
+static int vring_rx_chain(struct virtio_vring *vr, const void *buf,
+			  size_t len)
+{
+	uint16_t head = vring_next_chain(vr);
+	size_t done = 0, l;
+	int niov, i;
+
+	if (head == VQ_RING_DESC_CHAIN_END)
+		return 0;
+	niov = vring_chain_iov(vr, head, VRING_DESC_F_WRITE);
+	for (i = 0; i < niov && done < len; i++) {
+		l = min(vr->iov[i].iov_len, len - done);
+		memcpy(vr->iov[i].iov_base, buf + done, l);
+		done += l;
+	}
+	if (done < len) {
+		pr_debug("%s: %zu bytes don't fit chain %u\n", __func__, len,
+			 head);
+		vr->rx_dropped++;
+		done = 0;
+	}
+	vring_used(vr, head, done);
+	return 1;
+}
+
+int virtio_vring_rx(struct virtio_vring *vr, const void *buf, size_t len)
+{
+	struct virtio_rx_pkt *p;
+
+	/* Keep the order, the backlog goes first */
+	if (list_empty(&vr->backlog) && vring_rx_chain(vr, buf, len)) {
+		if (!vr->nused || !list_empty(&vr->pending))
+			return 0;
+		if (!vring_pending_init) {
+			INIT_LIST_HEAD(&vring_pending);
+			if (fd_events_add_post_cb(vring_complete_pending,
+						  NULL) < 0) {
+				vring_complete(vr);
+				return 0;
+			}
+			vring_pending_init = 1;
+		}
+		list_add_tail(&vr->pending, &vring_pending);
+		return 0;
+	}
+	if (vr->backlog_len + len > VIRTIO_VRING_BACKLOG) {
+		vr->rx_dropped++;
+		errno = ENOBUFS;
+		return -1;
+	}
+	p = malloc(sizeof(*p) + len);
+	if (!p) {
+		vr->rx_dropped++;
+		return -1;
+	}
+	p->len = len;
+	memcpy(p->data, buf, len);
+	list_add_tail(&p->list, &vr->backlog);
+	vr->backlog_len += len;
+	vr->rx_backlogged++;
+	/* Now we need a kick as soon as a buffer is posted */
+	if (vr->backlog_len == len &&
+	    virtqueue_enable_notify(vr->vq, VQ_POSTPONE_SHORT))
+		virtio_vring_rx_kick(vr);
+	return 0;
+}
+
+int virtio_vring_rx_kick(struct virtio_vring *vr)
+{
+	struct virtio_rx_pkt *p, *tmp;
+	int ret = 0;
+
+	for (;;) {
+		list_for_each_entry_safe(p, tmp, &vr->backlog, list) {
+			if (!vring_rx_chain(vr, p->data, p->len))
+				break;
+			list_del(&p->list);
+			vr->backlog_len -= p->len;
+			free(p);
+			ret++;
+		}
+		vring_complete(vr);
+		/*
+		 * Buffers are taken when data comes, kicks are only needed
+		 * when there's a backlog
+		 */
+		if (list_empty(&vr->backlog)) {
+			virtqueue_enable_notify(vr->vq, VQ_POSTPONE_EMPTIED);
+			return ret;
+		}
+		if (!virtqueue_enable_notify(vr->vq, VQ_POSTPONE_SHORT))
+			return ret;
+	}
+}
+
+/* No handler: just log what the other side sends */
+static int virtio_backend_log_chain(void *_vbe, const struct iovec *iov,
+				    int iovcnt)
+{
+	struct virtio_backend *vbe = _vbe;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		pr_debug("%s: %zu bytes at %p\n", vbe->devname,
+			 iov[i].iov_len, iov[i].iov_base);
+	return 0;
+}
+
 static void virtio_backend_readable(void *_vbe)
 {
 	struct virtio_backend *vbe = _vbe;
-	struct vring_desc *desc = vbe->vring_ptr;
-	unsigned long offset;
-	char *ptr;
 
 	pr_debug("%s is readable\n", vbe->devname);
-	pr_debug("%s: %s, vring[0] = 0x%08x\n",
-		 __func__, vbe->devname, ((unsigned int *)vbe->vring_ptr)[0]);
-	pr_debug("%s: %s, addr = 0x%" PRIx64 ", len = %lu, flags = 0x%04x, next = 0x%04x\n", __func__, vbe->devname, desc->addr, (unsigned long)desc->len,
-		 desc->flags, desc->next);
-	/*
-	 * desc->addr contains a phy address, get the offset from the
-	 * beginning of the r2proc reserved memory (mmap is done starting from
-	 * there);
-	 */
-	offset = desc->addr - vbe->phy_offset;
-	ptr = vbe->vring_ptr + offset;
-	pr_debug("read --- %s\n", ptr);
-}
-
-static int _create_virtqueue(struct virtio_backend *vbe)
+	virtio_vring_ack(&vbe->vr);
+	if (vbe->rx)
+		virtio_vring_rx_kick(&vbe->vr);
+	else
+		virtio_vring_drain(&vbe->vr, vbe->handler, vbe->handler_priv);
+}
+
+static int _create_virtqueue(struct virtio_backend *vbe,
+			     const struct virtio_backend_cfg *cfg)
 {
+	struct vring_alloc_info ring = {
+		.num_descs = cfg ? cfg->num : VIRTIO_DEF_VRING_NUM,
+		.align = cfg ? cfg->align : VIRTIO_DEF_VRING_ALIGN,
+	};
+
+	vbe->rx = cfg ? cfg->rx : 0;
+	vbe->handler = virtio_backend_log_chain;
+	vbe->handler_priv = vbe;
+	if (cfg && cfg->handler) {
+		vbe->handler = cfg->handler;
+		vbe->handler_priv = cfg->priv;
+	}
+	if (virtio_vring_init(&vbe->vr, vbe->fd, vbe->vring_ptr,
+			      vbe->phy_len, vbe->phy_offset, &ring,
+			      cfg ? cfg->features : 0) < 0)
+		return -1;
+	vbe->vr.postpone = cfg ? cfg->postpone : VQ_POSTPONE_SHORT;
 	return 0;
 }
 
@@ -73,12 +443,14 @@ void virtio_backend_add(struct udev_device *dev, const char *path, void *priv)
 	offs = udev_device_get_sysattr_value(dev, "phy_offset");
 	if (!offs) {
 		pr_err("%s: could not find phy_offset attribute\n", __func__);
+		free(vbe);
 		return;
 	}
 	vbe->phy_offset = strtoul(offs, NULL, 16);
 	size = udev_device_get_sysattr_value(dev, "phy_len");
 	if (!size) {
 		pr_err("%s: could not find phy_len attribute\n", __func__);
+		free(vbe);
 		return;
 	}
 	vbe->phy_len = strtoul(size, NULL, 16);
@@ -88,28 +460,37 @@ void virtio_backend_add(struct udev_device *dev, const char *path, void *priv)
 	fd = open(vbe->devname, O_RDWR);
 	if (fd < 0) {
 		perror("open");
+		free(vbe);
 		return;
 	}
 	vbe->fd = fd;
-	vbe->evt = add_fd_event(vbe->fd, EVT_FD_RD, virtio_backend_readable,
-				vbe);
-	if (!vbe->evt) {
-		pr_err("%s: error adding virtio backend event\n", __func__);
+	/* The used ring is written */
+	vbe->vring_ptr = mmap(NULL, vbe->phy_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fd, 0);
+	if (vbe->vring_ptr == MAP_FAILED) {
+		perror("mmap");
 		close(fd);
 		free(vbe);
 		return;
 	}
-	
-	vbe->vring_ptr = mmap(NULL, vbe->phy_len, PROT_READ, MAP_SHARED, fd, 0);
-	if (vbe->vring_ptr == MAP_FAILED)
-		perror("mmap");
 	pr_info("%s: mapped vring (%s) to %p\n", __func__, vbe->devname,
 		vbe->vring_ptr);
 
-	if (_create_virtqueue(vbe) < 0){
+	if (_create_virtqueue(vbe, priv) < 0){
 		pr_err("%s: error creating virtqueue\n", __func__);
 		munmap(vbe->vring_ptr, vbe->phy_len);
 		close(fd);
 		free(vbe);
+		return;
+	}
+	vbe->evt = add_fd_event(vbe->fd, EVT_FD_RD, virtio_backend_readable,
+				vbe);
+	if (!vbe->evt) {
+		pr_err("%s: error adding virtio backend event\n", __func__);
+		virtio_vring_release(&vbe->vr);
+		munmap(vbe->vring_ptr, vbe->phy_len);
+		close(fd);
+		free(vbe);
+		return;
 	}
 }
@@ -32,6 +32,9 @@ static void vq_ring_init(struct virtqueue *);
 static void vq_ring_update_avail(struct virtqueue *, uint16_t);
 static uint16_t vq_ring_add_buffer(struct virtqueue *, struct vring_desc *,
 				   uint16_t, struct metal_sg *, int, int);
+static int vq_ring_use_indirect(struct virtqueue *, int);
+static void vq_ring_add_indirect(struct virtqueue *, uint16_t,
+				 struct metal_sg *, int, int);
 static int vq_ring_enable_interrupt(struct virtqueue *, uint16_t);
 static void vq_ring_free_chain(struct virtqueue *, uint16_t);
 static int vq_ring_must_notify_host(struct virtqueue *vq);
@@ -54,11 +57,11 @@ static int virtqueue_nused(struct virtqueue *vq);
  *
  * @return          - Function status
  */
-int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
+static int vq_create(struct virtio_device *virt_dev, unsigned short id,
 		     char *name, struct vring_alloc_info *ring,
 		     void (*callback) (struct virtqueue * vq),
 		     void (*notify) (struct virtqueue * vq),
-		     struct metal_io_region *shm_io,
+		     struct metal_io_region *shm_io, uint32_t flags,
 		     struct virtqueue **v_queue)
 {
 
@@ -71,8 +74,6 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 	VQ_PARAM_CHK(ring->num_descs & (ring->num_descs - 1), status,
 		     ERROR_VRING_ALIGN);
 
-	//TODO : Error check for indirect buffer addition
-
 	if (status == VQUEUE_SUCCESS) {
 
 		vq_size = sizeof(struct virtqueue)
@@ -86,6 +87,7 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 		memset(vq, 0x00, vq_size);
 
 		vq->vq_dev = virt_dev;
+		vq->vq_flags = flags;
 		strncpy(vq->vq_name, name, VIRTQUEUE_MAX_NAME_SZ);
 		vq->vq_queue_index = id;
 		vq->vq_alignment = ring->align;
@@ -95,7 +97,7 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 		vq->notify = notify;
 		vq->shm_io = shm_io;
 
-		//TODO : Whether we want to support indirect addition or not.
+		/* Indirect tables, if any, see virtqueue_init_indirect() */
 		vq->vq_ring_size = vring_size(ring->num_descs, ring->align);
 		vq->vq_ring_mem = (void *)ring->vaddr;
 
@@ -103,19 +105,99 @@ int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
 		vq_ring_init(vq);
 
 		/* Disable callbacks - will be enabled by the application
-		 * once initialization is completed.
+		 * once initialization is completed. The avail ring belongs
+		 * to the other side on the device side.
 		 */
-		virtqueue_disable_cb(vq);
+		if (!(flags & VIRTQUEUE_FLAG_DEVICE))
+			virtqueue_disable_cb(vq);
 
 		*v_queue = vq;
 
-		//TODO : Need to add cleanup in case of error used with the indirect buffer addition
 		//TODO: do we need to save the new queue in db based on its id
 	}
 
 	return (status);
 }
 
+int virtqueue_create(struct virtio_device *virt_dev, unsigned short id,
+		     char *name, struct vring_alloc_info *ring,
+		     void (*callback) (struct virtqueue * vq),
+		     void (*notify) (struct virtqueue * vq),
+		     struct metal_io_region *shm_io,
+		     struct virtqueue **v_queue)
+{
+	return vq_create(virt_dev, id, name, ring, callback, notify, shm_io,
+			 0, v_queue);
+}
+
+/**
+ * virtqueue_attach - Attaches to a VirtIO queue set up by the other side
+ *
+ * The device (consumer) side of virtqueue_create(): the ring is used as
+ * it is, descriptors and avail ring are never written. Only the consumer
+ * API (virtqueue_get_available_buffer(), virtqueue_add_consumed_buffer*())
+ * can be used on the returned queue.
+ *
+ * Parameters are the same as virtqueue_create()'s
+ *
+ * @return          - Function status
+ */
+int virtqueue_attach(struct virtio_device *virt_dev, unsigned short id,
+		     char *name, struct vring_alloc_info *ring,
+		     void (*callback) (struct virtqueue * vq),
+		     void (*notify) (struct virtqueue * vq),
+		     struct metal_io_region *shm_io,
+		     struct virtqueue **v_queue)
+{
+	return vq_create(virt_dev, id, name, ring, callback, notify, shm_io,
+			 VIRTQUEUE_FLAG_DEVICE, v_queue);
+}
+
+/**
+ * virtqueue_init_indirect - Sets up the indirect descriptor tables of a
+ *                           VirtIO queue (VIRTIO_RING_F_INDIRECT_DESC).
+ *                           Each descriptor of the ring gets a table:
+ *                           buffers of 2 to max_indirect pieces then take
+ *                           a single ring descriptor
+ *
+ * @param vq                - Pointer to VirtIO queue control block
+ * @param mem               - Tables, in the shared memory I/O region, at
+ *                            least vring_indirect_size(vq_nentries,
+ *                            max_indirect) bytes. Owned by the caller
+ * @param max_indirect      - Max number of pieces in a table
+ *
+ * @return                  - Function status
+ */
+int virtqueue_init_indirect(struct virtqueue *vq, void *mem, int max_indirect)
+{
+	struct vq_desc_extra *dxp;
+	metal_phys_addr_t paddr;
+	int i, size;
+
+	if (vq == VQ_NULL || mem == VQ_NULL || max_indirect < 2 ||
+	    (vq->vq_flags & VIRTQUEUE_FLAG_DEVICE))
+		return (ERROR_VQUEUE_INVLD_PARAM);
+
+	size = max_indirect * sizeof(struct vring_desc);
+	/* The whole pool must be visible to the other side */
+	paddr = metal_io_virt_to_phys(vq->shm_io, mem);
+	if (paddr == METAL_BAD_PHYS ||
+	    metal_io_virt_to_phys(vq->shm_io, (uint8_t *)mem +
+				  vq->vq_nentries * size - 1) == METAL_BAD_PHYS)
+		return (ERROR_VQUEUE_INVLD_PARAM);
+
+	for (i = 0; i < vq->vq_nentries; i++) {
+		dxp = &vq->vq_descx[i];
+		dxp->indirect = (struct vring_desc *)((uint8_t *)mem + i * size);
+		dxp->indirect_paddr = paddr + i * size;
+	}
+	vq->vq_max_indirect_size = max_indirect;
+	vq->vq_indirect_mem_size = size;
+	vq->vq_flags |= VIRTQUEUE_FLAG_INDIRECT;
+
+	return (VQUEUE_SUCCESS);
+}
+
 /**
  * virtqueue_add_buffer()   - Enqueues new buffer in vring for consumption
  *                            by other side. Readable buffers are always
@@ -143,16 +225,15 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct metal_sg *sg,
 
 	VQ_PARAM_CHK(vq == VQ_NULL, status, ERROR_VQUEUE_INVLD_PARAM);
 	VQ_PARAM_CHK(needed < 1, status, ERROR_VQUEUE_INVLD_PARAM);
-	VQ_PARAM_CHK(vq->vq_free_cnt == 0, status, ERROR_VRING_FULL);
 
-	//TODO: Add parameters validation for indirect buffer addition
+	/* Not a debug check, a long chain would run off the free list */
+	if (vq->vq_free_cnt < (vq_ring_use_indirect(vq, needed) ? 1 : needed))
+		return (ERROR_VRING_FULL);
 
 	VQUEUE_BUSY(vq);
 
 	if (status == VQUEUE_SUCCESS) {
 
-		//TODO : Indirect buffer addition support
-
 		VQASSERT(vq, cookie != VQ_NULL, "enqueuing with no cookie");
 
 		head_idx = vq->vq_desc_head_idx;
@@ -163,11 +244,19 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct metal_sg *sg,
 			 "cookie already exists for index");
 
 		dxp->cookie = cookie;
-		dxp->ndescs = needed;
 
 		/* Enqueue buffer onto the ring. */
-		idx = vq_ring_add_buffer(vq, vq->vq_ring.desc, head_idx, sg,
-					 readable, writable);
+		if (vq_ring_use_indirect(vq, needed)) {
+			vq_ring_add_indirect(vq, head_idx, sg, readable,
+					     writable);
+			needed = 1;
+			idx = vq->vq_ring.desc[head_idx].next;
+		} else {
+			idx = vq_ring_add_buffer(vq, vq->vq_ring.desc,
+						 head_idx, sg, readable,
+						 writable);
+		}
+		dxp->ndescs = needed;
 
 		vq->vq_desc_head_idx = idx;
 		vq->vq_free_cnt -= needed;
@@ -190,6 +279,87 @@ int virtqueue_add_buffer(struct virtqueue *vq, struct metal_sg *sg,
 	return (status);
 }
 
+/**
+ * virtqueue_add_buffers()  - Enqueues a batch of buffers in vring for
+ *                            consumption by other side, publishing
+ *                            avail->idx once. A single virtqueue_kick()
+ *                            then decides whether to notify for the
+ *                            whole batch
+ *
+ * @param vq                - Pointer to VirtIO queue control block.
+ * @param sg                - Pointer to buffer scatter/gather list, the
+ *                            pieces of all the buffers one after the other
+ * @param readable          - Number of readable pieces of each buffer
+ * @param writable          - Number of writable pieces of each buffer
+ * @param cookies           - Call back data of each buffer
+ * @param n                 - Number of buffers
+ *
+ * @return                  - Function status, nothing is enqueued on error
+ */
+int virtqueue_add_buffers(struct virtqueue *vq, struct metal_sg *sg,
+			  const int *readable, const int *writable,
+			  void **cookies, int n)
+{
+	struct vq_desc_extra *dxp;
+	uint16_t head_idx, avail_idx;
+	int i, needed, total = 0;
+
+	if (vq == VQ_NULL || n < 1)
+		return (ERROR_VQUEUE_INVLD_PARAM);
+
+	for (i = 0; i < n; i++) {
+		needed = readable[i] + writable[i];
+		if (needed < 1)
+			return (ERROR_VQUEUE_INVLD_PARAM);
+		total += vq_ring_use_indirect(vq, needed) ? 1 : needed;
+	}
+	if (total > vq->vq_free_cnt)
+		return (ERROR_VRING_FULL);
+
+	VQUEUE_BUSY(vq);
+
+	avail_idx = vq->vq_ring.avail->idx;
+	for (i = 0; i < n; i++, avail_idx++) {
+		needed = readable[i] + writable[i];
+
+		head_idx = vq->vq_desc_head_idx;
+		VQ_RING_ASSERT_VALID_IDX(vq, head_idx);
+		dxp = &vq->vq_descx[head_idx];
+
+		VQASSERT(vq, (dxp->cookie == VQ_NULL),
+			 "cookie already exists for index");
+
+		dxp->cookie = cookies[i];
+
+		if (vq_ring_use_indirect(vq, needed)) {
+			vq_ring_add_indirect(vq, head_idx, sg, readable[i],
+					     writable[i]);
+			dxp->ndescs = 1;
+			vq->vq_desc_head_idx = vq->vq_ring.desc[head_idx].next;
+		} else {
+			dxp->ndescs = needed;
+			vq->vq_desc_head_idx =
+			    vq_ring_add_buffer(vq, vq->vq_ring.desc, head_idx,
+					       sg, readable[i], writable[i]);
+		}
+		vq->vq_free_cnt -= dxp->ndescs;
+		sg += needed;
+
+		vq->vq_ring.avail->ring[avail_idx & (vq->vq_nentries - 1)] =
+		    head_idx;
+	}
+
+	/* Descriptors and ring entries before the index */
+	atomic_thread_fence(memory_order_release);
+
+	vq->vq_ring.avail->idx = avail_idx;
+	vq->vq_queued_cnt += n;
+
+	VQUEUE_IDLE(vq);
+
+	return (VQUEUE_SUCCESS);
+}
+
 /**
  * virtqueue_add_single_buffer - Enqueues single buffer in vring
  *
@@ -298,6 +468,55 @@ void *virtqueue_get_buffer(struct virtqueue *vq, uint32_t * len, uint16_t * idx)
 	return (cookie);
 }
 
+/**
+ * virtqueue_get_buffers - Returns a batch of used buffers from VirtIO
+ *                         queue, reading used->idx once
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ * @param cookies       - Pointers to the used buffers
+ * @param len           - Length of each consumed buffer, can be NULL
+ * @param max           - Max number of buffers returned
+ *
+ * @return              - Number of buffers returned
+ */
+int virtqueue_get_buffers(struct virtqueue *vq, void **cookies,
+			  uint32_t *len, int max)
+{
+	struct vring_used_elem *uep;
+	uint16_t used_idx, desc_idx;
+	int i, n;
+
+	if (vq == VQ_NULL)
+		return 0;
+
+	VQUEUE_BUSY(vq);
+
+	n = (uint16_t)(vq->vq_ring.used->idx - vq->vq_used_cons_idx);
+	if (n > max)
+		n = max;
+
+	/* Used ring entries after the index */
+	atomic_thread_fence(memory_order_acquire);
+
+	for (i = 0; i < n; i++) {
+		used_idx = vq->vq_used_cons_idx++ & (vq->vq_nentries - 1);
+		uep = &vq->vq_ring.used->ring[used_idx];
+
+		desc_idx = (uint16_t) uep->id;
+		if (len != VQ_NULL)
+			len[i] = uep->len;
+
+		vq_ring_free_chain(vq, desc_idx);
+
+		cookies[i] = vq->vq_descx[desc_idx].cookie;
+		vq->vq_descx[desc_idx].cookie = VQ_NULL;
+	}
+
+	VQUEUE_IDLE(vq);
+
+	return n;
+}
+
 uint32_t virtqueue_get_buffer_length(struct virtqueue *vq, uint16_t idx)
 {
 	return vq->vq_ring.desc[idx].len;
@@ -319,7 +538,7 @@ void virtqueue_free(struct virtqueue *vq)
 			    ("\r\nWARNING %s: freeing non-empty virtqueue\r\n",
 			     vq->vq_name);
 		}
-		//TODO : Need to free indirect buffers here
+		/* Indirect tables belong to the caller's shared memory */
 
 		if (vq->vq_ring_mem != VQ_NULL) {
 			vq->vq_ring_size = 0;
@@ -354,10 +573,20 @@ void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t * avail_idx,
 	VQUEUE_BUSY(vq);
 
 	head_idx = vq->vq_available_idx++ & (vq->vq_nentries - 1);
+
+	/* Read the ring entry after avail->idx */
+	atomic_thread_fence(memory_order_acquire);
+
 	*avail_idx = vq->vq_ring.avail->ring[head_idx];
 
 	atomic_thread_fence(memory_order_seq_cst);
 
+	/* The other side owns the ring, don't trust it */
+	if (*avail_idx >= vq->vq_nentries) {
+		VQUEUE_IDLE(vq);
+		return (VQ_NULL);
+	}
+
 	buffer = metal_io_phys_to_virt(vq->shm_io, vq->vq_ring.desc[*avail_idx].addr);
 	*len = vq->vq_ring.desc[*avail_idx].len;
 
@@ -366,6 +595,42 @@ void *virtqueue_get_available_buffer(struct virtqueue *vq, uint16_t * avail_idx,
 	return (buffer);
 }
 
+/**
+ * virtqueue_get_available_buffers - Returns a batch of chains available for
+ *                                   use in the VirtIO queue, reading
+ *                                   avail->idx once
+ *
+ * @param vq                        - Pointer to VirtIO queue control block
+ * @param heads                     - Head descriptor index of each chain
+ * @param max                       - Max number of chains returned
+ *
+ * @return                          - Number of chains returned. Heads are
+ *                                    not checked, the caller must
+ *                                    validate them
+ */
+int virtqueue_get_available_buffers(struct virtqueue *vq, uint16_t *heads,
+				    int max)
+{
+	int i, n;
+
+	VQUEUE_BUSY(vq);
+
+	n = (uint16_t)(vq->vq_ring.avail->idx - vq->vq_available_idx);
+	if (n > max)
+		n = max;
+
+	/* Avail ring entries after the index */
+	atomic_thread_fence(memory_order_acquire);
+
+	for (i = 0; i < n; i++)
+		heads[i] = vq->vq_ring.avail->ring[vq->vq_available_idx++ &
+						   (vq->vq_nentries - 1)];
+
+	VQUEUE_IDLE(vq);
+
+	return n;
+}
+
 /**
  * virtqueue_add_consumed_buffer - Returns consumed buffer back to VirtIO queue
  *
@@ -402,6 +667,47 @@ int virtqueue_add_consumed_buffer(struct virtqueue *vq, uint16_t head_idx,
 	return (VQUEUE_SUCCESS);
 }
 
+/**
+ * virtqueue_add_consumed_buffers - Returns consumed buffers back to VirtIO
+ *                                  queue with a single used->idx update
+ *
+ * @param vq                      - Pointer to VirtIO queue control block
+ * @param used                    - Used ring elements (head index and
+ *                                  length of each consumed chain)
+ * @param n                       - Number of elements in used
+ *
+ * @return                        - Function status
+ */
+int virtqueue_add_consumed_buffers(struct virtqueue *vq,
+				   const struct vring_used_elem *used, int n)
+{
+	uint16_t used_idx;
+	int i;
+
+	if (n > vq->vq_nentries)
+		return (ERROR_VQUEUE_INVLD_PARAM);
+
+	for (i = 0; i < n; i++)
+		if (used[i].id >= vq->vq_nentries)
+			return (ERROR_VRING_NO_BUFF);
+
+	VQUEUE_BUSY(vq);
+
+	used_idx = vq->vq_ring.used->idx;
+	for (i = 0; i < n; i++, used_idx++)
+		vq->vq_ring.used->ring[used_idx & (vq->vq_nentries - 1)] =
+		    used[i];
+
+	/* Used ring entries before the index */
+	atomic_thread_fence(memory_order_release);
+
+	vq->vq_ring.used->idx = used_idx;
+
+	VQUEUE_IDLE(vq);
+
+	return (VQUEUE_SUCCESS);
+}
+
 /**
  * virtqueue_enable_cb  - Enables callback generation
  *
@@ -436,6 +742,134 @@ void virtqueue_disable_cb(struct virtqueue *vq)
 	VQUEUE_IDLE(vq);
 }
 
+/**
+ * virtqueue_postpone_cb - Enables callback generation, postponed as
+ *                         suggested by hint. Only postpones with the
+ *                         EVENT_IDX feature
+ *
+ * @param vq            - Pointer to VirtIO queue control block
+ * @param hint          - How long to postpone: a quarter (SHORT), three
+ *                        quarters (LONG) or all (EMPTIED) of the buffers
+ *                        not used yet
+ *
+ * @return              - 1 if enough buffers are already used
+ */
+int virtqueue_postpone_cb(struct virtqueue *vq, vq_postpone_t hint)
+{
+	uint16_t ndesc;
+
+	ndesc = (uint16_t)(vq->vq_ring.avail->idx - vq->vq_used_cons_idx);
+
+	switch (hint) {
+	case VQ_POSTPONE_SHORT:
+		ndesc = ndesc / 4;
+		break;
+	case VQ_POSTPONE_LONG:
+		ndesc = (ndesc * 3) / 4;
+		break;
+	case VQ_POSTPONE_EMPTIED:
+		/* The interrupt comes when more than ndesc are used */
+		if (ndesc)
+			ndesc--;
+		break;
+	}
+
+	return (vq_ring_enable_interrupt(vq, ndesc));
+}
+
+/**
+ * virtqueue_enable_notify - Device side: asks the other side to notify
+ *                           new available buffers
+ *
+ * @param vq              - Pointer to VirtIO queue control block
+ * @param hint            - When to notify: on the next buffer (SHORT),
+ *                          once three quarters of the ring (LONG) or all
+ *                          of it (EMPTIED) are available. Without the
+ *                          EVENT_IDX feature, LONG and EMPTIED disable
+ *                          notifications. The caller must poll the queue
+ *                          if they can come too late
+ *
+ * @return                - 1 if that many buffers are already available
+ */
+int virtqueue_enable_notify(struct virtqueue *vq, vq_postpone_t hint)
+{
+	uint16_t ndesc = 0;
+
+	switch (hint) {
+	case VQ_POSTPONE_SHORT:
+		ndesc = 0;
+		break;
+	case VQ_POSTPONE_LONG:
+		ndesc = (vq->vq_nentries * 3) / 4;
+		break;
+	case VQ_POSTPONE_EMPTIED:
+		ndesc = vq->vq_nentries - 1;
+		break;
+	}
+
+	VQUEUE_BUSY(vq);
+
+	if (vq->vq_flags & VIRTQUEUE_FLAG_EVENT_IDX)
+		vring_avail_event(&vq->vq_ring) = vq->vq_available_idx + ndesc;
+	else if (hint == VQ_POSTPONE_SHORT)
+		vq->vq_ring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	else
+		vq->vq_ring.used->flags |= VRING_USED_F_NO_NOTIFY;
+
+	/* Published before checking what's available */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	VQUEUE_IDLE(vq);
+
+	return ((uint16_t)(vq->vq_ring.avail->idx - vq->vq_available_idx) >
+		ndesc);
+}
+
+/**
+ * virtqueue_disable_notify - Device side: asks the other side not to
+ *                            notify new available buffers
+ *
+ * @param vq               - Pointer to VirtIO queue control block
+ */
+void virtqueue_disable_notify(struct virtqueue *vq)
+{
+
+	VQUEUE_BUSY(vq);
+
+	if (vq->vq_flags & VIRTQUEUE_FLAG_EVENT_IDX) {
+		vring_avail_event(&vq->vq_ring) =
+		    vq->vq_available_idx - vq->vq_nentries - 1;
+	} else {
+		vq->vq_ring.used->flags |= VRING_USED_F_NO_NOTIFY;
+	}
+
+	VQUEUE_IDLE(vq);
+}
+
+/**
+ * virtqueue_need_interrupt - Device side: tells whether the other side
+ *                            wants to be interrupted for the buffers used
+ *                            since old_idx
+ *
+ * @param vq               - Pointer to VirtIO queue control block
+ * @param old_idx          - used->idx before the buffers were added
+ *
+ * @return                 - 1 if the other side must be interrupted
+ */
+int virtqueue_need_interrupt(struct virtqueue *vq, uint16_t old_idx)
+{
+	uint16_t new_idx = vq->vq_ring.used->idx;
+
+	/* used->idx published before reading what the other side wants */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (vq->vq_flags & VIRTQUEUE_FLAG_EVENT_IDX)
+		return (vring_need_event(vring_used_event(&vq->vq_ring),
+					 new_idx, old_idx) != 0);
+
+	return ((vq->vq_ring.avail->flags & VRING_AVAIL_F_NO_INTERRUPT) == 0);
+}
+
 /**
  * virtqueue_kick - Notifies other side that there is buffer available for it.
  *
@@ -550,6 +984,41 @@ static uint16_t vq_ring_add_buffer(struct virtqueue *vq,
 	return (idx);
 }
 
+/**
+ *
+ * vq_ring_use_indirect
+ *
+ */
+static int vq_ring_use_indirect(struct virtqueue *vq, int needed)
+{
+	return (vq->vq_flags & VIRTQUEUE_FLAG_INDIRECT) && needed > 1 &&
+	    needed <= vq->vq_max_indirect_size;
+}
+
+/**
+ *
+ * vq_ring_add_indirect - the pieces go to the table of the head
+ * descriptor, which alone goes to the ring
+ *
+ */
+static void vq_ring_add_indirect(struct virtqueue *vq, uint16_t head_idx,
+				 struct metal_sg *sg, int readable,
+				 int writable)
+{
+	struct vq_desc_extra *dxp = &vq->vq_descx[head_idx];
+	struct vring_desc *dp = &vq->vq_ring.desc[head_idx];
+	int i, needed = readable + writable;
+
+	/* The table is shared, the other side may have changed it */
+	for (i = 0; i < needed; i++)
+		dxp->indirect[i].next = i + 1;
+	vq_ring_add_buffer(vq, dxp->indirect, 0, sg, readable, writable);
+
+	dp->addr = dxp->indirect_paddr;
+	dp->len = needed * sizeof(struct vring_desc);
+	dp->flags = VRING_DESC_F_INDIRECT;
+}
+
 /**
  *
  * vq_ring_free_chain
@@ -608,6 +1077,10 @@ static void vq_ring_init(struct virtqueue *vq)
 
 	vring_init(vr, size, ring_mem, vq->vq_alignment);
 
+	/* Descriptors belong to the other side */
+	if (vq->vq_flags & VIRTQUEUE_FLAG_DEVICE)
+		return;
+
 	for (i = 0; i < size - 1; i++)
 		vr->desc[i].next = i + 1;
 	vr->desc[i].next = VQ_RING_DESC_CHAIN_END;
@@ -0,0 +1,321 @@
+/*
+ * AF_XDP sockets, see include/xsk.h
+ *
+ * GNU GPLv2 or later
+ */
+#ifdef CONFIG_EBPF
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "logger.h"
+#include "ebpf.h"
+#include "xsk.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSK_TX_FRAMES (XSK_FRAME_NR - XSK_RING_SIZE)
+
+static inline uint32_t ring_load(uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_store(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int xsk_map_ring(struct xsk *x, struct xsk_ring *r,
+			const struct xdp_ring_offset *off, size_t desc_size,
+			off_t pgoff)
+{
+	r->map_size = off->desc + XSK_RING_SIZE * desc_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_POPULATE, x->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		pr_err("%s: mmap: %s\n", __func__, strerror(errno));
+		r->map = NULL;
+		return -1;
+	}
+	r->producer = r->map + off->producer;
+	r->consumer = r->map + off->consumer;
+	r->flags = r->map + off->flags;
+	r->ring = r->map + off->desc;
+	return 0;
+}
+
+static int xsk_setup_rings(struct xsk *x)
+{
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	int size = XSK_RING_SIZE;
+
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+		       sizeof(size)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+		       sizeof(size)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+		pr_err("%s: setsockopt: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		pr_err("%s: getsockopt(XDP_MMAP_OFFSETS): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	if (xsk_map_ring(x, &x->fill, &off.fr, sizeof(uint64_t),
+			 XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+	    xsk_map_ring(x, &x->comp, &off.cr, sizeof(uint64_t),
+			 XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+	    xsk_map_ring(x, &x->rx, &off.rx, sizeof(struct xdp_desc),
+			 XDP_PGOFF_RX_RING) < 0 ||
+	    xsk_map_ring(x, &x->tx, &off.tx, sizeof(struct xdp_desc),
+			 XDP_PGOFF_TX_RING) < 0)
+		return -1;
+	return 0;
+}
+
+static int xsk_setup_umem(struct xsk *x)
+{
+	struct xdp_umem_reg reg;
+	uint64_t *fill;
+	unsigned int i;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uintptr_t)x->umem;
+	reg.len = (uint64_t)XSK_FRAME_NR * XSK_FRAME_SIZE;
+	reg.chunk_size = XSK_FRAME_SIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+		pr_err("%s: setsockopt(XDP_UMEM_REG): %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	if (xsk_setup_rings(x) < 0)
+		return -1;
+	/* First half of the frames goes to the kernel for rx */
+	fill = x->fill.ring;
+	for (i = 0; i < XSK_RING_SIZE; i++)
+		fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+	ring_store(x->fill.producer, XSK_RING_SIZE);
+	for (i = 0; i < XSK_TX_FRAMES; i++)
+		x->tx_free[i] = (uint64_t)(XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+	x->tx_nfree = XSK_TX_FRAMES;
+	return 0;
+}
+
+/*
+ * if (data + ETH_HLEN > data_end || eth->h_proto != htons(eth_type))
+ *	return XDP_PASS;
+ * return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ */
+static int xsk_load_prog(struct xsk *x, uint16_t eth_type)
+{
+	struct bpf_insn prog[] = {
+		BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
+			    offsetof(struct xdp_md, data)),
+		BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_1,
+			    offsetof(struct xdp_md, data_end)),
+		BPF_MOV64_REG(BPF_REG_4, BPF_REG_2),
+		BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, 14),
+		BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 8),
+		BPF_LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, 12),
+		BPF_JMP_IMM(BPF_JNE, BPF_REG_4, htons(eth_type), 6),
+		BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
+			    offsetof(struct xdp_md, rx_queue_index)),
+		BPF_LD_MAP_FD(BPF_REG_1, x->map_fd),
+		BPF_MOV64_IMM(BPF_REG_3, XDP_PASS),
+		BPF_EMIT_CALL(BPF_FUNC_redirect_map),
+		BPF_EXIT_INSN(),
+		/* pass: */
+		BPF_MOV64_IMM(BPF_REG_0, XDP_PASS),
+		BPF_EXIT_INSN(),
+	};
+
+	x->prog_fd = ebpf_prog_load(BPF_PROG_TYPE_XDP, prog,
+				    sizeof(prog) / sizeof(prog[0]));
+	if (x->prog_fd < 0) {
+		pr_err("%s: cannot load xdp program: %s\n", __func__,
+		       strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int xsk_open(struct xsk *x, int ifindex, int queue_id, uint16_t eth_type,
+	     unsigned int flags)
+{
+	struct sockaddr_xdp sxdp;
+	uint32_t key = queue_id;
+	int xdp_flags = flags & XSK_F_DRV ? XDP_FLAGS_DRV_MODE :
+		XDP_FLAGS_SKB_MODE;
+
+	memset(x, 0, sizeof(*x));
+	x->fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+	x->umem = mmap(NULL, (size_t)XSK_FRAME_NR * XSK_FRAME_SIZE,
+		       PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		pr_err("%s: mmap: %s\n", __func__, strerror(errno));
+		x->umem = NULL;
+		return -1;
+	}
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (x->fd < 0) {
+		pr_err("%s: socket: %s\n", __func__, strerror(errno));
+		goto err;
+	}
+	if (xsk_setup_umem(x) < 0)
+		goto err;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue_id;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	/* Generic XDP only works in copy mode */
+	if (!(flags & XSK_F_DRV))
+		sxdp.sxdp_flags |= XDP_COPY;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		pr_err("%s: bind: %s\n", __func__, strerror(errno));
+		goto err;
+	}
+	x->map_fd = ebpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t),
+				    sizeof(uint32_t), queue_id + 1);
+	if (x->map_fd < 0) {
+		pr_err("%s: cannot create xsk map: %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	if (ebpf_map_update(x->map_fd, &key, &x->fd, BPF_ANY) < 0) {
+		pr_err("%s: cannot add xsk to map: %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	if (xsk_load_prog(x, eth_type) < 0)
+		goto err;
+	x->link_fd = ebpf_xdp_attach(x->prog_fd, ifindex, xdp_flags);
+	if (x->link_fd < 0) {
+		pr_err("%s: cannot attach xdp program: %s\n", __func__,
+		       strerror(errno));
+		goto err;
+	}
+	return 0;
+
+err:
+	xsk_close(x);
+	return -1;
+}
+
+static void xsk_unmap_ring(struct xsk_ring *r)
+{
+	if (r->map)
+		munmap(r->map, r->map_size);
+	r->map = NULL;
+}
+
+void xsk_close(struct xsk *x)
+{
+	if (x->link_fd >= 0)
+		close(x->link_fd);
+	if (x->prog_fd >= 0)
+		close(x->prog_fd);
+	if (x->map_fd >= 0)
+		close(x->map_fd);
+	xsk_unmap_ring(&x->fill);
+	xsk_unmap_ring(&x->comp);
+	xsk_unmap_ring(&x->rx);
+	xsk_unmap_ring(&x->tx);
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->umem)
+		munmap(x->umem, (size_t)XSK_FRAME_NR * XSK_FRAME_SIZE);
+	x->fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+	x->umem = NULL;
+}
+
+int xsk_rx(struct xsk *x, xsk_rx_cb cb, void *cb_data)
+{
+	struct xdp_desc *rx = x->rx.ring, *d;
+	uint64_t *fill = x->fill.ring;
+	uint32_t cons, prod, fprod;
+	int n = 0;
+
+	prod = ring_load(x->rx.producer);
+	cons = *x->rx.consumer;
+	fprod = *x->fill.producer;
+	for (; cons != prod; cons++, fprod++, n++) {
+		d = &rx[cons & (XSK_RING_SIZE - 1)];
+		cb(cb_data, x->umem + d->addr, d->len);
+		/*
+		 * Give the frame back to the kernel right away, there's always
+		 * room for it since rx frames are as many as fill ring entries
+		 */
+		fill[fprod & (XSK_RING_SIZE - 1)] = d->addr &
+			~(uint64_t)(XSK_FRAME_SIZE - 1);
+	}
+	if (!n)
+		return 0;
+	ring_store(x->rx.consumer, cons);
+	ring_store(x->fill.producer, fprod);
+	if (ring_load(x->fill.flags) & XDP_RING_NEED_WAKEUP)
+		recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+	return n;
+}
+
+static void xsk_tx_complete(struct xsk *x)
+{
+	uint64_t *comp = x->comp.ring;
+	uint32_t cons, prod;
+
+	prod = ring_load(x->comp.producer);
+	for (cons = *x->comp.consumer; cons != prod; cons++)
+		x->tx_free[x->tx_nfree++] = comp[cons & (XSK_RING_SIZE - 1)];
+	ring_store(x->comp.consumer, cons);
+}
+
+void *xsk_tx_reserve(struct xsk *x)
+{
+	if (!x->tx_nfree)
+		xsk_tx_complete(x);
+	if (!x->tx_nfree)
+		return NULL;
+	return x->umem + x->tx_free[--x->tx_nfree];
+}
+
+void xsk_tx_submit(struct xsk *x, void *buf, unsigned int len)
+{
+	struct xdp_desc *tx = x->tx.ring, *d;
+	uint32_t prod = *x->tx.producer;
+
+	/* tx ring can hold all the tx frames, no need to check for room */
+	d = &tx[prod & (XSK_RING_SIZE - 1)];
+	d->addr = buf - x->umem;
+	d->len = len;
+	d->options = 0;
+	ring_store(x->tx.producer, prod + 1);
+}
+
+void xsk_tx_kick(struct xsk *x)
+{
+	if ((ring_load(x->tx.flags) & XDP_RING_NEED_WAKEUP) &&
+	    sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+		pr_err("%s: sendto: %s\n", __func__, strerror(errno));
+	xsk_tx_complete(x);
+}
+
+#endif /* CONFIG_EBPF */